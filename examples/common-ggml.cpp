@@ -38,7 +38,9 @@ bool ggml_common_quantize_0(
         std::ofstream & fout,
         const ggml_ftype ftype,
         const std::vector<std::string> & to_quant,
-        const std::vector<std::string> & to_skip) {
+        const std::vector<std::string> & to_skip,
+        bool aligned_inp,
+        bool aligned_out) {
 
     ggml_type qtype = GGML_TYPE_F32;
 
@@ -97,6 +99,10 @@ bool ggml_common_quantize_0(
         std::string name(length, 0);
         finp.read (&name[0], length);
 
+        if (aligned_inp) {
+            finp.seekg((GGML_FILE_ALIGN - finp.tellg() % GGML_FILE_ALIGN) % GGML_FILE_ALIGN, std::ios::cur);
+        }
+
         printf("%64s - [%5d, %5d, %5d], type = %6s ", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype));
 
         bool quantize = false;
@@ -154,6 +160,11 @@ bool ggml_common_quantize_0(
         }
         fout.write(&name[0], length);
 
+        if (aligned_out) {
+            const char pad[GGML_FILE_ALIGN] = {};
+            fout.write(pad, (GGML_FILE_ALIGN - fout.tellp() % GGML_FILE_ALIGN) % GGML_FILE_ALIGN);
+        }
+
         if (quantize) {
             work.resize(nelements); // for quantization
 
@@ -187,6 +198,8 @@ bool ggml_common_quantize_0(
                 case GGML_TYPE_I16:
                 case GGML_TYPE_I32:
                 case GGML_TYPE_Q8_1:
+                case GGML_TYPE_Q4_0_X4:
+                case GGML_TYPE_Q8_0_X4:
                 case GGML_TYPE_COUNT:
                     {
                         fprintf(stderr, "%s: unsupported quantization type %d (%s)\n", __func__, ttype, ggml_type_name((ggml_type) ttype));
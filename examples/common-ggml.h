@@ -6,6 +6,11 @@
 #include <vector>
 #include <string>
 
+// model files whose ftype has this flag pad the data of each tensor to GGML_FILE_ALIGN bytes from the start of the
+// file, with zeros after the tensor name, so that the tensors of a mapped file can be used in place
+#define GGML_FILE_FLAG_ALIGNED 0x10000
+#define GGML_FILE_ALIGN        32
+
 enum ggml_ftype ggml_parse_ftype(const char * str);
 
 void ggml_print_ftypes(FILE * fp = stderr);
@@ -15,4 +20,6 @@ bool ggml_common_quantize_0(
         std::ofstream & fout,
         const ggml_ftype ftype,
         const std::vector<std::string> & to_quant,
-        const std::vector<std::string> & to_skip);
+        const std::vector<std::string> & to_skip,
+        bool aligned_inp = false,  // the input has the padding of GGML_FILE_FLAG_ALIGNED
+        bool aligned_out = false); // write the padding of GGML_FILE_FLAG_ALIGNED
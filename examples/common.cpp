@@ -381,70 +381,49 @@ gpt_vocab::id gpt_sample_top_k_top_p(
     return logits_id[idx].second;
 }
 
-bool read_wav(const std::string & fname, std::vector<float>& pcmf32, std::vector<std::vector<float>>& pcmf32s, bool stereo) {
-    drwav wav;
-    std::vector<uint8_t> wav_data; // used for pipe input from stdin
-
-    if (fname == "-") {
-        {
-            uint8_t buf[1024];
-            while (true)
-            {
-                const size_t n = fread(buf, 1, sizeof(buf), stdin);
-                if (n == 0) {
-                    break;
-                }
-                wav_data.insert(wav_data.end(), buf, buf + n);
-            }
-        }
-
-        if (drwav_init_memory(&wav, wav_data.data(), wav_data.size(), nullptr) == false) {
-            fprintf(stderr, "error: failed to open WAV file from stdin\n");
-            return false;
-        }
-
-        fprintf(stderr, "%s: read %zu bytes from stdin\n", __func__, wav_data.size());
-    }
-    else if (drwav_init_file(&wav, fname.c_str(), nullptr) == false) {
-        fprintf(stderr, "error: failed to open '%s' as WAV file\n", fname.c_str());
-        return false;
-    }
-
+// convert the PCM data of an opened WAV file to float
+// data_size is the size of the WAV data in memory (0 - use the length from the WAV header)
+static bool read_wav_pcm(drwav & wav, const std::string & name, size_t data_size, std::vector<float>& pcmf32, std::vector<std::vector<float>>& pcmf32s, bool stereo) {
     if (wav.channels != 1 && wav.channels != 2) {
-        fprintf(stderr, "%s: WAV file '%s' must be mono or stereo\n", __func__, fname.c_str());
+        fprintf(stderr, "%s: WAV file '%s' must be mono or stereo\n", __func__, name.c_str());
+        drwav_uninit(&wav);
         return false;
     }
 
     if (stereo && wav.channels != 2) {
-        fprintf(stderr, "%s: WAV file '%s' must be stereo for diarization\n", __func__, fname.c_str());
+        fprintf(stderr, "%s: WAV file '%s' must be stereo for diarization\n", __func__, name.c_str());
+        drwav_uninit(&wav);
         return false;
     }
 
     if (wav.sampleRate != COMMON_SAMPLE_RATE) {
-        fprintf(stderr, "%s: WAV file '%s' must be %i kHz\n", __func__, fname.c_str(), COMMON_SAMPLE_RATE/1000);
+        fprintf(stderr, "%s: WAV file '%s' must be %i kHz\n", __func__, name.c_str(), COMMON_SAMPLE_RATE/1000);
+        drwav_uninit(&wav);
         return false;
     }
 
     if (wav.bitsPerSample != 16) {
-        fprintf(stderr, "%s: WAV file '%s' must be 16-bit\n", __func__, fname.c_str());
+        fprintf(stderr, "%s: WAV file '%s' must be 16-bit\n", __func__, name.c_str());
+        drwav_uninit(&wav);
         return false;
     }
 
-    const uint64_t n = wav_data.empty() ? wav.totalPCMFrameCount : wav_data.size()/(wav.channels*wav.bitsPerSample/8);
+    // the header of piped WAV data does not always contain the correct length
+    const uint64_t n = data_size == 0 ? wav.totalPCMFrameCount : data_size/(wav.channels*wav.bitsPerSample/8);
 
     std::vector<int16_t> pcm16;
     pcm16.resize(n*wav.channels);
-    drwav_read_pcm_frames_s16(&wav, n, pcm16.data());
+    const uint64_t n_read = drwav_read_pcm_frames_s16(&wav, n, pcm16.data());
     drwav_uninit(&wav);
 
     // convert to mono, float
-    pcmf32.resize(n);
+    pcmf32.resize(n_read);
     if (wav.channels == 1) {
-        for (uint64_t i = 0; i < n; i++) {
+        for (uint64_t i = 0; i < n_read; i++) {
             pcmf32[i] = float(pcm16[i])/32768.0f;
         }
     } else {
-        for (uint64_t i = 0; i < n; i++) {
+        for (uint64_t i = 0; i < n_read; i++) {
             pcmf32[i] = float(pcm16[2*i] + pcm16[2*i + 1])/65536.0f;
         }
     }
@@ -453,9 +432,9 @@ bool read_wav(const std::string & fname, std::vector<float>& pcmf32, std::vector
         // convert to stereo, float
         pcmf32s.resize(2);
 
-        pcmf32s[0].resize(n);
-        pcmf32s[1].resize(n);
-        for (uint64_t i = 0; i < n; i++) {
+        pcmf32s[0].resize(n_read);
+        pcmf32s[1].resize(n_read);
+        for (uint64_t i = 0; i < n_read; i++) {
             pcmf32s[0][i] = float(pcm16[2*i])/32768.0f;
             pcmf32s[1][i] = float(pcm16[2*i + 1])/32768.0f;
         }
@@ -464,6 +443,48 @@ bool read_wav(const std::string & fname, std::vector<float>& pcmf32, std::vector
     return true;
 }
 
+bool read_wav(const std::string & fname, std::vector<float>& pcmf32, std::vector<std::vector<float>>& pcmf32s, bool stereo) {
+    if (fname == "-") {
+        std::vector<uint8_t> wav_data; // used for pipe input from stdin
+
+        {
+            uint8_t buf[1024];
+            while (true)
+            {
+                const size_t n = fread(buf, 1, sizeof(buf), stdin);
+                if (n == 0) {
+                    break;
+                }
+                wav_data.insert(wav_data.end(), buf, buf + n);
+            }
+        }
+
+        fprintf(stderr, "%s: read %zu bytes from stdin\n", __func__, wav_data.size());
+
+        return read_wav_from_memory(wav_data, pcmf32, pcmf32s, stereo);
+    }
+
+    drwav wav;
+
+    if (drwav_init_file(&wav, fname.c_str(), nullptr) == false) {
+        fprintf(stderr, "error: failed to open '%s' as WAV file\n", fname.c_str());
+        return false;
+    }
+
+    return read_wav_pcm(wav, fname, 0, pcmf32, pcmf32s, stereo);
+}
+
+bool read_wav_from_memory(const std::vector<uint8_t> & wav_data, std::vector<float>& pcmf32, std::vector<std::vector<float>>& pcmf32s, bool stereo) {
+    drwav wav;
+
+    if (drwav_init_memory(&wav, wav_data.data(), wav_data.size(), nullptr) == false) {
+        fprintf(stderr, "error: failed to open WAV data from memory\n");
+        return false;
+    }
+
+    return read_wav_pcm(wav, "<memory>", wav_data.size(), pcmf32, pcmf32s, stereo);
+}
+
 void high_pass_filter(std::vector<float> & data, float cutoff, float sample_rate) {
     const float rc = 1.0f / (2.0f * M_PI * cutoff);
     const float dt = 1.0f / sample_rate;
@@ -105,6 +105,13 @@ bool read_wav(
         std::vector<std::vector<float>> & pcmf32s,
         bool stereo);
 
+// Same as read_wav(), but the WAV file is already in memory (e.g. received over the network)
+bool read_wav_from_memory(
+        const std::vector<uint8_t> & wav_data,
+        std::vector<float> & pcmf32,
+        std::vector<std::vector<float>> & pcmf32s,
+        bool stereo);
+
 // Apply a high-pass frequency filter to PCM audio
 // Suppresses frequencies below cutoff Hz
 void high_pass_filter(
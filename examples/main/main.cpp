@@ -57,14 +57,19 @@ struct whisper_params {
     int32_t duration_ms  =  0;
     int32_t max_context  = -1;
     int32_t max_len      =  0;
-    int32_t best_of      =  2;
+    int32_t best_of      =  5;
     int32_t beam_size    = -1;
+    int32_t n_draft      =  4;
+    int32_t n_lang_win   =  1;
 
     float word_thold    =  0.01f;
     float entropy_thold =  2.40f;
     float logprob_thold = -1.00f;
+    float vad_thold     =  0.10f;
 
     bool speed_up       = false;
+    bool audio_ctx_auto = false;
+    bool vad            = false;
     bool translate      = false;
     bool detect_language= false;
     bool diarize        = false;
@@ -81,11 +86,17 @@ struct whisper_params {
     bool print_colors   = false;
     bool print_progress = false;
     bool no_timestamps  = false;
+    bool use_mmap       = false;
+    bool use_mlock      = false;
+    bool kv_q8_0        = false;
+    bool repack         = false;
+    bool flash_attn     = false;
 
     std::string language = "en";
     std::string prompt;
     std::string font_path = "/System/Library/Fonts/Supplemental/Courier New Bold.ttf";
     std::string model    = "models/ggml-base.en.bin";
+    std::string model_draft;
 
     std::vector<std::string> fname_inp = {};
     std::vector<std::string> fname_out = {};
@@ -124,6 +135,9 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-et"   || arg == "--entropy-thold")  { params.entropy_thold  = std::stof(argv[++i]); }
         else if (arg == "-lpt"  || arg == "--logprob-thold")  { params.logprob_thold  = std::stof(argv[++i]); }
         else if (arg == "-su"   || arg == "--speed-up")       { params.speed_up       = true; }
+        else if (arg == "-aca"  || arg == "--audio-ctx-auto") { params.audio_ctx_auto = true; }
+        else if (arg == "-vad"  || arg == "--vad")            { params.vad            = true; }
+        else if (arg == "-vth"  || arg == "--vad-thold")      { params.vad_thold      = std::stof(argv[++i]); }
         else if (arg == "-tr"   || arg == "--translate")      { params.translate      = true; }
         else if (arg == "-di"   || arg == "--diarize")        { params.diarize        = true; }
         else if (arg == "-sow"  || arg == "--split-on-word")  { params.split_on_word  = true; }
@@ -143,8 +157,16 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-nt"   || arg == "--no-timestamps")  { params.no_timestamps  = true; }
         else if (arg == "-l"    || arg == "--language")       { params.language       = argv[++i]; }
         else if (arg == "-dl"   || arg == "--detect-language"){ params.detect_language= true; }
+        else if (arg == "-lw"   || arg == "--lang-windows")   { params.n_lang_win     = std::stoi(argv[++i]); }
+        else if (                  arg == "--mmap")           { params.use_mmap       = true; }
+        else if (                  arg == "--mlock")          { params.use_mlock      = true; }
+        else if (                  arg == "--kv-q8_0")        { params.kv_q8_0        = true; }
+        else if (                  arg == "--repack")         { params.repack         = true; }
+        else if (arg == "-fa"   || arg == "--flash-attn")     { params.flash_attn     = true; }
         else if (                  arg == "--prompt")         { params.prompt         = argv[++i]; }
         else if (arg == "-m"    || arg == "--model")          { params.model          = argv[++i]; }
+        else if (arg == "-md"   || arg == "--model-draft")    { params.model_draft    = argv[++i]; }
+        else if (arg == "-nd"   || arg == "--n-draft")        { params.n_draft        = std::stoi(argv[++i]); }
         else if (arg == "-f"    || arg == "--file")           { params.fname_inp.emplace_back(argv[++i]); }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
@@ -176,6 +198,9 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -et N,     --entropy-thold N   [%-7.2f] entropy threshold for decoder fail\n",           params.entropy_thold);
     fprintf(stderr, "  -lpt N,    --logprob-thold N   [%-7.2f] log probability threshold for decoder fail\n",   params.logprob_thold);
     fprintf(stderr, "  -su,       --speed-up          [%-7s] speed up audio by x2 (reduced accuracy)\n",        params.speed_up ? "true" : "false");
+    fprintf(stderr, "  -aca,      --audio-ctx-auto    [%-7s] size the audio context to the audio length\n",     params.audio_ctx_auto ? "true" : "false");
+    fprintf(stderr, "  -vad,      --vad               [%-7s] skip the silence with voice activity detection\n", params.vad ? "true" : "false");
+    fprintf(stderr, "  -vth N,    --vad-thold N       [%-7.2f] voice activity detection threshold\n",           params.vad_thold);
     fprintf(stderr, "  -tr,       --translate         [%-7s] translate from source language to english\n",      params.translate ? "true" : "false");
     fprintf(stderr, "  -di,       --diarize           [%-7s] stereo audio diarization\n",                       params.diarize ? "true" : "false");
     fprintf(stderr, "  -nf,       --no-fallback       [%-7s] do not use temperature fallback while decoding\n", params.no_fallback ? "true" : "false");
@@ -194,8 +219,16 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -nt,       --no-timestamps     [%-7s] do not print timestamps\n",                        params.no_timestamps ? "true" : "false");
     fprintf(stderr, "  -l LANG,   --language LANG     [%-7s] spoken language ('auto' for auto-detect)\n",       params.language.c_str());
     fprintf(stderr, "  -dl,       --detect-language   [%-7s] exit after automatically detecting language\n",    params.detect_language ? "true" : "false");
+    fprintf(stderr, "  -lw N,     --lang-windows N    [%-7d] number of 30 s windows used to detect the language\n", params.n_lang_win);
     fprintf(stderr, "             --prompt PROMPT     [%-7s] initial prompt\n",                                 params.prompt.c_str());
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
+    fprintf(stderr, "  -md FNAME, --model-draft FNAME [%-7s] draft model path for speculative decoding\n",      params.model_draft.c_str());
+    fprintf(stderr, "  -nd N,     --n-draft N         [%-7d] number of tokens to draft per decoder pass\n",     params.n_draft);
+    fprintf(stderr, "             --mmap              [%-7s] map the model file instead of reading it (see whisper.h for old models)\n",       params.use_mmap ? "true" : "false");
+    fprintf(stderr, "             --mlock             [%-7s] lock the mapped model in memory\n",                params.use_mlock ? "true" : "false");
+    fprintf(stderr, "             --kv-q8_0           [%-7s] store the attention K caches in Q8_0\n",           params.kv_q8_0 ? "true" : "false");
+    fprintf(stderr, "             --repack            [%-7s] interleave Q4_0/Q8_0 weights for fast decoding\n",   params.repack ? "true" : "false");
+    fprintf(stderr, "  -fa,       --flash-attn        [%-7s] use flash attention (less memory)\n",              params.flash_attn ? "true" : "false");
     fprintf(stderr, "  -f FNAME,  --file FNAME        [%-7s] input WAV file path\n",                            "");
     fprintf(stderr, "\n");
 }
@@ -299,9 +332,9 @@ bool output_txt(struct whisper_context * ctx, const char * fname) {
 
     fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
 
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
+    const whisper_result result = whisper_full_get_result(ctx);
+    for (int i = 0; i < result.n_segments; ++i) {
+        const char * text = result.text + result.segments[i].text;
         fout << text << "\n";
     }
 
@@ -319,11 +352,11 @@ bool output_vtt(struct whisper_context * ctx, const char * fname) {
 
     fout << "WEBVTT\n\n";
 
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+    const whisper_result result = whisper_full_get_result(ctx);
+    for (int i = 0; i < result.n_segments; ++i) {
+        const char * text = result.text + result.segments[i].text;
+        const int64_t t0 = result.segments[i].t0;
+        const int64_t t1 = result.segments[i].t1;
 
         fout << to_timestamp(t0) << " --> " << to_timestamp(t1) << "\n";
         fout << text << "\n\n";
@@ -341,11 +374,11 @@ bool output_srt(struct whisper_context * ctx, const char * fname, const whisper_
 
     fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
 
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+    const whisper_result result = whisper_full_get_result(ctx);
+    for (int i = 0; i < result.n_segments; ++i) {
+        const char * text = result.text + result.segments[i].text;
+        const int64_t t0 = result.segments[i].t0;
+        const int64_t t1 = result.segments[i].t1;
 
         fout << i + 1 + params.offset_n << "\n";
         fout << to_timestamp(t0, true) << " --> " << to_timestamp(t1, true) << "\n";
@@ -395,12 +428,12 @@ bool output_csv(struct whisper_context * ctx, const char * fname) {
 
     fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const whisper_result result = whisper_full_get_result(ctx);
     fout << "start,end,text\n";
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+    for (int i = 0; i < result.n_segments; ++i) {
+        const char * text = result.text + result.segments[i].text;
+        const int64_t t0 = result.segments[i].t0;
+        const int64_t t1 = result.segments[i].t1;
         char * text_escaped = escape_double_quotes_and_backslashes(text);
 
         //need to multiply times returned from whisper_full_get_segment_t{0,1}() by 10 to get milliseconds.
@@ -511,11 +544,11 @@ bool output_json(struct whisper_context * ctx, const char * fname, const whisper
         end_obj();
         start_arr("transcription");
 
-            const int n_segments = whisper_full_n_segments(ctx);
-            for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const whisper_result result = whisper_full_get_result(ctx);
+            for (int i = 0; i < result.n_segments; ++i) {
+                const char * text = result.text + result.segments[i].text;
+                const int64_t t0 = result.segments[i].t0;
+                const int64_t t1 = result.segments[i].t1;
 
                 start_obj();
                     start_obj("timestamps");
@@ -527,7 +560,7 @@ bool output_json(struct whisper_context * ctx, const char * fname, const whisper
                         value_i("to", t1 * 10, true);
                     end_obj();
                     value_s("text", text, true);
-                end_obj(i == (n_segments - 1));
+                end_obj(i == (result.n_segments - 1));
             }
 
         end_arr(true);
@@ -664,10 +697,10 @@ bool output_lrc(struct whisper_context * ctx, const char * fname) {
 
     fout << "[by:whisper.cpp]\n";
 
-    const int n_segments = whisper_full_n_segments(ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t = whisper_full_get_segment_t0(ctx, i);
+    const whisper_result result = whisper_full_get_result(ctx);
+    for (int i = 0; i < result.n_segments; ++i) {
+        const char * text = result.text + result.segments[i].text;
+        const int64_t t = result.segments[i].t0;
 
         int64_t msec = t * 10;
         int64_t min = msec / (1000 * 60);
@@ -706,13 +739,32 @@ int main(int argc, char ** argv) {
 
     // whisper init
 
-    struct whisper_context * ctx = whisper_init_from_file(params.model.c_str());
+    whisper_context_params cparams = whisper_context_default_params();
+
+    cparams.use_mmap   = params.use_mmap;
+    cparams.use_mlock  = params.use_mlock;
+    cparams.kv_q8_0    = params.kv_q8_0;
+    cparams.repack     = params.repack;
+    cparams.flash_attn = params.flash_attn;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
 
     if (ctx == nullptr) {
         fprintf(stderr, "error: failed to initialize whisper context\n");
         return 3;
     }
 
+    struct whisper_context * ctx_draft = nullptr;
+
+    if (!params.model_draft.empty()) {
+        ctx_draft = whisper_init_from_file_with_params(params.model_draft.c_str(), cparams);
+
+        if (ctx_draft == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper context for the draft model\n");
+            return 3;
+        }
+    }
+
     for (int f = 0; f < (int) params.fname_inp.size(); ++f) {
         const auto fname_inp = params.fname_inp[f];
 		const auto fname_out = f < (int) params.fname_out.size() && !params.fname_out[f].empty() ? params.fname_out[f] : params.fname_inp[f];
@@ -768,6 +820,7 @@ int main(int argc, char ** argv) {
             wparams.translate        = params.translate;
             wparams.language         = params.language.c_str();
             wparams.detect_language  = params.detect_language;
+            wparams.detect_language_n_windows = params.n_lang_win;
             wparams.n_threads        = params.n_threads;
             wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
             wparams.offset_ms        = params.offset_t_ms;
@@ -779,12 +832,18 @@ int main(int argc, char ** argv) {
             wparams.split_on_word    = params.split_on_word;
 
             wparams.speed_up         = params.speed_up;
+            wparams.audio_ctx_auto   = params.audio_ctx_auto;
+            wparams.vad              = params.vad;
+            wparams.vad_thold        = params.vad_thold;
 
             wparams.initial_prompt   = params.prompt.c_str();
 
             wparams.greedy.best_of        = params.best_of;
             wparams.beam_search.beam_size = params.beam_size;
 
+            wparams.draft.ctx     = ctx_draft;
+            wparams.draft.n_draft = params.n_draft;
+
             wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
             wparams.entropy_thold    = params.entropy_thold;
             wparams.logprob_thold    = params.logprob_thold;
@@ -866,6 +925,7 @@ int main(int argc, char ** argv) {
 
     whisper_print_timings(ctx);
     whisper_free(ctx);
+    whisper_free(ctx_draft);
 
     return 0;
 }
@@ -67,6 +67,8 @@ bool whisper_model_quantize(const std::string & fname_inp, const std::string & f
 
     whisper_hparams hparams;
 
+    bool aligned_src = false;
+
     // load hparams
     {
         finp.read((char *) &hparams.n_vocab,       sizeof(hparams.n_vocab));
@@ -81,8 +83,12 @@ bool whisper_model_quantize(const std::string & fname_inp, const std::string & f
         finp.read((char *) &hparams.n_mels,        sizeof(hparams.n_mels));
         finp.read((char *) &hparams.ftype,         sizeof(hparams.ftype));
 
+        aligned_src = hparams.ftype & GGML_FILE_FLAG_ALIGNED;
+
+        hparams.ftype &= ~GGML_FILE_FLAG_ALIGNED;
+
         const int32_t qntvr_src =    hparams.ftype / GGML_QNT_VERSION_FACTOR;
-        const int32_t ftype_dst = GGML_QNT_VERSION * GGML_QNT_VERSION_FACTOR + ftype;
+        const int32_t ftype_dst = GGML_QNT_VERSION * GGML_QNT_VERSION_FACTOR + ftype + GGML_FILE_FLAG_ALIGNED;
 
         fprintf(stderr, "%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
         fprintf(stderr, "%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
@@ -96,6 +102,7 @@ bool whisper_model_quantize(const std::string & fname_inp, const std::string & f
         fprintf(stderr, "%s: n_mels        = %d\n", __func__, hparams.n_mels);
         fprintf(stderr, "%s: ftype (src)   = %d\n", __func__, hparams.ftype);
         fprintf(stderr, "%s: qntvr (src)   = %d\n", __func__, qntvr_src);
+        fprintf(stderr, "%s: aligned (src) = %d\n", __func__, aligned_src);
         fprintf(stderr, "%s: ftype (dst)   = %d\n", __func__, ftype_dst);
         fprintf(stderr, "%s: qntvr (dst)   = %d\n", __func__, GGML_QNT_VERSION);
 
@@ -162,7 +169,7 @@ bool whisper_model_quantize(const std::string & fname_inp, const std::string & f
         "decoder.positional_embedding",
     };
 
-    if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, to_skip)) {
+    if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, to_skip, aligned_src, true)) {
         fprintf(stderr, "%s: failed to quantize model '%s'\n", __func__, fname_inp.c_str());
         return false;
     }
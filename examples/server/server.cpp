@@ -0,0 +1,631 @@
+// HTTP transcription server
+//
+// Loads the model once and transcribes the audio uploaded over HTTP, using a fixed number of whisper states that
+// share the weights. The segments are streamed back to the client as they are decoded.
+
+#include "common.h"
+#include "whisper.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// command-line parameters
+struct whisper_params {
+    int32_t n_threads   = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    int32_t n_states    = 2;
+    int32_t n_queue     = 16;
+    int32_t max_conn    = 32;
+    int32_t port        = 8080;
+    int32_t max_body_mb = 100;
+
+    bool translate = false;
+    bool use_mmap  = false;
+
+    std::string host     = "127.0.0.1";
+    std::string language = "en";
+    std::string model    = "models/ggml-base.en.bin";
+};
+
+void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
+
+bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            whisper_print_usage(argc, argv, params);
+            exit(0);
+        }
+        else if (arg == "-t"  || arg == "--threads")     { params.n_threads   = std::stoi(argv[++i]); }
+        else if (arg == "-s"  || arg == "--states")      { params.n_states    = std::stoi(argv[++i]); }
+        else if (arg == "-q"  || arg == "--queue")       { params.n_queue     = std::stoi(argv[++i]); }
+        else if (arg == "-c"  || arg == "--max-conn")    { params.max_conn    = std::stoi(argv[++i]); }
+        else if (                arg == "--host")        { params.host        = argv[++i]; }
+        else if (                arg == "--port")        { params.port        = std::stoi(argv[++i]); }
+        else if (                arg == "--max-body-mb") { params.max_body_mb = std::stoi(argv[++i]); }
+        else if (arg == "-tr" || arg == "--translate")   { params.translate   = true; }
+        else if (                arg == "--mmap")        { params.use_mmap    = true; }
+        else if (arg == "-l"  || arg == "--language")    { params.language    = argv[++i]; }
+        else if (arg == "-m"  || arg == "--model")       { params.model       = argv[++i]; }
+        else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            whisper_print_usage(argc, argv, params);
+            exit(0);
+        }
+    }
+
+    return true;
+}
+
+void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,       --help          [default] show this help message and exit\n");
+    fprintf(stderr, "  -t N,     --threads N     [%-7d] number of threads to use for each request\n",   params.n_threads);
+    fprintf(stderr, "  -s N,     --states N      [%-7d] number of requests processed concurrently\n",   params.n_states);
+    fprintf(stderr, "  -q N,     --queue N       [%-7d] maximum number of waiting requests\n",          params.n_queue);
+    fprintf(stderr, "  -c N,     --max-conn N    [%-7d] maximum number of open connections\n",          params.max_conn);
+    fprintf(stderr, "            --host HOST     [%-7s] address to listen on\n",                        params.host.c_str());
+    fprintf(stderr, "            --port N        [%-7d] port to listen on\n",                           params.port);
+    fprintf(stderr, "            --max-body-mb N [%-7d] maximum size of the uploaded audio in MB\n",    params.max_body_mb);
+    fprintf(stderr, "  -tr,      --translate     [%-7s] translate from source language to english\n",   params.translate ? "true" : "false");
+    fprintf(stderr, "            --mmap          [%-7s] map the model file instead of reading it (see whisper.h for old models)\n",    params.use_mmap ? "true" : "false");
+    fprintf(stderr, "  -l LANG,  --language LANG [%-7s] default spoken language ('auto' for auto-detect)\n", params.language.c_str());
+    fprintf(stderr, "  -m FNAME, --model FNAME   [%-7s] model path\n",                                  params.model.c_str());
+    fprintf(stderr, "\n");
+}
+
+//
+// HTTP
+//
+
+struct http_request {
+    std::string method;
+    std::string path;
+
+    std::map<std::string, std::string> query;
+    std::map<std::string, std::string> headers; // lower-case names
+
+    std::vector<uint8_t> body;
+};
+
+static bool send_all(int fd, const char * data, size_t size) {
+    while (size > 0) {
+        const ssize_t n = send(fd, data, size, 0);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool send_all(int fd, const std::string & data) {
+    return send_all(fd, data.data(), data.size());
+}
+
+static bool send_response(int fd, int status, const char * reason, const std::string & body) {
+    std::string res;
+
+    res += "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n";
+    res += "Content-Type: text/plain\r\n";
+    res += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    res += "Connection: close\r\n";
+    res += "\r\n";
+    res += body;
+
+    return send_all(fd, res);
+}
+
+// check if the client closed the connection, without blocking
+static bool is_disconnected(int fd) {
+    char c;
+    const ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+// write a chunk of a response with "Transfer-Encoding: chunked" (an empty chunk terminates the response)
+static bool send_chunk(int fd, const std::string & data) {
+    char size[32];
+    snprintf(size, sizeof(size), "%zx\r\n", data.size());
+
+    return send_all(fd, size) && send_all(fd, data) && send_all(fd, "\r\n");
+}
+
+static std::string url_decode(const std::string & s) {
+    std::string res;
+
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '%' && i + 2 < s.size() && isxdigit(s[i + 1]) && isxdigit(s[i + 2])) {
+            res += (char) std::stoi(s.substr(i + 1, 2), nullptr, 16);
+            i += 2;
+        } else if (s[i] == '+') {
+            res += ' ';
+        } else {
+            res += s[i];
+        }
+    }
+
+    return res;
+}
+
+// returns the HTTP status code to reply with on failure, or 0 on success
+static int read_request(int fd, size_t max_body, http_request & req) {
+    std::string head;
+
+    char buf[4096];
+
+    // read until the end of the headers
+    size_t pos_end;
+    while ((pos_end = head.find("\r\n\r\n")) == std::string::npos) {
+        if (head.size() > 16*1024) {
+            return 431;
+        }
+
+        const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            return 400;
+        }
+        head.append(buf, n);
+    }
+
+    // the part of the body received together with the headers
+    req.body.assign(head.begin() + pos_end + 4, head.end());
+    head.resize(pos_end);
+
+    // request line: METHOD /path?query HTTP/1.1
+    {
+        const size_t p0 = head.find(' ');
+        const size_t p1 = head.find(' ', p0 + 1);
+        const size_t p2 = head.find("\r\n");
+        if (p0 == std::string::npos || p1 == std::string::npos || p1 > p2) {
+            return 400;
+        }
+
+        req.method = head.substr(0, p0);
+
+        const std::string target = head.substr(p0 + 1, p1 - p0 - 1);
+        const size_t pq = target.find('?');
+
+        req.path = target.substr(0, pq);
+
+        if (pq != std::string::npos) {
+            size_t p = pq + 1;
+            while (p < target.size()) {
+                size_t pa = target.find('&', p);
+                if (pa == std::string::npos) {
+                    pa = target.size();
+                }
+
+                const std::string kv = target.substr(p, pa - p);
+                const size_t pe = kv.find('=');
+                if (pe == std::string::npos) {
+                    req.query[url_decode(kv)] = "";
+                } else {
+                    req.query[url_decode(kv.substr(0, pe))] = url_decode(kv.substr(pe + 1));
+                }
+
+                p = pa + 1;
+            }
+        }
+
+        head.erase(0, p2 == std::string::npos ? head.size() : p2 + 2);
+    }
+
+    // headers
+    {
+        size_t p = 0;
+        while (p < head.size()) {
+            size_t pn = head.find("\r\n", p);
+            if (pn == std::string::npos) {
+                pn = head.size();
+            }
+
+            const std::string line = head.substr(p, pn - p);
+            const size_t pc = line.find(':');
+            if (pc != std::string::npos) {
+                std::string name  = line.substr(0, pc);
+                std::string value = line.substr(pc + 1);
+
+                std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+                req.headers[name] = trim(value);
+            }
+
+            p = pn + 2;
+        }
+    }
+
+    if (req.method != "POST") {
+        return 0;
+    }
+
+    if (req.headers.count("content-length") == 0) {
+        return 411;
+    }
+
+    size_t n_body = 0;
+    try {
+        n_body = std::stoull(req.headers["content-length"]);
+    } catch (...) {
+        return 400;
+    }
+
+    if (n_body > max_body) {
+        return 413;
+    }
+
+    while (req.body.size() < n_body) {
+        const ssize_t n = recv(fd, buf, std::min(sizeof(buf), n_body - req.body.size()), 0);
+        if (n <= 0) {
+            return 400;
+        }
+        req.body.insert(req.body.end(), buf, buf + n);
+    }
+
+    req.body.resize(n_body);
+
+    return 0;
+}
+
+static const char * http_reason(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 411: return "Length Required";
+        case 413: return "Payload Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case 503: return "Service Unavailable";
+        default:  return "Error";
+    }
+}
+
+//
+// Transcription
+//
+
+static std::string json_escape(const char * str) {
+    std::string res;
+
+    for (const char * p = str; *p; ++p) {
+        switch (*p) {
+            case '"':  res += "\\\""; break;
+            case '\\': res += "\\\\"; break;
+            case '\n': res += "\\n";  break;
+            case '\r': res += "\\r";  break;
+            case '\t': res += "\\t";  break;
+            default:
+                if ((unsigned char) *p < 0x20) {
+                    char tmp[8];
+                    snprintf(tmp, sizeof(tmp), "\\u%04x", *p);
+                    res += tmp;
+                } else {
+                    res += *p;
+                }
+        }
+    }
+
+    return res;
+}
+
+// a request being processed by the pool
+// the whisper callbacks run in the worker thread of the pool, the connection thread writes the lines to the socket
+struct server_job {
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::deque<std::string> lines; // JSON lines not sent yet
+
+    bool done   = false;
+    int  result = 0;
+
+    std::string language; // referenced by the whisper_full_params of the job
+};
+
+static void server_new_segment(struct whisper_context * /*ctx*/, struct whisper_state * state, int n_new, void * user_data) {
+    server_job * job = (server_job *) user_data;
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
+
+    std::lock_guard<std::mutex> lock(job->mutex);
+
+    for (int i = n_segments - n_new; i < n_segments; ++i) {
+        const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+        const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
+
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
+
+        job->lines.push_back(
+            "{\"t0\": " + std::to_string(10*t0) + ", \"t1\": " + std::to_string(10*t1) + ", \"text\": \"" + json_escape(text) + "\"}\n");
+    }
+
+    job->cv.notify_one();
+}
+
+static void server_job_done(struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, int /*job_id*/, int result, void * user_data) {
+    server_job * job = (server_job *) user_data;
+
+    std::lock_guard<std::mutex> lock(job->mutex);
+
+    job->done   = true;
+    job->result = result;
+
+    job->cv.notify_one();
+}
+
+// the body is either a WAV file or raw 16-bit mono PCM at 16 kHz
+static bool decode_audio(const std::vector<uint8_t> & body, std::vector<float> & pcmf32) {
+    if (body.size() >= 4 && memcmp(body.data(), "RIFF", 4) == 0) {
+        std::vector<std::vector<float>> pcmf32s;
+        return read_wav_from_memory(body, pcmf32, pcmf32s, false) && !pcmf32.empty();
+    }
+
+    const size_t n = body.size()/2;
+
+    pcmf32.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        const int16_t s = (int16_t) (body[2*i] | (body[2*i + 1] << 8));
+        pcmf32[i] = float(s)/32768.0f;
+    }
+
+    return n > 0;
+}
+
+static void handle_inference(int fd, whisper_pool * pool, const whisper_params & params, const http_request & req) {
+    std::vector<float> pcmf32;
+    if (!decode_audio(req.body, pcmf32)) {
+        send_response(fd, 400, http_reason(400), "expected a 16 kHz 16-bit WAV file or raw 16-bit mono PCM\n");
+        return;
+    }
+
+    server_job job;
+
+    job.language = req.query.count("language") ? req.query.at("language") : params.language;
+
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    wparams.print_realtime   = false;
+    wparams.print_progress   = false;
+    wparams.print_timestamps = false;
+    wparams.print_special    = false;
+    wparams.translate        = req.query.count("translate") ? req.query.at("translate") != "0" : params.translate;
+    wparams.language         = job.language.c_str();
+    wparams.n_threads        = params.n_threads;
+
+    wparams.new_segment_callback           = server_new_segment;
+    wparams.new_segment_callback_user_data = &job;
+
+    const int job_id = whisper_pool_submit(pool, wparams, pcmf32.data(), pcmf32.size(), server_job_done, &job);
+    if (job_id < 0) {
+        send_response(fd, 503, http_reason(503), "too many requests in the queue\n");
+        return;
+    }
+
+    fprintf(stderr, "%s: job %d: %.1f sec of audio, language = %s\n", __func__, job_id, float(pcmf32.size())/WHISPER_SAMPLE_RATE, job.language.c_str());
+
+    bool ok = send_all(fd,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/x-ndjson\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Connection: close\r\n"
+            "\r\n");
+
+    bool cancelled = false;
+
+    // the job must be done before returning, since the pool references it
+    while (true) {
+        std::deque<std::string> lines;
+        bool done;
+
+        {
+            std::unique_lock<std::mutex> lock(job.mutex);
+            job.cv.wait_for(lock, std::chrono::milliseconds(100), [&job] { return job.done || !job.lines.empty(); });
+
+            lines.swap(job.lines);
+            done = job.done;
+        }
+
+        for (const auto & line : lines) {
+            if (ok && !send_chunk(fd, line)) {
+                ok = false;
+            }
+        }
+
+        if (ok && !done && is_disconnected(fd)) {
+            ok = false;
+        }
+
+        if (!ok && !cancelled) {
+            // the client went away - stop the transcription
+            cancelled = true;
+            whisper_pool_cancel(pool, job_id);
+        }
+
+        if (done) {
+            break;
+        }
+    }
+
+    fprintf(stderr, "%s: job %d: done, result = %d\n", __func__, job_id, job.result);
+
+    if (ok) {
+        send_chunk(fd, "{\"result\": " + std::to_string(job.result) + "}\n") && send_chunk(fd, "");
+    }
+}
+
+static void handle_connection(int fd, whisper_pool * pool, const whisper_params & params) {
+    http_request req;
+
+    const int status = read_request(fd, (size_t) params.max_body_mb*1024*1024, req);
+
+    if (status != 0) {
+        send_response(fd, status, http_reason(status), std::string(http_reason(status)) + "\n");
+    } else if (req.path == "/inference") {
+        if (req.method == "POST") {
+            handle_inference(fd, pool, params, req);
+        } else {
+            send_response(fd, 405, http_reason(405), "use POST\n");
+        }
+    } else if (req.path == "/" && req.method == "GET") {
+        send_response(fd, 200, http_reason(200),
+                "POST /inference?language=LANG&translate=0|1 with a 16 kHz WAV file or raw 16-bit mono PCM as body\n"
+                "The segments are returned as JSON lines: {\"t0\": ms, \"t1\": ms, \"text\": \"...\"}\n");
+    } else {
+        send_response(fd, 404, http_reason(404), "not found\n");
+    }
+
+    close(fd);
+}
+
+int main(int argc, char ** argv) {
+    whisper_params params;
+
+    if (whisper_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.language != "auto" && whisper_lang_id(params.language.c_str()) == -1) {
+        fprintf(stderr, "error: unknown language '%s'\n", params.language.c_str());
+        whisper_print_usage(argc, argv, params);
+        exit(0);
+    }
+
+    // writing to a closed connection must not terminate the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // whisper init
+
+    whisper_context_params cparams = whisper_context_default_params();
+
+    cparams.use_mmap = params.use_mmap;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    struct whisper_pool * pool = whisper_pool_init(ctx, params.n_states, params.n_queue);
+    if (pool == nullptr) {
+        fprintf(stderr, "error: failed to initialize the state pool\n");
+        whisper_free(ctx);
+        return 3;
+    }
+
+    // listen
+
+    const int fd_listen = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_listen < 0) {
+        fprintf(stderr, "error: failed to create socket: %s\n", strerror(errno));
+        return 4;
+    }
+
+    {
+        const int one = 1;
+        setsockopt(fd_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+
+    struct sockaddr_in addr = {};
+
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(params.port);
+
+    if (inet_pton(AF_INET, params.host.c_str(), &addr.sin_addr) != 1) {
+        fprintf(stderr, "error: invalid host address '%s'\n", params.host.c_str());
+        return 4;
+    }
+
+    if (bind(fd_listen, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd_listen, 64) != 0) {
+        fprintf(stderr, "error: failed to listen on %s:%d: %s\n", params.host.c_str(), params.port, strerror(errno));
+        return 4;
+    }
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: listening on http://%s:%d with %d states, %d threads per request\n",
+            __func__, params.host.c_str(), params.port, params.n_states, params.n_threads);
+
+    // number of connections being handled, each one buffers up to max_body_mb of audio
+    // the pool and the context are freed only after the last handler is done with them
+    std::mutex              conn_mutex;
+    std::condition_variable conn_cv;
+    int                     n_conn = 0;
+
+    while (true) {
+        const int fd = accept(fd_listen, nullptr, nullptr);
+        if (fd < 0) {
+            // the connection was reset before it was accepted, or the server is out of descriptors for now
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                fprintf(stderr, "warning: accept failed: %s, retrying\n", strerror(errno));
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            fprintf(stderr, "error: accept failed: %s\n", strerror(errno));
+            break;
+        }
+
+        bool refused;
+
+        {
+            std::lock_guard<std::mutex> lock(conn_mutex);
+
+            refused = n_conn >= params.max_conn;
+            if (!refused) {
+                ++n_conn;
+            }
+        }
+
+        // refuse before reading the request
+        if (refused) {
+            send_response(fd, 503, http_reason(503), "too many connections\n");
+            close(fd);
+            continue;
+        }
+
+        std::thread([fd, pool, params, &conn_mutex, &conn_cv, &n_conn]() {
+            handle_connection(fd, pool, params);
+
+            std::lock_guard<std::mutex> lock(conn_mutex);
+            --n_conn;
+            conn_cv.notify_one();
+        }).detach();
+    }
+
+    close(fd_listen);
+
+    {
+        std::unique_lock<std::mutex> lock(conn_mutex);
+        conn_cv.wait(lock, [&n_conn] { return n_conn == 0; });
+    }
+
+    whisper_pool_free(pool);
+    whisper_free(ctx);
+
+    return 0;
+}
@@ -139,6 +139,11 @@ int main(int argc, char ** argv) {
     params.no_context    |= use_vad;
     params.max_tokens     = 0;
 
+    if (!use_vad && params.speed_up) {
+        fprintf(stderr, "%s: WARNING: speed up is not supported in sliding window mode, ignoring\n", __func__);
+        params.speed_up = false;
+    }
+
     // init audio
 
     audio_async audio(params.length_ms);
@@ -160,9 +165,12 @@ int main(int argc, char ** argv) {
     struct whisper_context * ctx = whisper_init_from_file(params.model.c_str());
 
     std::vector<float> pcmf32    (n_samples_30s, 0.0f);
-    std::vector<float> pcmf32_old;
     std::vector<float> pcmf32_new(n_samples_30s, 0.0f);
 
+    // in sliding window mode, the mel spectrogram of the new audio is computed incrementally and
+    // the window only tracks how many of the previous samples to reuse
+    int n_samples_old = 0;
+
     std::vector<whisper_token> prompt_tokens;
 
     // print some info about the processing
@@ -246,19 +254,17 @@ int main(int argc, char ** argv) {
             const int n_samples_new = pcmf32_new.size();
 
             // take up to params.length_ms audio from previous iteration
-            const int n_samples_take = std::min((int) pcmf32_old.size(), std::max(0, n_samples_keep + n_samples_len - n_samples_new));
-
-            //printf("processing: take = %d, new = %d, old = %d\n", n_samples_take, n_samples_new, (int) pcmf32_old.size());
+            const int n_samples_take = std::min(n_samples_old, std::max(0, n_samples_keep + n_samples_len - n_samples_new));
 
-            pcmf32.resize(n_samples_new + n_samples_take);
+            //printf("processing: take = %d, new = %d, old = %d\n", n_samples_take, n_samples_new, n_samples_old);
 
-            for (int i = 0; i < n_samples_take; i++) {
-                pcmf32[i] = pcmf32_old[pcmf32_old.size() - n_samples_take + i];
+            if (whisper_mel_stream_append(ctx, pcmf32_new.data(), n_samples_new, params.n_threads) != 0 ||
+                whisper_mel_stream_window(ctx, n_samples_take + n_samples_new) != 0) {
+                fprintf(stderr, "%s: failed to compute log mel spectrogram\n", argv[0]);
+                return 6;
             }
 
-            memcpy(pcmf32.data() + n_samples_take, pcmf32_new.data(), n_samples_new*sizeof(float));
-
-            pcmf32_old = pcmf32;
+            n_samples_old = n_samples_take + n_samples_new;
         } else {
             const auto t_now  = std::chrono::high_resolution_clock::now();
             const auto t_diff = std::chrono::duration_cast<std::chrono::milliseconds>(t_now - t_last).count();
@@ -306,7 +312,11 @@ int main(int argc, char ** argv) {
             wparams.prompt_tokens    = params.no_context ? nullptr : prompt_tokens.data();
             wparams.prompt_n_tokens  = params.no_context ? 0       : prompt_tokens.size();
 
-            if (whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+            // in sliding window mode, the spectrogram of the window is already set in the context
+            const int ret = use_vad ? whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size())
+                                    : whisper_full_from_mel(ctx, wparams);
+
+            if (ret != 0) {
                 fprintf(stderr, "%s: failed to process audio\n", argv[0]);
                 return 6;
             }
@@ -368,7 +378,7 @@ int main(int argc, char ** argv) {
                 printf("\n");
 
                 // keep part of the audio for next iteration to try to mitigate word boundary issues
-                pcmf32_old = std::vector<float>(pcmf32.end() - n_samples_keep, pcmf32.end());
+                n_samples_old = std::min(n_samples_old, n_samples_keep);
 
                 // Add tokens of the last full length segment as the prompt
                 if (!params.no_context) {
@@ -71,6 +71,51 @@ static int sched_yield (void) {
     Sleep (0);
     return 0;
 }
+
+typedef CRITICAL_SECTION   pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+static int pthread_mutex_init(pthread_mutex_t * mutex, void * unused) {
+    (void) unused;
+    InitializeCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_destroy(pthread_mutex_t * mutex) {
+    DeleteCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_lock(pthread_mutex_t * mutex) {
+    EnterCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_unlock(pthread_mutex_t * mutex) {
+    LeaveCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_cond_init(pthread_cond_t * cond, void * unused) {
+    (void) unused;
+    InitializeConditionVariable(cond);
+    return 0;
+}
+
+static int pthread_cond_destroy(pthread_cond_t * cond) {
+    (void) cond;
+    return 0;
+}
+
+static int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+    return 0;
+}
+
+static int pthread_cond_broadcast(pthread_cond_t * cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
 #else
 #include <pthread.h>
 #include <stdatomic.h>
@@ -103,6 +148,21 @@ typedef void* thread_ret_t;
 #define GGML_SOFT_MAX_UNROLL 4
 #define GGML_VEC_DOT_UNROLL  2
 
+// register tile of the F16 x F32 matrix multiplication: GGML_MUL_MAT_MR rows of src0 x GGML_MUL_MAT_NR columns of src1
+// the tiled path is used when src1 has at least GGML_MUL_MAT_TILE_NE11 columns and processes the rows of src0 in
+// blocks of GGML_MUL_MAT_MC rows that stay in cache while the columns of src1 are streamed once per block
+#define GGML_MUL_MAT_MR         4
+#define GGML_MUL_MAT_NR         3
+#define GGML_MUL_MAT_MC         16
+#define GGML_MUL_MAT_TILE_NE11  32
+
+// number of q rows that ggml_flash_attn processes together with the F16 kernel (a multiple of GGML_MUL_MAT_NR)
+#define GGML_FLASH_ATTN_BQ 12
+
+// the conversion of src1 in the INIT phase of the F16 and quantized matrix multiplications is split across the
+// threads when src1 has at least GGML_MUL_MAT_INIT_NROWS rows
+#define GGML_MUL_MAT_INIT_NROWS 32
+
 #ifdef GGML_USE_ACCELERATE
 // uncomment to use vDSP for soft max computation
 // note: not sure if it is actually faster
@@ -813,6 +873,29 @@ typedef struct {
 } block_q8_1;
 static_assert(sizeof(block_q8_1) == 2*sizeof(float) + QK8_1, "wrong q8_1 block size/padding");
 
+// the same block of 4 consecutive rows, interleaved by ggml_repack()
+#define GGML_REPACK_NROWS 4
+typedef struct {
+    ggml_fp16_t d[GGML_REPACK_NROWS];               // deltas
+    uint8_t qs[GGML_REPACK_NROWS * QK4_0 / 2];      // nibbles / quants
+} block_q4_0x4;
+static_assert(sizeof(block_q4_0x4) == GGML_REPACK_NROWS * sizeof(block_q4_0), "wrong q4_0x4 block size/padding");
+
+typedef struct {
+    ggml_fp16_t d[GGML_REPACK_NROWS];               // deltas
+    int8_t  qs[GGML_REPACK_NROWS * QK8_0];          // quants
+} block_q8_0x4;
+static_assert(sizeof(block_q8_0x4) == GGML_REPACK_NROWS * sizeof(block_q8_0), "wrong q8_0x4 block size/padding");
+
+// the type of the rows that were interleaved into a repacked type
+static inline enum ggml_type ggml_repack_row_type(enum ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_Q4_0_X4: return GGML_TYPE_Q4_0;
+        case GGML_TYPE_Q8_0_X4: return GGML_TYPE_Q8_0;
+        default:                return type;
+    }
+}
+
 // reference implementation for deterministic creation of model files
 static void quantize_row_q4_0_reference(const float * restrict x, block_q4_0 * restrict y, int k) {
     static const int qk = QK4_0;
@@ -1513,6 +1596,8 @@ static void ggml_vec_dot_q4_1_q8_1(const int n, float * restrict s, const void *
 static void ggml_vec_dot_q5_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 static void ggml_vec_dot_q5_1_q8_1(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 static void ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+static void ggml_vec_dot_q4_0x4_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+static void ggml_vec_dot_q8_0x4_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 
 static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
     [GGML_TYPE_Q4_0] = {
@@ -1563,6 +1648,23 @@ static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
         .vec_dot_q                = NULL,   // TODO
         .vec_dot_type             = GGML_TYPE_Q8_1,
     },
+    // the repacked types compute GGML_REPACK_NROWS dot products per vec_dot_q call
+    [GGML_TYPE_Q4_0_X4] = {
+        .dequantize_row_q         = NULL,
+        .quantize_row_q           = NULL,
+        .quantize_row_q_reference = NULL,
+        .quantize_row_q_dot       = quantize_row_q8_0,
+        .vec_dot_q                = ggml_vec_dot_q4_0x4_q8_0,
+        .vec_dot_type             = GGML_TYPE_Q8_0,
+    },
+    [GGML_TYPE_Q8_0_X4] = {
+        .dequantize_row_q         = NULL,
+        .quantize_row_q           = NULL,
+        .quantize_row_q_reference = NULL,
+        .quantize_row_q_dot       = quantize_row_q8_0,
+        .vec_dot_q                = ggml_vec_dot_q8_0x4_q8_0,
+        .vec_dot_type             = GGML_TYPE_Q8_0,
+    },
 };
 
 // For internal test use
@@ -3160,6 +3262,225 @@ static void ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const void *
 #endif
 }
 
+// compute the GGML_REPACK_NROWS dot products of a group of interleaved q4_0 rows with the same y
+// each y block is loaded once for all the rows of the group
+static void ggml_vec_dot_q4_0x4_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0x4 * restrict x = vx;
+    const block_q8_0   * restrict y = vy;
+
+#if defined(__ARM_NEON)
+    float32x4_t sumv[GGML_REPACK_NROWS];
+    for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+        sumv[r] = vdupq_n_f32(0.0f);
+    }
+
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t  s8b = vdupq_n_s8(0x8);
+
+    for (int i = 0; i < nb; ++i) {
+        // load y
+        const int8x16_t v1_l = vld1q_s8(y[i].qs);
+        const int8x16_t v1_h = vld1q_s8(y[i].qs + 16);
+
+        const float dy = GGML_FP16_TO_FP32(y[i].d);
+
+        for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+            const uint8x16_t v0 = vld1q_u8(x[i].qs + r*QK4_0/2);
+
+            // 4-bit -> 8-bit, sub 8
+            const int8x16_t v0_ls = vsubq_s8(vreinterpretq_s8_u8(vandq_u8  (v0, m4b)), s8b);
+            const int8x16_t v0_hs = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(v0, 4)),   s8b);
+
+#if defined(__ARM_FEATURE_DOTPROD)
+            const int32x4_t p = vdotq_s32(vdotq_s32(vdupq_n_s32(0), v0_ls, v1_l), v0_hs, v1_h);
+#else
+            const int16x8_t pll = vmull_s8(vget_low_s8 (v0_ls), vget_low_s8 (v1_l));
+            const int16x8_t plh = vmull_s8(vget_high_s8(v0_ls), vget_high_s8(v1_l));
+            const int16x8_t phl = vmull_s8(vget_low_s8 (v0_hs), vget_low_s8 (v1_h));
+            const int16x8_t phh = vmull_s8(vget_high_s8(v0_hs), vget_high_s8(v1_h));
+
+            const int32x4_t p = vaddq_s32(vaddq_s32(vpaddlq_s16(pll), vpaddlq_s16(plh)),
+                                          vaddq_s32(vpaddlq_s16(phl), vpaddlq_s16(phh)));
+#endif
+            sumv[r] = vmlaq_n_f32(sumv[r], vcvtq_f32_s32(p), GGML_FP16_TO_FP32(x[i].d[r])*dy);
+        }
+    }
+
+    for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+        s[r] = vaddvq_f32(sumv[r]);
+    }
+#elif defined(__AVX2__) || defined(__AVX__)
+    __m256 acc[GGML_REPACK_NROWS];
+    for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+        acc[r] = _mm256_setzero_ps();
+    }
+
+    const __m256i off = _mm256_set1_epi8( 8 );
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256i by = _mm256_loadu_si256((const __m256i *)y[i].qs);
+
+        // the x quants are kept in [ 0 .. 15 ] and the offset is applied once per y block:
+        // (x - 8)*y = x*y - 8*y
+        const __m256 yoff = mul_sum_us8_pairs_float(off, by);
+
+        const float dy = GGML_FP16_TO_FP32(y[i].d);
+
+        for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+            const __m256 d = _mm256_set1_ps( GGML_FP16_TO_FP32(x[i].d[r]) * dy );
+
+            const __m256i bx = bytes_from_nibbles_32(x[i].qs + r*QK4_0/2);
+
+            const __m256 q = _mm256_sub_ps(mul_sum_us8_pairs_float(bx, by), yoff);
+
+#if defined(__AVX2__)
+            acc[r] = _mm256_fmadd_ps( d, q, acc[r] );
+#else
+            acc[r] = _mm256_add_ps( _mm256_mul_ps( d, q ), acc[r] );
+#endif
+        }
+    }
+
+    for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+        s[r] = hsum_float_8(acc[r]);
+    }
+#else
+    // scalar
+    for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+        float sumf = 0.0;
+
+        for (int i = 0; i < nb; i++) {
+            const uint8_t * restrict qs = x[i].qs + r*qk/2;
+
+            int sumi = 0;
+
+            for (int j = 0; j < qk/2; ++j) {
+                const int v0 = (qs[j] & 0x0F) - 8;
+                const int v1 = (qs[j] >>   4) - 8;
+
+                sumi += (v0 * y[i].qs[j]) + (v1 * y[i].qs[j + qk/2]);
+            }
+
+            sumf += sumi*GGML_FP16_TO_FP32(x[i].d[r])*GGML_FP16_TO_FP32(y[i].d);
+        }
+
+        s[r] = sumf;
+    }
+#endif
+}
+
+// compute the GGML_REPACK_NROWS dot products of a group of interleaved q8_0 rows with the same y
+static void ggml_vec_dot_q8_0x4_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_0x4 * restrict x = vx;
+    const block_q8_0   * restrict y = vy;
+
+#if defined(__ARM_NEON)
+    float32x4_t sumv[GGML_REPACK_NROWS];
+    for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+        sumv[r] = vdupq_n_f32(0.0f);
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        // load y
+        const int8x16_t y_0 = vld1q_s8(y[i].qs);
+        const int8x16_t y_1 = vld1q_s8(y[i].qs + 16);
+
+        const float dy = GGML_FP16_TO_FP32(y[i].d);
+
+        for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+            const int8x16_t x_0 = vld1q_s8(x[i].qs + r*QK8_0);
+            const int8x16_t x_1 = vld1q_s8(x[i].qs + r*QK8_0 + 16);
+
+#if defined(__ARM_FEATURE_DOTPROD)
+            const int32x4_t p = vaddq_s32(
+                    vdotq_s32(vdupq_n_s32(0), x_0, y_0),
+                    vdotq_s32(vdupq_n_s32(0), x_1, y_1));
+#else
+            const int16x8_t p_0 = vmull_s8(vget_low_s8 (x_0), vget_low_s8 (y_0));
+            const int16x8_t p_1 = vmull_s8(vget_high_s8(x_0), vget_high_s8(y_0));
+            const int16x8_t p_2 = vmull_s8(vget_low_s8 (x_1), vget_low_s8 (y_1));
+            const int16x8_t p_3 = vmull_s8(vget_high_s8(x_1), vget_high_s8(y_1));
+
+            const int32x4_t p = vaddq_s32(vaddq_s32(vpaddlq_s16(p_0), vpaddlq_s16(p_1)),
+                                          vaddq_s32(vpaddlq_s16(p_2), vpaddlq_s16(p_3)));
+#endif
+            sumv[r] = vmlaq_n_f32(sumv[r], vcvtq_f32_s32(p), GGML_FP16_TO_FP32(x[i].d[r])*dy);
+        }
+    }
+
+    for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+        s[r] = vaddvq_f32(sumv[r]);
+    }
+#elif defined(__AVX2__) || defined(__AVX__)
+    __m256 acc[GGML_REPACK_NROWS];
+    for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+        acc[r] = _mm256_setzero_ps();
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256i by = _mm256_loadu_si256((const __m256i *)y[i].qs);
+
+#if defined(__AVX2__) && !__AVXVNNIINT8__
+        // get the absolute values of y once and move its signs to the x vectors
+        const __m256i ay = _mm256_sign_epi8(by, by);
+#endif
+
+        const float dy = GGML_FP16_TO_FP32(y[i].d);
+
+        for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+            const __m256 d = _mm256_set1_ps( GGML_FP16_TO_FP32(x[i].d[r]) * dy );
+
+            const __m256i bx = _mm256_loadu_si256((const __m256i *)(x[i].qs + r*QK8_0));
+
+#if defined(__AVX2__) && !__AVXVNNIINT8__
+            const __m256 q = mul_sum_us8_pairs_float(ay, _mm256_sign_epi8(bx, by));
+#else
+            const __m256 q = mul_sum_i8_pairs_float(bx, by);
+#endif
+
+#if defined(__AVX2__)
+            acc[r] = _mm256_fmadd_ps( d, q, acc[r] );
+#else
+            acc[r] = _mm256_add_ps( _mm256_mul_ps( d, q ), acc[r] );
+#endif
+        }
+    }
+
+    for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+        s[r] = hsum_float_8(acc[r]);
+    }
+#else
+    // scalar
+    for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+        float sumf = 0.0;
+
+        for (int i = 0; i < nb; i++) {
+            const int8_t * restrict qs = x[i].qs + r*qk;
+
+            int sumi = 0;
+
+            for (int j = 0; j < qk; j++) {
+                sumi += qs[j]*y[i].qs[j];
+            }
+
+            sumf += sumi*(GGML_FP16_TO_FP32(x[i].d[r])*GGML_FP16_TO_FP32(y[i].d));
+        }
+
+        s[r] = sumf;
+    }
+#endif
+}
+
 // compute GGML_VEC_DOT_UNROLL dot products at once
 // xs - x row stride in bytes
 inline static void ggml_vec_dot_f16_unroll(const int n, const int xs, float * restrict s, void * restrict xv, ggml_fp16_t * restrict y) {
@@ -3215,6 +3536,77 @@ inline static void ggml_vec_dot_f16_unroll(const int n, const int xs, float * re
     }
 }
 
+#if defined(GGML_SIMD)
+// compute the GGML_MUL_MAT_MR x GGML_MUL_MAT_NR dot products of the rows of x and y at once
+// xs, ys - x and y row strides in elements
+// s[c*ss + r] = x[r] . y[c]
+inline static void ggml_vec_dot_f16_tile(const int n, float * restrict s, const int ss, ggml_fp16_t * restrict x, const int xs, ggml_fp16_t * restrict y, const int ys) {
+    const int np = (n & ~(GGML_F16_EPR - 1));
+
+    GGML_F16_VEC sum[GGML_MUL_MAT_MR][GGML_MUL_MAT_NR];
+
+    for (int r = 0; r < GGML_MUL_MAT_MR; ++r) {
+        for (int c = 0; c < GGML_MUL_MAT_NR; ++c) {
+            sum[r][c] = GGML_F16_VEC_ZERO;
+        }
+    }
+
+    GGML_F16_VEC ax;
+    GGML_F16_VEC ay[GGML_MUL_MAT_NR];
+
+    for (int k = 0; k < np; k += GGML_F16_EPR) {
+        for (int c = 0; c < GGML_MUL_MAT_NR; ++c) {
+            ay[c] = GGML_F16_VEC_LOAD(y + c*ys + k, 0);
+        }
+
+        for (int r = 0; r < GGML_MUL_MAT_MR; ++r) {
+            ax = GGML_F16_VEC_LOAD(x + r*xs + k, 0);
+
+            for (int c = 0; c < GGML_MUL_MAT_NR; ++c) {
+                sum[r][c] = GGML_F16_VEC_FMA(sum[r][c], ax, ay[c]);
+            }
+        }
+    }
+
+    for (int r = 0; r < GGML_MUL_MAT_MR; ++r) {
+        for (int c = 0; c < GGML_MUL_MAT_NR; ++c) {
+            ggml_float sumf = 0.0;
+
+            GGML_F16_VEC t[GGML_F16_ARR] = { sum[r][c] };
+            GGML_F16_VEC_REDUCE(sumf, t);
+
+            // leftovers
+            for (int k = np; k < n; ++k) {
+                sumf += (ggml_float)(GGML_FP16_TO_FP32(x[r*xs + k])*GGML_FP16_TO_FP32(y[c*ys + k]));
+            }
+
+            s[c*ss + r] = sumf;
+        }
+    }
+}
+#endif
+
+// s[c*ss + r] = x[r] . y[c] for r < nr and c < nc, using the register tiles where possible
+static void ggml_vec_dot_f16_block(const int n, const int nr, const int nc, float * restrict s, const int ss, ggml_fp16_t * restrict x, const int xs, ggml_fp16_t * restrict y, const int ys) {
+    for (int c = 0; c < nc; c += GGML_MUL_MAT_NR) {
+        for (int r = 0; r < nr; r += GGML_MUL_MAT_MR) {
+#if defined(GGML_SIMD)
+            if (r + GGML_MUL_MAT_MR <= nr && c + GGML_MUL_MAT_NR <= nc) {
+                ggml_vec_dot_f16_tile(n, s + c*ss + r, ss, x + r*xs, xs, y + c*ys, ys);
+                continue;
+            }
+#endif
+
+            // partial tile
+            for (int jc = c; jc < MIN(c + GGML_MUL_MAT_NR, nc); ++jc) {
+                for (int jr = r; jr < MIN(r + GGML_MUL_MAT_MR, nr); ++jr) {
+                    ggml_vec_dot_f16(n, s + jc*ss + jr, x + jr*xs, y + jc*ys);
+                }
+            }
+        }
+    }
+}
+
 inline static void ggml_vec_mad_f32(const int n, float * restrict y, const float * restrict x, const float v) {
 #if defined(GGML_SIMD)
     const int np = (n & ~(GGML_F32_STEP - 1));
@@ -3445,8 +3837,10 @@ static const int GGML_BLCK_SIZE[GGML_TYPE_COUNT] = {
     [GGML_TYPE_I8]   = 1,
     [GGML_TYPE_I16]  = 1,
     [GGML_TYPE_I32]  = 1,
+    [GGML_TYPE_Q4_0_X4] = QK4_0,
+    [GGML_TYPE_Q8_0_X4] = QK8_0,
 };
-static_assert(GGML_TYPE_COUNT == 13, "GGML_BLCK_SIZE is outdated");
+static_assert(GGML_TYPE_COUNT == 15, "GGML_BLCK_SIZE is outdated");
 
 static const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
     [GGML_TYPE_F32]  = sizeof(float),
@@ -3460,8 +3854,10 @@ static const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
     [GGML_TYPE_I8]   = sizeof(int8_t),
     [GGML_TYPE_I16]  = sizeof(int16_t),
     [GGML_TYPE_I32]  = sizeof(int32_t),
+    [GGML_TYPE_Q4_0_X4] = sizeof(block_q4_0),
+    [GGML_TYPE_Q8_0_X4] = sizeof(block_q8_0),
 };
-static_assert(GGML_TYPE_COUNT == 13, "GGML_TYPE_SIZE is outdated");
+static_assert(GGML_TYPE_COUNT == 15, "GGML_TYPE_SIZE is outdated");
 
 
 static const char * GGML_TYPE_NAME[GGML_TYPE_COUNT] = {
@@ -3476,8 +3872,10 @@ static const char * GGML_TYPE_NAME[GGML_TYPE_COUNT] = {
     [GGML_TYPE_I8]   = "i8",
     [GGML_TYPE_I16]  = "i16",
     [GGML_TYPE_I32]  = "i32",
+    [GGML_TYPE_Q4_0_X4] = "q4_0_x4",
+    [GGML_TYPE_Q8_0_X4] = "q8_0_x4",
 };
-static_assert(GGML_TYPE_COUNT == 13, "GGML_TYPE_NAME is outdated");
+static_assert(GGML_TYPE_COUNT == 15, "GGML_TYPE_NAME is outdated");
 
 static bool GGML_IS_QUANTIZED[GGML_TYPE_COUNT] = {
     [GGML_TYPE_F32]  = false,
@@ -3491,8 +3889,10 @@ static bool GGML_IS_QUANTIZED[GGML_TYPE_COUNT] = {
     [GGML_TYPE_I8]   = false,
     [GGML_TYPE_I16]  = false,
     [GGML_TYPE_I32]  = false,
+    [GGML_TYPE_Q4_0_X4] = true,
+    [GGML_TYPE_Q8_0_X4] = true,
 };
-static_assert(GGML_TYPE_COUNT == 13, "GGML_IS_QUANTIZED is outdated");
+static_assert(GGML_TYPE_COUNT == 15, "GGML_IS_QUANTIZED is outdated");
 
 static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
     "NONE",
@@ -6355,14 +6755,19 @@ struct ggml_tensor * ggml_clamp(
 }
 
 // ggml_conv_1d_1s
+// ggml_conv_1d_2s
 
-struct ggml_tensor * ggml_conv_1d_1s(
+// opt[0] is 1 if the kernel a was returned by ggml_conv_1d_pack_kernel
+struct ggml_tensor * ggml_conv_1d_impl(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
-        struct ggml_tensor  * b) {
+        struct ggml_tensor  * b,
+        int                   s,
+        bool                  packed) {
     GGML_ASSERT(ggml_is_matrix(b));
-    GGML_ASSERT(a->ne[1] == b->ne[1]);
+    GGML_ASSERT(a->ne[packed ? 0 : 1] == b->ne[1]);
     GGML_ASSERT(a->ne[3] == 1);
+    GGML_ASSERT(!packed || ggml_is_contiguous(a));
     bool is_node = false;
 
     if (a->grad || b->grad) {
@@ -6370,40 +6775,76 @@ struct ggml_tensor * ggml_conv_1d_1s(
         is_node = true;
     }
 
-    const int64_t ne[4] = { b->ne[0], a->ne[2], 1, 1, };
+    const int64_t ne[4] = { b->ne[0]/s, a->ne[2], 1, 1, };
     struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 2, ne);
 
-    result->op   = GGML_OP_CONV_1D_1S;
+    result->op   = s == 1 ? GGML_OP_CONV_1D_1S : GGML_OP_CONV_1D_2S;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src0 = a;
     result->src1 = b;
+    result->opt[0] = ggml_new_i32(ctx, packed);
 
     return result;
 }
 
-// ggml_conv_1d_2s
+struct ggml_tensor * ggml_conv_1d_1s(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    return ggml_conv_1d_impl(ctx, a, b, 1, false);
+}
 
 struct ggml_tensor * ggml_conv_1d_2s(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
         struct ggml_tensor  * b) {
-    GGML_ASSERT(ggml_is_matrix(b));
-    GGML_ASSERT(a->ne[1] == b->ne[1]);
-    GGML_ASSERT(a->ne[3] == 1);
-    bool is_node = false;
+    return ggml_conv_1d_impl(ctx, a, b, 2, false);
+}
 
-    if (a->grad || b->grad) {
-        GGML_ASSERT(false); // TODO: implement backward
-        is_node = true;
+struct ggml_tensor * ggml_conv_1d_1s_packed(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    return ggml_conv_1d_impl(ctx, a, b, 1, true);
+}
+
+struct ggml_tensor * ggml_conv_1d_2s_packed(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    return ggml_conv_1d_impl(ctx, a, b, 2, true);
+}
+
+// ggml_conv_1d_pack_kernel
+
+struct ggml_tensor * ggml_conv_1d_pack_kernel(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a) {
+    if ((a->type != GGML_TYPE_F16 && a->type != GGML_TYPE_F32) || a->data == NULL || !ggml_is_contiguous(a) || a->ne[3] != 1) {
+        return NULL;
     }
 
-    const int64_t ne[4] = { b->ne[0]/2, a->ne[2], 1, 1, };
-    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 2, ne);
+    const size_t  ts  = GGML_TYPE_SIZE[a->type];
+    const int64_t ne0 = a->ne[0];
+    const int64_t ne1 = a->ne[1];
+    const size_t  rs  = ne0*ne1*ts;
 
-    result->op   = GGML_OP_CONV_1D_2S;
-    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
-    result->src0 = a;
-    result->src1 = b;
+    struct ggml_tensor * result = ggml_new_tensor_3d(ctx, a->type, ne1, ne0, a->ne[2]);
+    if (result->data == NULL) {
+        return NULL;
+    }
+
+    // taps x input channels -> input channels x taps, for each output channel
+    for (int64_t i2 = 0; i2 < a->ne[2]; ++i2) {
+        const char * src = (const char *) a->data + i2*rs;
+              char * dst = (char *) result->data + i2*rs;
+
+        for (int64_t i1 = 0; i1 < ne1; ++i1) {
+            for (int64_t i0 = 0; i0 < ne0; ++i0) {
+                memcpy(dst + (i0*ne1 + i1)*ts, src + (i1*ne0 + i0)*ts, ts);
+            }
+        }
+    }
 
     return result;
 }
@@ -6416,8 +6857,20 @@ struct ggml_tensor * ggml_flash_attn(
         struct ggml_tensor  * k,
         struct ggml_tensor  * v,
         bool                  masked) {
+    return ggml_flash_attn_ext(ctx, q, k, v, 1.0f/sqrtf(q->ne[0]), masked ? (int) (k->ne[1] - q->ne[1]) : -1);
+}
+
+struct ggml_tensor * ggml_flash_attn_ext(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        float                 scale,
+        int                   n_past) {
     GGML_ASSERT(ggml_can_mul_mat(k, q));
-    // TODO: check if vT can be multiplied by (k*qT)
+    GGML_ASSERT(v->ne[0] == k->ne[1] && v->ne[1] == q->ne[0] && v->ne[2] == q->ne[2] && v->ne[3] == q->ne[3]);
+    GGML_ASSERT(k->type == v->type);
+    GGML_ASSERT(k->type == GGML_TYPE_F16 || (k->type == GGML_TYPE_F32 && q->type == GGML_TYPE_F32));
 
     bool is_node = false;
 
@@ -6434,7 +6887,8 @@ struct ggml_tensor * ggml_flash_attn(
     result->src0 = q;
     result->src1 = k;
     result->opt[0] = v;
-    result->opt[1] = ggml_new_i32(ctx, masked ? 1 : 0);
+    result->opt[1] = ggml_new_i32(ctx, n_past < 0 ? -1 : n_past);
+    result->opt[2] = ggml_new_f32(ctx, scale);
 
     return result;
 }
@@ -9446,6 +9900,11 @@ static bool ggml_compute_forward_mul_mat_use_blas(
     const int64_t ne0 = dst->ne[0];
     const int64_t ne1 = dst->ne[1];
 
+    // the repacked types cannot be dequantized row by row
+    if (ggml_repack_row_type(src0->type) != src0->type) {
+        return false;
+    }
+
     // TODO: find the optimal values for these
     if (ggml_is_contiguous(src0) &&
         ggml_is_contiguous(src1) &&
@@ -9640,6 +10099,13 @@ static void ggml_compute_forward_mul_mat_f32(
     //}
 }
 
+// the INIT phase is run by all the threads of the node, each converting a part of src1
+static bool ggml_compute_forward_mul_mat_init_parallel(
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1) {
+    return src0->type != GGML_TYPE_F32 && ggml_nrows(src1) >= GGML_MUL_MAT_INIT_NROWS;
+}
+
 static void ggml_compute_forward_mul_mat_f16_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -9781,19 +10247,26 @@ static void ggml_compute_forward_mul_mat_f16_f32(
     if (params->type == GGML_TASK_INIT) {
         ggml_fp16_t * const wdata = params->wdata;
 
-        size_t id = 0;
-        for (int64_t i13 = 0; i13 < ne13; ++i13) {
-            for (int64_t i12 = 0; i12 < ne12; ++i12) {
-                for (int64_t i11 = 0; i11 < ne11; ++i11) {
-                    for (int64_t i10 = 0; i10 < ne10; ++i10) {
-                        wdata[id++] = GGML_FP32_TO_FP16(*(float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11 + i10*nb10));
-                    }
-                }
+        // rows of src1 converted by this thread
+        const int nr  = ne11*ne12*ne13;
+        const int nth_init = ggml_compute_forward_mul_mat_init_parallel(src0, src1) ? nth : 1;
+        const int dr  = (nr + nth_init - 1)/nth_init;
+        const int ir0 = dr*ith;
+        const int ir1 = MIN(ir0 + dr, nr);
+
+        GGML_ASSERT((size_t) nr*ne10*sizeof(ggml_fp16_t) <= params->wsize);
+
+        for (int ir = ir0; ir < ir1; ++ir) {
+            const int i13 = ir/(ne12*ne11);
+            const int i12 = (ir - i13*ne12*ne11)/ne11;
+            const int i11 = (ir - i13*ne12*ne11 - i12*ne11);
+
+            size_t id = (size_t) ir*ne10;
+            for (int64_t i10 = 0; i10 < ne10; ++i10) {
+                wdata[id++] = GGML_FP32_TO_FP16(*(float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11 + i10*nb10));
             }
         }
 
-        GGML_ASSERT(id*sizeof(ggml_fp16_t) <= params->wsize);
-
         return;
     }
 
@@ -9819,9 +10292,50 @@ static void ggml_compute_forward_mul_mat_f16_f32(
 
     ggml_fp16_t * wdata = params->wdata;
 
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // src0 indices
-        const int i03 = ir/(ne02*ne01);
+#if defined(GGML_SIMD)
+    if (ne11 >= GGML_MUL_MAT_TILE_NE11 && nb01 % sizeof(ggml_fp16_t) == 0 && nb1 % sizeof(float) == 0) {
+        // blocks of GGML_MUL_MAT_MC rows within the same src0 matrix
+        for (int ib0 = ir0; ib0 < ir1; ) {
+            const int i03 = ib0/(ne02*ne01);
+            const int i02 = (ib0 - i03*ne02*ne01)/ne01;
+            const int i01 = (ib0 - i03*ne02*ne01 - i02*ne01);
+
+            const int nrb = MIN(MIN(GGML_MUL_MAT_MC, ir1 - ib0), ne01 - i01);
+
+            ggml_fp16_t * src0_row = (ggml_fp16_t *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
+            ggml_fp16_t * src1_col =                                wdata + (       0 + i02*ne11 + i03*ne12*ne11)*ne00;
+
+            float * dst_col = (float *) ((char *) dst->data + (i01*nb0 + 0*nb1 + i02*nb2 + i03*nb3));
+
+            const int xs = nb01/sizeof(ggml_fp16_t);
+            const int ss = nb1/sizeof(float);
+
+            for (int64_t ic = 0; ic < ne11; ic += GGML_MUL_MAT_NR) {
+                for (int ir = 0; ir < nrb; ir += GGML_MUL_MAT_MR) {
+                    if (ir + GGML_MUL_MAT_MR <= nrb && ic + GGML_MUL_MAT_NR <= ne11) {
+                        ggml_vec_dot_f16_tile(ne00, dst_col + ic*ss + ir, ss, src0_row + ir*xs, xs, src1_col + ic*ne00, ne00);
+                        continue;
+                    }
+
+                    // partial tile
+                    for (int64_t jc = ic; jc < MIN(ic + GGML_MUL_MAT_NR, ne11); ++jc) {
+                        for (int jr = ir; jr < MIN(ir + GGML_MUL_MAT_MR, nrb); ++jr) {
+                            ggml_vec_dot_f16(ne00, dst_col + jc*ss + jr, src0_row + jr*xs, src1_col + jc*ne00);
+                        }
+                    }
+                }
+            }
+
+            ib0 += nrb;
+        }
+
+        return;
+    }
+#endif
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        // src0 indices
+        const int i03 = ir/(ne02*ne01);
         const int i02 = (ir - i03*ne02*ne01)/ne01;
         const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
@@ -10000,13 +10514,19 @@ static void ggml_compute_forward_mul_mat_q_f32(
         char * wdata = params->wdata;
         const size_t row_size = ne10*GGML_TYPE_SIZE[vec_dot_type]/GGML_BLCK_SIZE[vec_dot_type];
 
-        for (int64_t i13 = 0; i13 < ne13; ++i13) {
-            for (int64_t i12 = 0; i12 < ne12; ++i12) {
-                for (int64_t i11 = 0; i11 < ne11; ++i11) {
-                    quantize_row_q_dot((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (void *) wdata, ne10);
-                    wdata += row_size;
-                }
-            }
+        // rows of src1 quantized by this thread
+        const int nr  = ne11*ne12*ne13;
+        const int nth_init = ggml_compute_forward_mul_mat_init_parallel(src0, src1) ? nth : 1;
+        const int dr  = (nr + nth_init - 1)/nth_init;
+        const int ir0 = dr*ith;
+        const int ir1 = MIN(ir0 + dr, nr);
+
+        for (int ir = ir0; ir < ir1; ++ir) {
+            const int i13 = ir/(ne12*ne11);
+            const int i12 = (ir - i13*ne12*ne11)/ne11;
+            const int i11 = (ir - i13*ne12*ne11 - i12*ne11);
+
+            quantize_row_q_dot((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (void *) (wdata + ir*row_size), ne10);
         }
 
         return;
@@ -10018,11 +10538,18 @@ static void ggml_compute_forward_mul_mat_q_f32(
 
     // parallelize by src0 rows using ggml_vec_dot_q
 
+    // the repacked types compute a group of rows per ggml_vec_dot_q call
+    // the rows after the last whole group are left as they are and use the original kernel
+    const enum ggml_type type_row = ggml_repack_row_type(type);
+    const int nrg = type_row != type ? GGML_REPACK_NROWS : 1;
+    const int ne01_g = ne01 - ne01 % nrg;
+    vec_dot_q_t const vec_dot_q_row = quantize_fns[type_row].vec_dot_q;
+
     // total rows in src0
     const int nr = ne01*ne02*ne03;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    // rows per thread, in whole groups
+    const int dr = nrg*(((nr + nrg - 1)/nrg + nth - 1)/nth);
 
     // row range for this thread
     const int ir0 = dr*ith;
@@ -10031,12 +10558,14 @@ static void ggml_compute_forward_mul_mat_q_f32(
     void * wdata = params->wdata;
     const size_t row_size = ne00*GGML_TYPE_SIZE[vec_dot_type]/GGML_BLCK_SIZE[vec_dot_type];
 
-    for (int ir = ir0; ir < ir1; ++ir) {
+    for (int ir = ir0; ir < ir1; ) {
         // src0 indices
         const int i03 = ir/(ne02*ne01);
         const int i02 = (ir - i03*ne02*ne01)/ne01;
         const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
+        const bool grouped = i01 < ne01_g;
+
         const int i13 = i03;
         const int i12 = i02;
 
@@ -10052,8 +10581,10 @@ static void ggml_compute_forward_mul_mat_q_f32(
         assert(ne00 % 32 == 0);
 
         for (int64_t ic = 0; ic < ne11; ++ic) {
-            vec_dot_q(ne00, &dst_col[ic*ne0], src0_row, (void *) (src1_col + ic*row_size));
+            (grouped ? vec_dot_q : vec_dot_q_row)(ne00, &dst_col[ic*ne0], src0_row, (void *) (src1_col + ic*row_size));
         }
+
+        ir += grouped ? nrg : 1;
     }
 
     //int64_t t1 = ggml_time_us();
@@ -10081,6 +10612,8 @@ static void ggml_compute_forward_mul_mat(
         case GGML_TYPE_Q5_1:
         case GGML_TYPE_Q8_0:
         case GGML_TYPE_Q8_1:
+        case GGML_TYPE_Q4_0_X4:
+        case GGML_TYPE_Q8_0_X4:
             {
                 ggml_compute_forward_mul_mat_q_f32(params, src0, src1, dst);
             } break;
@@ -10417,6 +10950,58 @@ static void ggml_compute_forward_get_rows_f32(
     }
 }
 
+static void ggml_compute_forward_get_rows_q_x4(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    assert(params->ith == 0);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nelements(src1);
+    const enum ggml_type type = ggml_repack_row_type(src0->type);
+    dequantize_row_q_t const dequantize_row_q = quantize_fns[type].dequantize_row_q;
+
+    const int    qk = GGML_BLCK_SIZE[type];
+    const size_t bs = GGML_TYPE_SIZE[type];
+    const size_t qs = bs - sizeof(ggml_fp16_t);
+    const int ne01_g = src0->ne[1] - src0->ne[1] % GGML_REPACK_NROWS;
+
+    assert( dst->ne[0] == nc);
+    assert( dst->ne[1] == nr);
+    assert(src0->nb[0] == GGML_TYPE_SIZE[type]);
+    assert(bs <= sizeof(block_q8_0));
+
+    for (int i = 0; i < nr; ++i) {
+        const int r = ((int32_t *) src1->data)[i];
+
+        float * y = (float *) ((char *) dst->data + i*dst->nb[1]);
+
+        if (r >= ne01_g) {
+            dequantize_row_q((const void *) ((char *) src0->data + r*src0->nb[1]), y, nc);
+            continue;
+        }
+
+        // gather the blocks of the row from its group, see ggml_repack()
+        const int k = r % GGML_REPACK_NROWS;
+        const char * x = (const char *) src0->data + (r - k)*src0->nb[1];
+
+        for (int ib = 0; ib < nc/qk; ++ib) {
+            const char * xb = x + ib*GGML_REPACK_NROWS*bs;
+
+            char tmp[sizeof(block_q8_0)];
+            memcpy(tmp, xb + k*sizeof(ggml_fp16_t), sizeof(ggml_fp16_t));
+            memcpy(tmp + sizeof(ggml_fp16_t), xb + GGML_REPACK_NROWS*sizeof(ggml_fp16_t) + k*qs, qs);
+
+            dequantize_row_q(tmp, y + ib*qk, qk);
+        }
+    }
+}
+
 static void ggml_compute_forward_get_rows(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -10432,6 +11017,11 @@ static void ggml_compute_forward_get_rows(
             {
                 ggml_compute_forward_get_rows_q(params, src0, src1, dst);
             } break;
+        case GGML_TYPE_Q4_0_X4:
+        case GGML_TYPE_Q8_0_X4:
+            {
+                ggml_compute_forward_get_rows_q_x4(params, src0, src1, dst);
+            } break;
         case GGML_TYPE_F16:
             {
                 ggml_compute_forward_get_rows_f16(params, src0, src1, dst);
@@ -10978,6 +11568,8 @@ static void ggml_compute_forward_alibi(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_X4:
+        case GGML_TYPE_Q8_0_X4:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -11049,6 +11641,8 @@ static void ggml_compute_forward_clamp(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_X4:
+        case GGML_TYPE_Q8_0_X4:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -11555,12 +12149,23 @@ static void ggml_compute_forward_rope_back(
 }
 
 // ggml_compute_forward_conv_1d_1s
+// ggml_compute_forward_conv_1d_2s
+
+// a kernel returned by ggml_conv_1d_pack_kernel() is already in the layout used by the GEMM below
+static bool ggml_conv_1d_kernel_is_packed(const struct ggml_tensor * dst) {
+    return ggml_get_i32_1d(dst->opt[0], 0) != 0;
+}
 
-static void ggml_compute_forward_conv_1d_1s_f16_f32(
+// the convolution is computed as a GEMM between the kernel and the windows of the input:
+//   - the kernel of each output channel is a row of nk*ne01 elements (taps x input channels)
+//   - the input is transposed to time x input channels and padded with nh zero rows on each side,
+//     so the window of output i0 is the contiguous row of nk*ne01 elements starting at row s*i0
+static void ggml_compute_forward_conv_1d_f16_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
-              struct ggml_tensor * dst) {
+              struct ggml_tensor * dst,
+        const int s) {
     GGML_ASSERT(src0->type == GGML_TYPE_F16);
     GGML_ASSERT(src1->type == GGML_TYPE_F32);
     GGML_ASSERT( dst->type == GGML_TYPE_F32);
@@ -11568,36 +12173,26 @@ static void ggml_compute_forward_conv_1d_1s_f16_f32(
     int64_t t0 = ggml_perf_time_us();
     UNUSED(t0);
 
-    const int64_t ne00 = src0->ne[0];
-    const int64_t ne01 = src0->ne[1];
+    const bool packed = ggml_conv_1d_kernel_is_packed(dst);
+
+    // taps and input channels - their dimensions are swapped in a packed kernel
+    const int64_t ne00 = src0->ne[packed ? 1 : 0];
+    const int64_t ne01 = src0->ne[packed ? 0 : 1];
     const int64_t ne02 = src0->ne[2];
-    //const int64_t ne03 = src0->ne[3];
 
     const int64_t ne10 = src1->ne[0];
     const int64_t ne11 = src1->ne[1];
-    //const int64_t ne12 = src1->ne[2];
-    //const int64_t ne13 = src1->ne[3];
 
-    //const int64_t ne0  = dst->ne[0];
-    //const int64_t ne1  = dst->ne[1];
-    //const int64_t ne2  = dst->ne[2];
-    //const int64_t ne3  = dst->ne[3];
-    //const int64_t ne   = ne0*ne1*ne2*ne3;
+    const int64_t ne0  = dst->ne[0];
 
     const int nb00 = src0->nb[0];
     const int nb01 = src0->nb[1];
     const int nb02 = src0->nb[2];
-    //const int nb03 = src0->nb[3];
 
     const int nb10 = src1->nb[0];
     const int nb11 = src1->nb[1];
-    //const int nb12 = src1->nb[2];
-    //const int nb13 = src1->nb[3];
 
-    //const int nb0  = dst->nb[0];
     const int nb1  = dst->nb[1];
-    //const int nb2  = dst->nb[2];
-    //const int nb3  = dst->nb[3];
 
     const int ith = params->ith;
     const int nth = params->nth;
@@ -11605,40 +12200,50 @@ static void ggml_compute_forward_conv_1d_1s_f16_f32(
     const int nk = ne00;
     const int nh = nk/2;
 
-    const int ew0 = ggml_up32(ne01);
+    // length of the kernel rows and of the input windows
+    const int nkc = nk*ne01;
 
     GGML_ASSERT(ne00 % 2 == 1); // TODO: support even kernel sizes
     GGML_ASSERT(nb00 == sizeof(ggml_fp16_t));
     GGML_ASSERT(nb10 == sizeof(float));
 
-    if (params->type == GGML_TASK_INIT) {
-        // TODO: fix this memset (wsize is overestimated)
-        memset(params->wdata, 0, params->wsize);
+    ggml_fp16_t * const wdata_src1 = (ggml_fp16_t *) params->wdata;
+    ggml_fp16_t * const wdata_src0 = wdata_src1 + (ne10 + 2*nh)*ne11;
 
-        // prepare kernel data (src0)
-        {
-            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + 0;
+    if (params->type == GGML_TASK_INIT) {
+        // prepare kernel data (src0), by output channels
+        if (!packed) {
+            const int dr  = (ne02 + nth - 1)/nth;
+            const int ir0 = dr*ith;
+            const int ir1 = MIN(ir0 + dr, ne02);
 
-            for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i02 = ir0; i02 < ir1; i02++) {
                 for (int64_t i01 = 0; i01 < ne01; i01++) {
                     const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i02*nb02 + i01*nb01);
-                    ggml_fp16_t * dst_data = wdata + i02*ew0*ne00;
+                    ggml_fp16_t * dst_data = wdata_src0 + i02*nkc;
                     for (int64_t i00 = 0; i00 < ne00; i00++) {
-                        dst_data[i00*ew0 + i01] = src[i00];
+                        dst_data[i00*ne01 + i01] = src[i00];
                     }
                 }
             }
         }
 
-        // prepare source data (src1)
+        // prepare source data (src1), by blocks of time steps
         {
-            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + ne02*ew0*ne00;
+            const int dr  = (ne10 + nth - 1)/nth;
+            const int ir0 = dr*ith;
+            const int ir1 = MIN(ir0 + dr, ne10);
+
+            if (ith == 0) {
+                memset(wdata_src1, 0, nh*ne11*sizeof(ggml_fp16_t));
+                memset(wdata_src1 + (ne10 + nh)*ne11, 0, nh*ne11*sizeof(ggml_fp16_t));
+            }
 
             for (int64_t i11 = 0; i11 < ne11; i11++) {
                 const float * const src = (float *)((char *) src1->data + i11*nb11);
-                ggml_fp16_t * dst_data = wdata;
-                for (int64_t i10 = 0; i10 < ne10; i10++) {
-                    dst_data[(i10 + nh)*ew0 + i11] = GGML_FP32_TO_FP16(src[i10]);
+                ggml_fp16_t * dst_data = wdata_src1;
+                for (int64_t i10 = ir0; i10 < ir1; i10++) {
+                    dst_data[(i10 + nh)*ne11 + i11] = GGML_FP32_TO_FP16(src[i10]);
                 }
             }
         }
@@ -11650,6 +12255,8 @@ static void ggml_compute_forward_conv_1d_1s_f16_f32(
         return;
     }
 
+    ggml_fp16_t * const kernel = packed ? (ggml_fp16_t *) src0->data : wdata_src0;
+
     // total rows in dst
     const int nr = ne02;
 
@@ -11660,27 +12267,48 @@ static void ggml_compute_forward_conv_1d_1s_f16_f32(
     const int ir0 = dr*ith;
     const int ir1 = MIN(ir0 + dr, nr);
 
+#if defined(GGML_SIMD)
+    const int ss = nb1/sizeof(float);
+
+    // blocks of GGML_MUL_MAT_MC output channels, whose kernels stay in cache while the input windows
+    // are streamed once per block
+    for (int ib = ir0; ib < ir1; ib += GGML_MUL_MAT_MC) {
+        const int nrb = MIN(GGML_MUL_MAT_MC, ir1 - ib);
+
+        for (int64_t i0 = 0; i0 < ne0; i0 += GGML_MUL_MAT_MR) {
+            for (int jc = 0; jc < nrb; jc += GGML_MUL_MAT_NR) {
+                float * dst_data = (float *) dst->data + (ib + jc)*ss + i0;
+
+                if (i0 + GGML_MUL_MAT_MR <= ne0 && jc + GGML_MUL_MAT_NR <= nrb) {
+                    ggml_vec_dot_f16_tile(nkc, dst_data, ss, wdata_src1 + s*i0*ne01, s*ne01, kernel + (ib + jc)*nkc, nkc);
+                    continue;
+                }
+
+                // partial tile
+                for (int c = 0; c < MIN(GGML_MUL_MAT_NR, nrb - jc); ++c) {
+                    for (int r = 0; r < MIN(GGML_MUL_MAT_MR, ne0 - i0); ++r) {
+                        ggml_vec_dot_f16(nkc, dst_data + c*ss + r, wdata_src1 + s*(i0 + r)*ne01, kernel + (ib + jc + c)*nkc);
+                    }
+                }
+            }
+        }
+    }
+#else
     for (int i1 = ir0; i1 < ir1; i1++) {
         float * dst_data = (float *)((char *) dst->data + i1*nb1);
-        for (int64_t i0 = 0; i0 < ne10; ++i0) {
-            dst_data[i0] = 0;
-            for (int k = -nh; k <= nh; k++) {
-                float v = 0.0f;
-                ggml_vec_dot_f16(ew0, &v,
-                        (ggml_fp16_t *) params->wdata +   i1*ew0*ne00 +      (nh + k)*ew0,
-                        (ggml_fp16_t *) params->wdata + ne02*ew0*ne00 + (i0 + nh + k)*ew0);
-
-                dst_data[i0] += v;
-            }
+        for (int64_t i0 = 0; i0 < ne0; ++i0) {
+            ggml_vec_dot_f16(nkc, &dst_data[i0], wdata_src1 + s*i0*ne01, kernel + i1*nkc);
         }
     }
+#endif
 }
 
-static void ggml_compute_forward_conv_1d_1s_f32(
+static void ggml_compute_forward_conv_1d_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
-              struct ggml_tensor * dst) {
+              struct ggml_tensor * dst,
+        const int s) {
     GGML_ASSERT(src0->type == GGML_TYPE_F32);
     GGML_ASSERT(src1->type == GGML_TYPE_F32);
     GGML_ASSERT( dst->type == GGML_TYPE_F32);
@@ -11688,36 +12316,26 @@ static void ggml_compute_forward_conv_1d_1s_f32(
     int64_t t0 = ggml_perf_time_us();
     UNUSED(t0);
 
-    const int64_t ne00 = src0->ne[0];
-    const int64_t ne01 = src0->ne[1];
+    const bool packed = ggml_conv_1d_kernel_is_packed(dst);
+
+    // taps and input channels - their dimensions are swapped in a packed kernel
+    const int64_t ne00 = src0->ne[packed ? 1 : 0];
+    const int64_t ne01 = src0->ne[packed ? 0 : 1];
     const int64_t ne02 = src0->ne[2];
-    //const int64_t ne03 = src0->ne[3];
 
     const int64_t ne10 = src1->ne[0];
     const int64_t ne11 = src1->ne[1];
-    //const int64_t ne12 = src1->ne[2];
-    //const int64_t ne13 = src1->ne[3];
 
-    //const int64_t ne0  = dst->ne[0];
-    //const int64_t ne1  = dst->ne[1];
-    //const int64_t ne2  = dst->ne[2];
-    //const int64_t ne3  = dst->ne[3];
-    //const int64_t ne   = ne0*ne1*ne2*ne3;
+    const int64_t ne0  = dst->ne[0];
 
     const int nb00 = src0->nb[0];
     const int nb01 = src0->nb[1];
     const int nb02 = src0->nb[2];
-    //const int nb03 = src0->nb[3];
 
     const int nb10 = src1->nb[0];
     const int nb11 = src1->nb[1];
-    //const int nb12 = src1->nb[2];
-    //const int nb13 = src1->nb[3];
 
-    //const int nb0  = dst->nb[0];
     const int nb1  = dst->nb[1];
-    //const int nb2  = dst->nb[2];
-    //const int nb3  = dst->nb[3];
 
     const int ith = params->ith;
     const int nth = params->nth;
@@ -11725,40 +12343,50 @@ static void ggml_compute_forward_conv_1d_1s_f32(
     const int nk = ne00;
     const int nh = nk/2;
 
-    const int ew0 = ggml_up32(ne01);
+    // length of the kernel rows and of the input windows
+    const int nkc = nk*ne01;
 
     GGML_ASSERT(ne00 % 2 == 1); // TODO: support even kernel sizes
     GGML_ASSERT(nb00 == sizeof(float));
     GGML_ASSERT(nb10 == sizeof(float));
 
-    if (params->type == GGML_TASK_INIT) {
-        // TODO: fix this memset (wsize is overestimated)
-        memset(params->wdata, 0, params->wsize);
+    float * const wdata_src1 = (float *) params->wdata;
+    float * const wdata_src0 = wdata_src1 + (ne10 + 2*nh)*ne11;
 
-        // prepare kernel data (src0)
-        {
-            float * const wdata = (float *) params->wdata + 0;
+    if (params->type == GGML_TASK_INIT) {
+        // prepare kernel data (src0), by output channels
+        if (!packed) {
+            const int dr  = (ne02 + nth - 1)/nth;
+            const int ir0 = dr*ith;
+            const int ir1 = MIN(ir0 + dr, ne02);
 
-            for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i02 = ir0; i02 < ir1; i02++) {
                 for (int64_t i01 = 0; i01 < ne01; i01++) {
                     const float * const src = (float *)((char *) src0->data + i02*nb02 + i01*nb01);
-                    float * dst_data = wdata + i02*ew0*ne00;
+                    float * dst_data = wdata_src0 + i02*nkc;
                     for (int64_t i00 = 0; i00 < ne00; i00++) {
-                        dst_data[i00*ew0 + i01] = src[i00];
+                        dst_data[i00*ne01 + i01] = src[i00];
                     }
                 }
             }
         }
 
-        // prepare source data (src1)
+        // prepare source data (src1), by blocks of time steps
         {
-            float * const wdata = (float *) params->wdata + ne02*ew0*ne00;
+            const int dr  = (ne10 + nth - 1)/nth;
+            const int ir0 = dr*ith;
+            const int ir1 = MIN(ir0 + dr, ne10);
+
+            if (ith == 0) {
+                memset(wdata_src1, 0, nh*ne11*sizeof(float));
+                memset(wdata_src1 + (ne10 + nh)*ne11, 0, nh*ne11*sizeof(float));
+            }
 
             for (int64_t i11 = 0; i11 < ne11; i11++) {
                 const float * const src = (float *)((char *) src1->data + i11*nb11);
-                float * dst_data = wdata;
-                for (int64_t i10 = 0; i10 < ne10; i10++) {
-                    dst_data[(i10 + nh)*ew0 + i11] = src[i10];
+                float * dst_data = wdata_src1;
+                for (int64_t i10 = ir0; i10 < ir1; i10++) {
+                    dst_data[(i10 + nh)*ne11 + i11] = src[i10];
                 }
             }
         }
@@ -11770,6 +12398,8 @@ static void ggml_compute_forward_conv_1d_1s_f32(
         return;
     }
 
+    float * const kernel = packed ? (float *) src0->data : wdata_src0;
+
     // total rows in dst
     const int nr = ne02;
 
@@ -11782,16 +12412,8 @@ static void ggml_compute_forward_conv_1d_1s_f32(
 
     for (int i1 = ir0; i1 < ir1; i1++) {
         float * dst_data = (float *)((char *) dst->data + i1*nb1);
-        for (int64_t i0 = 0; i0 < ne10; ++i0) {
-            dst_data[i0] = 0;
-            for (int k = -nh; k <= nh; k++) {
-                float v = 0.0f;
-                ggml_vec_dot_f32(ew0, &v,
-                        (float *) params->wdata +   i1*ew0*ne00 +      (nh + k)*ew0,
-                        (float *) params->wdata + ne02*ew0*ne00 + (i0 + nh + k)*ew0);
-
-                dst_data[i0] += v;
-            }
+        for (int64_t i0 = 0; i0 < ne0; ++i0) {
+            ggml_vec_dot_f32(nkc, &dst_data[i0], wdata_src1 + s*i0*ne01, kernel + i1*nkc);
         }
     }
 }
@@ -11804,11 +12426,11 @@ static void ggml_compute_forward_conv_1d_1s(
     switch (src0->type) {
         case GGML_TYPE_F16:
             {
-                ggml_compute_forward_conv_1d_1s_f16_f32(params, src0, src1, dst);
+                ggml_compute_forward_conv_1d_f16_f32(params, src0, src1, dst, 1);
             } break;
         case GGML_TYPE_F32:
             {
-                ggml_compute_forward_conv_1d_1s_f32(params, src0, src1, dst);
+                ggml_compute_forward_conv_1d_f32(params, src0, src1, dst, 1);
             } break;
         default:
             {
@@ -11817,277 +12439,110 @@ static void ggml_compute_forward_conv_1d_1s(
     }
 }
 
-// ggml_compute_forward_conv_1d_2s
-
-static void ggml_compute_forward_conv_1d_2s_f16_f32(
+static void ggml_compute_forward_conv_1d_2s(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
-              struct ggml_tensor * dst) {
-    GGML_ASSERT(src0->type == GGML_TYPE_F16);
-    GGML_ASSERT(src1->type == GGML_TYPE_F32);
-    GGML_ASSERT( dst->type == GGML_TYPE_F32);
-
-    int64_t t0 = ggml_perf_time_us();
-    UNUSED(t0);
-
-    const int64_t ne00 = src0->ne[0];
-    const int64_t ne01 = src0->ne[1];
-    const int64_t ne02 = src0->ne[2];
-    //const int64_t ne03 = src0->ne[3];
-
-    const int64_t ne10 = src1->ne[0];
-    const int64_t ne11 = src1->ne[1];
-    //const int64_t ne12 = src1->ne[2];
-    //const int64_t ne13 = src1->ne[3];
-
-    //const int64_t ne0  = dst->ne[0];
-    //const int64_t ne1  = dst->ne[1];
-    //const int64_t ne2  = dst->ne[2];
-    //const int64_t ne3  = dst->ne[3];
-    //const int64_t ne   = ne0*ne1*ne2*ne3;
-
-    const int nb00 = src0->nb[0];
-    const int nb01 = src0->nb[1];
-    const int nb02 = src0->nb[2];
-    //const int nb03 = src0->nb[3];
-
-    const int nb10 = src1->nb[0];
-    const int nb11 = src1->nb[1];
-    //const int nb12 = src1->nb[2];
-    //const int nb13 = src1->nb[3];
-
-    //const int nb0  = dst->nb[0];
-    const int nb1  = dst->nb[1];
-    //const int nb2  = dst->nb[2];
-    //const int nb3  = dst->nb[3];
-
-    const int ith = params->ith;
-    const int nth = params->nth;
-
-    const int nk = ne00;
-    const int nh = nk/2;
-
-    const int ew0 = ggml_up32(ne01);
-
-    GGML_ASSERT(ne00 % 2 == 1); // TODO: support even kernel sizes
-    GGML_ASSERT(nb00 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nb10 == sizeof(float));
-
-    if (params->type == GGML_TASK_INIT) {
-        // TODO: fix this memset (wsize is overestimated)
-        memset(params->wdata, 0, params->wsize);
-
-        // prepare kernel data (src0)
-        {
-            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + 0;
-
-            for (int64_t i02 = 0; i02 < ne02; i02++) {
-                for (int64_t i01 = 0; i01 < ne01; i01++) {
-                    const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i02*nb02 + i01*nb01);
-                    ggml_fp16_t * dst_data = wdata + i02*ew0*ne00;
-                    for (int64_t i00 = 0; i00 < ne00; i00++) {
-                        dst_data[i00*ew0 + i01] = src[i00];
-                    }
-                }
-            }
-        }
-
-        // prepare source data (src1)
-        {
-            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + ne02*ew0*ne00;
-
-            for (int64_t i11 = 0; i11 < ne11; i11++) {
-                const float * const src = (float *)((char *) src1->data + i11*nb11);
-                ggml_fp16_t * dst_data = wdata;
-                for (int64_t i10 = 0; i10 < ne10; i10++) {
-                    dst_data[(i10 + nh)*ew0 + i11] = GGML_FP32_TO_FP16(src[i10]);
-                }
-            }
-        }
-
-        return;
-    }
-
-    if (params->type == GGML_TASK_FINALIZE) {
-        return;
-    }
-
-    // total rows in dst
-    const int nr = ne02;
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
-    for (int i1 = ir0; i1 < ir1; i1++) {
-        float * dst_data = (float *)((char *) dst->data + i1*nb1);
-        for (int64_t i0 = 0; i0 < ne10; i0 += 2) {
-            dst_data[i0/2] = 0;
-            for (int k = -nh; k <= nh; k++) {
-                float v = 0.0f;
-                ggml_vec_dot_f16(ew0, &v,
-                        (ggml_fp16_t *) params->wdata +   i1*ew0*ne00 +      (nh + k)*ew0,
-                        (ggml_fp16_t *) params->wdata + ne02*ew0*ne00 + (i0 + nh + k)*ew0);
-
-                dst_data[i0/2] += v;
-            }
-        }
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F16:
+            {
+                ggml_compute_forward_conv_1d_f16_f32(params, src0, src1, dst, 2);
+            } break;
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_conv_1d_f32(params, src0, src1, dst, 2);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
     }
 }
 
-static void ggml_compute_forward_conv_1d_2s_f32(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0,
-        const struct ggml_tensor * src1,
-              struct ggml_tensor * dst) {
-    GGML_ASSERT(src0->type == GGML_TYPE_F32);
-    GGML_ASSERT(src1->type == GGML_TYPE_F32);
-    GGML_ASSERT( dst->type == GGML_TYPE_F32);
-
-    int64_t t0 = ggml_perf_time_us();
-    UNUSED(t0);
-
-    const int64_t ne00 = src0->ne[0];
-    const int64_t ne01 = src0->ne[1];
-    const int64_t ne02 = src0->ne[2];
-    //const int64_t ne03 = src0->ne[3];
-
-    const int64_t ne10 = src1->ne[0];
-    const int64_t ne11 = src1->ne[1];
-    //const int64_t ne12 = src1->ne[2];
-    //const int64_t ne13 = src1->ne[3];
-
-    //const int64_t ne0  = dst->ne[0];
-    //const int64_t ne1  = dst->ne[1];
-    //const int64_t ne2  = dst->ne[2];
-    //const int64_t ne3  = dst->ne[3];
-    //const int64_t ne   = ne0*ne1*ne2*ne3;
-
-    const int nb00 = src0->nb[0];
-    const int nb01 = src0->nb[1];
-    const int nb02 = src0->nb[2];
-    //const int nb03 = src0->nb[3];
-
-    const int nb10 = src1->nb[0];
-    const int nb11 = src1->nb[1];
-    //const int nb12 = src1->nb[2];
-    //const int nb13 = src1->nb[3];
-
-    //const int nb0  = dst->nb[0];
-    const int nb1  = dst->nb[1];
-    //const int nb2  = dst->nb[2];
-    //const int nb3  = dst->nb[3];
-
-    const int ith = params->ith;
-    const int nth = params->nth;
-
-    const int nk = ne00;
-    const int nh = nk/2;
-
-    const int ew0 = ggml_up32(ne01);
-
-    GGML_ASSERT(ne00 % 2 == 1); // TODO: support even kernel sizes
-    GGML_ASSERT(nb00 == sizeof(float));
-    GGML_ASSERT(nb10 == sizeof(float));
+// ggml_compute_forward_flash_attn
 
-    if (params->type == GGML_TASK_INIT) {
-        // TODO: fix this memset (wsize is overestimated)
-        memset(params->wdata, 0, params->wsize);
+// size in floats of the work buffer of each thread of ggml_compute_forward_flash_attn
+static size_t ggml_flash_attn_wsize(const struct ggml_tensor * q, const struct ggml_tensor * k) {
+    const int64_t D   = q->ne[0];
+    const int64_t Mup = ggml_up(k->ne[1], GGML_SOFT_MAX_UNROLL);
 
-        // prepare kernel data (src0)
-        {
-            float * const wdata = (float *) params->wdata + 0;
+    // F32: the scores of one q row
+    size_t n = Mup;
 
-            for (int64_t i02 = 0; i02 < ne02; i02++) {
-                for (int64_t i01 = 0; i01 < ne01; i01++) {
-                    const float * const src = (float *)((char *) src0->data + i02*nb02 + i01*nb01);
-                    float * dst_data = wdata + i02*ew0*ne00;
-                    for (int64_t i00 = 0; i00 < ne00; i00++) {
-                        dst_data[i00*ew0 + i01] = src[i00];
-                    }
-                }
-            }
-        }
+    if (k->type == GGML_TYPE_F16) {
+        // the scores of a block of q rows in F32 and F16 + the q rows in F16
+        n = GGML_FLASH_ATTN_BQ*Mup + (GGML_FLASH_ATTN_BQ*(Mup + D) + 1)/2;
+    }
 
-        // prepare source data (src1)
-        {
-            float * const wdata = (float *) params->wdata + ne02*ew0*ne00;
+    return ((n + CACHE_LINE_SIZE_F32 - 1)/CACHE_LINE_SIZE_F32)*CACHE_LINE_SIZE_F32;
+}
 
-            for (int64_t i11 = 0; i11 < ne11; i11++) {
-                const float * const src = (float *)((char *) src1->data + i11*nb11);
-                float * dst_data = wdata;
-                for (int64_t i10 = 0; i10 < ne10; i10++) {
-                    dst_data[(i10 + nh)*ew0 + i11] = src[i10];
-                }
-            }
-        }
+// in-place softmax of the first n elements of S
+// S must have room for ggml_up(n, GGML_SOFT_MAX_UNROLL) elements, the ones past n are set to 0
+static void ggml_flash_attn_softmax_f32(const int n, float * S) {
+    int nup = ggml_up(n, GGML_SOFT_MAX_UNROLL);
 
-        return;
+    for (int i = n; i < nup; ++i) {
+        S[i] = -INFINITY;
     }
 
-    if (params->type == GGML_TASK_FINALIZE) {
-        return;
-    }
-
-    // total rows in dst
-    const int nr = ne02;
+    float max = -INFINITY;
+    ggml_vec_max_f32(n, &max, S);
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    ggml_float sum = 0.0;
+    {
+#ifdef GGML_SOFT_MAX_ACCELERATE
+        max = -max;
+        vDSP_vsadd(S, 1, &max, S, 1, nup);
+        vvexpf(S, S, &nup);
+        ggml_vec_sum_f32(nup, &sum, S);
+#else
+        uint16_t   scvt[GGML_SOFT_MAX_UNROLL];
+        ggml_float sump[GGML_SOFT_MAX_UNROLL] = { 0.0 };
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+        for (int i = 0; i < nup; i += GGML_SOFT_MAX_UNROLL) {
+            float * SS = S + i;
 
-    for (int i1 = ir0; i1 < ir1; i1++) {
-        float * dst_data = (float *)((char *) dst->data + i1*nb1);
-        for (int64_t i0 = 0; i0 < ne10; i0 += 2) {
-            dst_data[i0/2] = 0;
-            for (int k = -nh; k <= nh; k++) {
-                float v = 0.0f;
-                ggml_vec_dot_f32(ew0, &v,
-                        (float *) params->wdata +   i1*ew0*ne00 +      (nh + k)*ew0,
-                        (float *) params->wdata + ne02*ew0*ne00 + (i0 + nh + k)*ew0);
-
-                dst_data[i0/2] += v;
-            }
-        }
-    }
-}
-
-static void ggml_compute_forward_conv_1d_2s(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0,
-        const struct ggml_tensor * src1,
-        struct ggml_tensor * dst) {
-    switch (src0->type) {
-        case GGML_TYPE_F16:
-            {
-                ggml_compute_forward_conv_1d_2s_f16_f32(params, src0, src1, dst);
-            } break;
-        case GGML_TYPE_F32:
-            {
-                ggml_compute_forward_conv_1d_2s_f32(params, src0, src1, dst);
-            } break;
-        default:
-            {
-                GGML_ASSERT(false);
-            } break;
+            for (int j = 0; j < GGML_SOFT_MAX_UNROLL; ++j) {
+                if (SS[j] == -INFINITY) {
+                    SS[j] = 0.0f;
+                } else {
+                    ggml_fp16_t s = GGML_FP32_TO_FP16(SS[j] - max);
+                    memcpy(&scvt[j], &s, sizeof(uint16_t));
+                    const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt[j]]);
+                    sump[j] += (ggml_float)val;
+                    SS[j] = val;
+                }
+            }
+        }
+
+        for (int i = 0; i < GGML_SOFT_MAX_UNROLL; i++) {
+            sum += sump[i];
+        }
+#endif
     }
-}
 
-// ggml_compute_forward_flash_attn
+    assert(sum > 0.0);
+
+    sum = 1.0/sum;
+    ggml_vec_scale_f32(n, S, sum);
+
+#ifndef NDEBUG
+    for (int i = 0; i < n; ++i) {
+        assert(!isnan(S[i]));
+        assert(!isinf(S[i]));
+    }
+#endif
+}
 
 static void ggml_compute_forward_flash_attn_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * q,
         const struct ggml_tensor * k,
         const struct ggml_tensor * v,
-        const bool masked,
+        const float scale,
+        const int n_past,
              struct ggml_tensor * dst) {
     int64_t t0 = ggml_perf_time_us();
     UNUSED(t0);
@@ -12099,10 +12554,10 @@ static void ggml_compute_forward_flash_attn_f32(
 
     const int64_t nek0 = k->ne[0];
     const int64_t nek1 = k->ne[1];
-    //const int64_t nek2 = k->ne[2];
-    //const int64_t nek3 = k->ne[3];
+    const int64_t nek2 = k->ne[2];
+    const int64_t nek3 = k->ne[3];
 
-    //const int64_t nev0 = v->ne[0];
+    const int64_t nev0 = v->ne[0];
     const int64_t nev1 = v->ne[1];
     //const int64_t nev2 = v->ne[2];
     //const int64_t nev3 = v->ne[3];
@@ -12137,26 +12592,21 @@ static void ggml_compute_forward_flash_attn_f32(
 
     const int64_t D = neq0;
     const int64_t N = neq1;
-    const int64_t P = nek1 - N;
-    const int64_t M = P + N;
-
-    const int Mup = ggml_up(M, GGML_SOFT_MAX_UNROLL);
+    const int64_t M = nek1;
 
     GGML_ASSERT(ne0 == D);
     GGML_ASSERT(ne1 == N);
-    GGML_ASSERT(P >= 0);
 
     GGML_ASSERT(nbq0 == sizeof(float));
     GGML_ASSERT(nbk0 == sizeof(float));
     GGML_ASSERT(nbv0 == sizeof(float));
 
-    GGML_ASSERT(neq0 == D);
     GGML_ASSERT(nek0 == D);
+    GGML_ASSERT(nev0 == M);
     GGML_ASSERT(nev1 == D);
 
-    GGML_ASSERT(neq1 == N);
-    GGML_ASSERT(nek1 == N + P);
-    GGML_ASSERT(nev1 == D);
+    GGML_ASSERT(nek2 == neq2);
+    GGML_ASSERT(nek3 == neq3);
 
     // dst cannot be transposed or permuted
     GGML_ASSERT(nb0 == sizeof(float));
@@ -12184,9 +12634,7 @@ static void ggml_compute_forward_flash_attn_f32(
     const int ir0 = dr*ith;
     const int ir1 = MIN(ir0 + dr, nr);
 
-    const float scale = 1.0f/sqrtf(D);
-
-    //printf("P=%d N=%d D=%d ir0=%d ir1=%d scale = %f\n", P, N, D, ir0, ir1, scale);
+    float * S = (float *) params->wdata + ith*ggml_flash_attn_wsize(q, k);
 
     for (int ir = ir0; ir < ir1; ++ir) {
         // q indices
@@ -12194,98 +12642,24 @@ static void ggml_compute_forward_flash_attn_f32(
         const int iq2 = (ir - iq3*neq2*neq1)/neq1;
         const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
 
-        float * S = (float *) params->wdata + ith*(Mup + CACHE_LINE_SIZE_F32);
-
-        for (int i = M; i < Mup; ++i) {
-            S[i] = -INFINITY;
-        }
-
-        for (int64_t ic = 0; ic < nek1; ++ic) {
-            // k indices
-            const int ik3 = iq3;
-            const int ik2 = iq2;
-            const int ik1 = ic;
-
-            // S indices
-            const int i1 = ik1;
+        // the k rows past n_past + iq1 are masked
+        const int64_t Mq = n_past < 0 ? M : MIN(M, n_past + iq1 + 1);
 
+        for (int64_t ic = 0; ic < Mq; ++ic) {
             ggml_vec_dot_f32(neq0,
-                    S + i1,
-                    (float *) ((char *) k->data + (ik1*nbk1 + ik2*nbk2 + ik3*nbk3)),
+                    S + ic,
+                    (float *) ((char *) k->data + (ic*nbk1 + iq2*nbk2 + iq3*nbk3)),
                     (float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3)));
         }
 
-        // scale
-        ggml_vec_scale_f32(nek1, S, scale);
-
-        if (masked) {
-            for (int64_t i = P; i < M; i++) {
-                if (i > P + iq1) {
-                    S[i] = -INFINITY;
-                }
-            }
-        }
-
-        // softmax
-        {
-            float max = -INFINITY;
-            ggml_vec_max_f32(M, &max, S);
-
-            ggml_float sum = 0.0;
-            {
-#ifdef GGML_SOFT_MAX_ACCELERATE
-                max = -max;
-                vDSP_vsadd(S, 1, &max, S, 1, Mup);
-                vvexpf(S, S, &Mup);
-                ggml_vec_sum_f32(Mup, &sum, S);
-#else
-                uint16_t   scvt[GGML_SOFT_MAX_UNROLL];
-                ggml_float sump[GGML_SOFT_MAX_UNROLL] = { 0.0 };
-
-                for (int i = 0; i < Mup; i += GGML_SOFT_MAX_UNROLL) {
-                    float * SS = S + i;
-
-                    for (int j = 0; j < GGML_SOFT_MAX_UNROLL; ++j) {
-                        if (SS[j] == -INFINITY) {
-                            SS[j] = 0.0f;
-                        } else {
-                            ggml_fp16_t s = GGML_FP32_TO_FP16(SS[j] - max);
-                            memcpy(&scvt[j], &s, sizeof(uint16_t));
-                            const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt[j]]);
-                            sump[j] += (ggml_float)val;
-                            SS[j] = val;
-                        }
-                    }
-                }
-
-                for (int i = 0; i < GGML_SOFT_MAX_UNROLL; i++) {
-                    sum += sump[i];
-                }
-#endif
-            }
-
-            assert(sum > 0.0);
+        ggml_vec_scale_f32(Mq, S, scale);
 
-            sum = 1.0/sum;
-            ggml_vec_scale_f32(M, S, sum);
-
-#ifndef NDEBUG
-            for (int i = 0; i < M; ++i) {
-                assert(!isnan(S[i]));
-                assert(!isinf(S[i]));
-            }
-#endif
-        }
+        ggml_flash_attn_softmax_f32(Mq, S);
 
         for (int64_t ic = 0; ic < nev1; ++ic) {
-            // dst indices
-            const int i1 = iq1;
-            const int i2 = iq2;
-            const int i3 = iq3;
-
-            ggml_vec_dot_f32(nek1,
-                    (float *) ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2  + i3*nb3)),
-                    (float *) ((char *) v->data   + (         ic*nbv1 + i2*nbv2 + i3*nbv3)),
+            ggml_vec_dot_f32(Mq,
+                    (float *) ((char *) dst->data + (ic*nb0 + iq1*nb1  + iq2*nb2  + iq3*nb3)),
+                    (float *) ((char *) v->data   + (         ic*nbv1 + iq2*nbv2 + iq3*nbv3)),
                     S);
         }
     }
@@ -12296,7 +12670,8 @@ static void ggml_compute_forward_flash_attn_f16(
         const struct ggml_tensor * q,
         const struct ggml_tensor * k,
         const struct ggml_tensor * v,
-        const bool masked,
+        const float scale,
+        const int n_past,
              struct ggml_tensor * dst) {
     int64_t t0 = ggml_perf_time_us();
     UNUSED(t0);
@@ -12308,10 +12683,10 @@ static void ggml_compute_forward_flash_attn_f16(
 
     const int64_t nek0 = k->ne[0];
     const int64_t nek1 = k->ne[1];
-    //const int64_t nek2 = k->ne[2];
-    //const int64_t nek3 = k->ne[3];
+    const int64_t nek2 = k->ne[2];
+    const int64_t nek3 = k->ne[3];
 
-    //const int64_t nev0 = v->ne[0];
+    const int64_t nev0 = v->ne[0];
     const int64_t nev1 = v->ne[1];
     //const int64_t nev2 = v->ne[2];
     //const int64_t nev3 = v->ne[3];
@@ -12346,26 +12721,24 @@ static void ggml_compute_forward_flash_attn_f16(
 
     const int64_t D = neq0;
     const int64_t N = neq1;
-    const int64_t P = nek1 - N;
-    const int64_t M = P + N;
+    const int64_t M = nek1;
 
     const int Mup = ggml_up(M, GGML_SOFT_MAX_UNROLL);
 
     GGML_ASSERT(ne0 == D);
     GGML_ASSERT(ne1 == N);
-    GGML_ASSERT(P >= 0);
 
-    GGML_ASSERT(nbq0 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(q->type == GGML_TYPE_F16 || q->type == GGML_TYPE_F32);
+    GGML_ASSERT(nbq0 == (int) GGML_TYPE_SIZE[q->type]);
     GGML_ASSERT(nbk0 == sizeof(ggml_fp16_t));
     GGML_ASSERT(nbv0 == sizeof(ggml_fp16_t));
 
-    GGML_ASSERT(neq0 == D);
     GGML_ASSERT(nek0 == D);
+    GGML_ASSERT(nev0 == M);
     GGML_ASSERT(nev1 == D);
 
-    GGML_ASSERT(neq1 == N);
-    GGML_ASSERT(nek1 == N + P);
-    GGML_ASSERT(nev1 == D);
+    GGML_ASSERT(nek2 == neq2);
+    GGML_ASSERT(nek3 == neq3);
 
     // dst cannot be transposed or permuted
     GGML_ASSERT(nb0 == sizeof(float));
@@ -12381,159 +12754,78 @@ static void ggml_compute_forward_flash_attn_f16(
         return;
     }
 
-    // parallelize by q rows using ggml_vec_dot_f32
+    // parallelize by blocks of GGML_FLASH_ATTN_BQ q rows within the same head
+    // each block computes its scores and its output with the ggml_vec_dot_f16_tile register tiles, so that
+    // the k and v rows of the head are read once per block instead of once per q row
 
-    // total rows in q
-    const int nr = neq1*neq2*neq3;
+    // q blocks per head
+    const int nbq = (N + GGML_FLASH_ATTN_BQ - 1)/GGML_FLASH_ATTN_BQ;
 
-    // rows per thread
+    // total blocks
+    const int nr = nbq*neq2*neq3;
+
+    // blocks per thread
     const int dr = (nr + nth - 1)/nth;
 
-    // row range for this thread
+    // block range for this thread
     const int ir0 = dr*ith;
     const int ir1 = MIN(ir0 + dr, nr);
 
-    const float scale = 1.0f/sqrtf(D);
-
-    //printf("P=%d N=%d D=%d ir0=%d ir1=%d scale = %f\n", P, N, D, ir0, ir1, scale);
+    float       * S   = (float *) params->wdata + ith*ggml_flash_attn_wsize(q, k);
+    ggml_fp16_t * S16 = (ggml_fp16_t *) (S + GGML_FLASH_ATTN_BQ*Mup);
+    ggml_fp16_t * Q16 = S16 + GGML_FLASH_ATTN_BQ*Mup;
 
     for (int ir = ir0; ir < ir1; ++ir) {
-        // q indices
-        const int iq3 = ir/(neq2*neq1);
-        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
-        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
-
-        float * S = (float *) params->wdata + ith*(2*Mup + CACHE_LINE_SIZE_F32);
+        // q indices of the first row of the block
+        const int iq3 = ir/(neq2*nbq);
+        const int iq2 = (ir - iq3*neq2*nbq)/nbq;
+        const int iq1 = (ir - iq3*neq2*nbq - iq2*nbq)*GGML_FLASH_ATTN_BQ;
 
-        for (int i = M; i < Mup; ++i) {
-            S[i] = -INFINITY;
-        }
+        const int nq = MIN(GGML_FLASH_ATTN_BQ, N - iq1);
 
-        if (GGML_VEC_DOT_UNROLL > 2 || nek1 % GGML_VEC_DOT_UNROLL != 0) {
-            for (int64_t ic = 0; ic < nek1; ++ic) {
-                // k indices
-                const int ik3 = iq3;
-                const int ik2 = iq2;
-                const int ik1 = ic;
+        // the k rows past n_past + iq1 + nq - 1 are masked for all the q rows of the block
+        const int64_t Mb = n_past < 0 ? M : MIN(M, n_past + iq1 + nq);
 
-                // S indices
-                const int i1 = ik1;
+        for (int j = 0; j < nq; ++j) {
+            const char * q_row = (const char *) q->data + ((iq1 + j)*nbq1 + iq2*nbq2 + iq3*nbq3);
 
-                ggml_vec_dot_f16(neq0,
-                        S + i1,
-                        (ggml_fp16_t *) ((char *) k->data + (ik1*nbk1 + ik2*nbk2 + ik3*nbk3)),
-                        (ggml_fp16_t *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3)));
-            }
-        } else {
-            for (int64_t ic = 0; ic < nek1; ic += GGML_VEC_DOT_UNROLL) {
-                // k indices
-                const int ik3 = iq3;
-                const int ik2 = iq2;
-                const int ik1 = ic;
-
-                // S indices
-                const int i1 = ik1;
-
-                ggml_vec_dot_f16_unroll(neq0, nbk1,
-                        S + i1,
-                        ((char *) k->data + (ik1*nbk1 + ik2*nbk2 + ik3*nbk3)),
-                        (ggml_fp16_t *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3)));
+            if (q->type == GGML_TYPE_F32) {
+                ggml_fp32_to_fp16_row((const float *) q_row, Q16 + j*D, D);
+            } else {
+                memcpy(Q16 + j*D, q_row, D*sizeof(ggml_fp16_t));
             }
         }
 
-        // scale
-        ggml_vec_scale_f32(nek1, S, scale);
-
-        if (masked) {
-            for (int64_t i = P; i < M; i++) {
-                if (i > P + iq1) {
-                    S[i] = -INFINITY;
-                }
-            }
-        }
+        // S[j*Mup + i] = k[i] . q[j]
+        ggml_vec_dot_f16_block(D, Mb, nq,
+                S, Mup,
+                (ggml_fp16_t *) ((char *) k->data + (iq2*nbk2 + iq3*nbk3)), nbk1/sizeof(ggml_fp16_t),
+                Q16, D);
 
-        // softmax
-        {
-            float max = -INFINITY;
-            ggml_vec_max_f32(M, &max, S);
+        for (int j = 0; j < nq; ++j) {
+            float       * Sj   = S   + j*Mup;
+            ggml_fp16_t * S16j = S16 + j*Mup;
 
-            ggml_float sum = 0.0;
-            {
-#ifdef GGML_SOFT_MAX_ACCELERATE
-                max = -max;
-                vDSP_vsadd(S, 1, &max, S, 1, Mup);
-                vvexpf(S, S, &Mup);
-                ggml_vec_sum_f32(Mup, &sum, S);
-#else
-                uint16_t   scvt[GGML_SOFT_MAX_UNROLL];
-                ggml_float sump[GGML_SOFT_MAX_UNROLL] = { 0.0 };
+            const int64_t Mq = n_past < 0 ? Mb : MIN(Mb, n_past + iq1 + j + 1);
 
-                for (int i = 0; i < Mup; i += GGML_SOFT_MAX_UNROLL) {
-                    float * SS = S + i;
+            ggml_vec_scale_f32(Mq, Sj, scale);
 
-                    for (int j = 0; j < GGML_SOFT_MAX_UNROLL; ++j) {
-                        if (SS[j] == -INFINITY) {
-                            SS[j] = 0.0f;
-                        } else {
-                            ggml_fp16_t s = GGML_FP32_TO_FP16(SS[j] - max);
-                            memcpy(&scvt[j], &s, sizeof(uint16_t));
-                            const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt[j]]);
-                            sump[j] += (ggml_float)val;
-                            SS[j] = val;
-                        }
-                    }
-                }
+            ggml_flash_attn_softmax_f32(Mq, Sj);
 
-                for (int i = 0; i < GGML_SOFT_MAX_UNROLL; i++) {
-                    sum += sump[i];
-                }
-#endif
+            for (int64_t i = 0; i < Mq; i++) {
+                S16j[i] = GGML_FP32_TO_FP16(Sj[i]);
             }
 
-            assert(sum > 0.0);
-
-            sum = 1.0/sum;
-            ggml_vec_scale_f32(M, S, sum);
-
-#ifndef NDEBUG
-            for (int i = 0; i < M; ++i) {
-                assert(!isnan(S[i]));
-                assert(!isinf(S[i]));
+            for (int64_t i = Mq; i < Mb; i++) {
+                S16j[i] = 0;
             }
-#endif
         }
 
-        ggml_fp16_t * S16 = (ggml_fp16_t *) ((float *) params->wdata + ith*(2*Mup + CACHE_LINE_SIZE_F32) + Mup);
-
-        for (int64_t i = 0; i < M; i++) {
-            S16[i] = GGML_FP32_TO_FP16(S[i]);
-        }
-
-        if (GGML_VEC_DOT_UNROLL == 1 || (nev1 % GGML_VEC_DOT_UNROLL != 0)) {
-            for (int64_t ic = 0; ic < nev1; ++ic) {
-                // dst indices
-                const int i1 = iq1;
-                const int i2 = iq2;
-                const int i3 = iq3;
-
-                ggml_vec_dot_f16(nek1,
-                        (float *)       ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2  + i3*nb3)),
-                        (ggml_fp16_t *) ((char *) v->data   + (         ic*nbv1 + i2*nbv2 + i3*nbv3)),
-                        S16);
-            }
-        } else {
-            for (int64_t ic = 0; ic < nev1; ic += GGML_VEC_DOT_UNROLL) {
-                // dst indices
-                const int i1 = iq1;
-                const int i2 = iq2;
-                const int i3 = iq3;
-
-                ggml_vec_dot_f16_unroll(nek1, nbv1,
-                        (float *) ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2  + i3*nb3)),
-                        ((char *) v->data   + (         ic*nbv1 + i2*nbv2 + i3*nbv3)),
-                        S16);
-            }
-        }
+        // dst[j][ic] = v[ic] . S16[j]
+        ggml_vec_dot_f16_block(Mb, nev1, nq,
+                (float *) ((char *) dst->data + (iq1*nb1 + iq2*nb2 + iq3*nb3)), nb1/sizeof(float),
+                (ggml_fp16_t *) ((char *) v->data + (iq2*nbv2 + iq3*nbv3)), nbv1/sizeof(ggml_fp16_t),
+                S16, Mup);
     }
 }
 
@@ -12542,16 +12834,17 @@ static void ggml_compute_forward_flash_attn(
         const struct ggml_tensor * q,
         const struct ggml_tensor * k,
         const struct ggml_tensor * v,
-        const bool masked,
+        const float scale,
+        const int n_past,
         struct ggml_tensor * dst) {
-    switch (q->type) {
+    switch (k->type) {
         case GGML_TYPE_F16:
             {
-                ggml_compute_forward_flash_attn_f16(params, q, k, v, masked, dst);
+                ggml_compute_forward_flash_attn_f16(params, q, k, v, scale, n_past, dst);
             } break;
         case GGML_TYPE_F32:
             {
-                ggml_compute_forward_flash_attn_f32(params, q, k, v, masked, dst);
+                ggml_compute_forward_flash_attn_f32(params, q, k, v, scale, n_past, dst);
             } break;
         default:
             {
@@ -12861,6 +13154,26 @@ static void ggml_compute_forward_map_binary(
 
 /////////////////////////////////
 
+// whether all the threads of the node take part in its INIT phase
+// by default, the INIT phase is run by the main thread only
+static bool ggml_compute_forward_init_parallel(const struct ggml_tensor * tensor) {
+    switch (tensor->op) {
+        case GGML_OP_MUL_MAT:
+            {
+                return ggml_compute_forward_mul_mat_init_parallel(tensor->src0, tensor->src1);
+            }
+        case GGML_OP_CONV_1D_1S:
+        case GGML_OP_CONV_1D_2S:
+            {
+                return true;
+            }
+        default:
+            {
+                return false;
+            }
+    }
+}
+
 static void ggml_compute_forward(struct ggml_compute_params * params, struct ggml_tensor * tensor) {
     GGML_ASSERT(params);
 
@@ -13051,10 +13364,9 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             } break;
         case GGML_OP_FLASH_ATTN:
             {
-                int32_t t = ggml_get_i32_1d(tensor->opt[1], 0);
-                GGML_ASSERT(t == 0 || t == 1);
-                bool masked = t != 0;
-                ggml_compute_forward_flash_attn(params, tensor->src0, tensor->src1, tensor->opt[0], masked, tensor);
+                const int32_t n_past = ggml_get_i32_1d(tensor->opt[1], 0);
+                const float   scale  = ggml_get_f32_1d(tensor->opt[2], 0);
+                ggml_compute_forward_flash_attn(params, tensor->src0, tensor->src1, tensor->opt[0], scale, n_past, tensor);
             } break;
         case GGML_OP_FLASH_FF:
             {
@@ -13850,6 +14162,7 @@ struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
         /*.n_nodes      =*/ 0,
         /*.n_leafs      =*/ 0,
         /*.n_threads    =*/ GGML_DEFAULT_N_THREADS,
+        /*.threadpool   =*/ NULL,
         /*.work_size    =*/ 0,
         /*.work         =*/ NULL,
         /*.nodes        =*/ { NULL },
@@ -13984,6 +14297,21 @@ struct ggml_compute_state {
     struct ggml_tensor * node;
 
     struct ggml_compute_state_shared * shared;
+    struct ggml_threadpool * pool; // NULL if the thread was spawned for a single graph
+};
+
+struct ggml_threadpool {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+
+    int n_threads; // including the thread that calls ggml_graph_compute()
+
+    int  n_graph;  // incremented for each graph submitted to the workers
+    bool stop;     // terminate the workers
+
+    atomic_int n_active; // number of workers still processing the current graph
+
+    struct ggml_compute_state * workers;
 };
 
 static thread_ret_t ggml_graph_compute_thread(void * data) {
@@ -14034,9 +14362,104 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     return 0;
 }
 
+// the workers of a thread pool are parked on a condition variable in between graphs
+// while a graph is being computed, they synchronize via the busy loops in ggml_graph_compute_thread()
+static thread_ret_t ggml_threadpool_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool    * pool  = state->pool;
+
+    int n_graph = 0;
+
+    while (true) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->n_graph == n_graph && !pool->stop) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        const bool stop = pool->stop;
+        n_graph = pool->n_graph;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (stop) {
+            break;
+        }
+
+        ggml_graph_compute_thread(state);
+
+        atomic_fetch_sub(&pool->n_active, 1);
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(int n_threads) {
+    GGML_ASSERT(n_threads > 0);
+
+    struct ggml_threadpool * pool = malloc(sizeof(struct ggml_threadpool));
+    GGML_ASSERT(pool != NULL);
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init (&pool->cond,  NULL);
+
+    pool->n_threads = n_threads;
+    pool->n_graph   = 0;
+    pool->stop      = false;
+    pool->workers   = n_threads > 1 ? malloc(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
+
+    atomic_store(&pool->n_active, 0);
+
+    for (int j = 0; j < n_threads - 1; j++) {
+        pool->workers[j] = (struct ggml_compute_state) {
+            .thrd   = 0,
+            .params = { .type = GGML_TASK_COMPUTE, .ith = j + 1, .nth = n_threads, .wsize = 0, .wdata = NULL },
+            .node   = NULL,
+            .shared = NULL,
+            .pool   = pool,
+        };
+
+        int rc = ggml_thread_create(&pool->workers[j].thrd, NULL, ggml_threadpool_thread, &pool->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    return pool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int j = 0; j < pool->n_threads - 1; j++) {
+        int rc = ggml_thread_join(pool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    pthread_cond_destroy (&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+
+    free(pool->workers);
+    free(pool);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool) {
+    return pool->n_threads;
+}
+
 void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
     const int n_threads = cgraph->n_threads;
 
+    struct ggml_threadpool * pool = cgraph->threadpool;
+    if (pool != NULL && pool->n_threads != n_threads) {
+        // the pool was created for a different number of threads - spawn new ones instead
+        pool = NULL;
+    }
+
     struct ggml_compute_state_shared state_shared = {
         /*.spin      =*/ GGML_LOCK_INITIALIZER,
         /*.n_threads =*/ n_threads,
@@ -14044,17 +14467,19 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         /*.has_work  =*/ false,
         /*.stop      =*/ false,
     };
-    struct ggml_compute_state * workers = n_threads > 1 ? alloca(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
+    struct ggml_compute_state * workers = pool ? pool->workers : n_threads > 1 ? alloca(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
 
-    // create thread pool
+    // create thread pool (or wake up the workers of the provided one)
     if (n_threads > 1) {
         ggml_lock_init(&state_shared.spin);
 
         atomic_store(&state_shared.has_work, true);
 
         for (int j = 0; j < n_threads - 1; j++) {
+            const ggml_thread_t thrd = pool ? workers[j].thrd : 0;
+
             workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
+                .thrd   = thrd,
                 .params = {
                     .type  = GGML_TASK_COMPUTE,
                     .ith   = j + 1,
@@ -14064,11 +14489,22 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                 },
                 .node   = NULL,
                 .shared = &state_shared,
+                .pool   = pool,
             };
 
-            int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
+            if (pool == NULL) {
+                int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
+                GGML_ASSERT(rc == 0);
+                UNUSED(rc);
+            }
+        }
+
+        if (pool) {
+            pthread_mutex_lock(&pool->mutex);
+            atomic_store(&pool->n_active, n_threads - 1);
+            pool->n_graph++;
+            pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->mutex);
         }
     }
 
@@ -14088,7 +14524,8 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
 
                         size_t cur = 0;
                         if (ggml_is_quantized(node->type)) {
-                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->ne[0] * n_threads;
+                            // one row of src0 converted to F32 per thread (see ggml_compute_forward_dup_f16)
+                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * (node->src0->ne[0] + CACHE_LINE_SIZE_F32) * n_threads;
                         }
 
                         work_size = MAX(work_size, cur);
@@ -14245,20 +14682,19 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                         GGML_ASSERT(node->src1->ne[3] == 1);
 
                         size_t cur = 0;
-                        const int nk = node->src0->ne[0];
+                        const bool packed = ggml_conv_1d_kernel_is_packed(node);
+                        const int  nk     = node->src0->ne[packed ? 1 : 0];
+
+                        // the padded input, followed by the reordered kernel unless it is already packed
+                        const size_t ne_src0 = packed ? 0 : ggml_nelements(node->src0);
+                        const size_t ne_src1 = (2*(nk/2) + node->src1->ne[0])*node->src1->ne[1];
 
                         if (node->src0->type == GGML_TYPE_F16 &&
                             node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(ggml_fp16_t)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
+                            cur = sizeof(ggml_fp16_t)*(ne_src0 + ne_src1);
                         } else if (node->src0->type == GGML_TYPE_F32 &&
                                    node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(float)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
+                            cur = sizeof(float)*(ne_src0 + ne_src1);
                         } else {
                             GGML_ASSERT(false);
                         }
@@ -14269,19 +14705,7 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                     {
                         node->n_tasks = n_threads;
 
-                        size_t cur = 0;
-
-                        const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
-
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
-
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+                        const size_t cur = sizeof(float)*ggml_flash_attn_wsize(node->src0, node->src1)*node->n_tasks;
 
                         work_size = MAX(work_size, cur);
                     } break;
@@ -14348,6 +14772,40 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         const int64_t perf_node_start_time_us = ggml_perf_time_us();
 
         // INIT
+        const bool init_parallel = node->n_tasks > 1 && ggml_compute_forward_init_parallel(node);
+
+        if (init_parallel) {
+            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
+                atomic_store(&state_shared.has_work, false);
+            }
+
+            while (atomic_load(&state_shared.has_work)) {
+                ggml_lock_lock  (&state_shared.spin);
+                ggml_lock_unlock(&state_shared.spin);
+            }
+
+            // launch thread pool
+            for (int j = 0; j < n_threads - 1; j++) {
+                workers[j].params = (struct ggml_compute_params) {
+                    .type  = GGML_TASK_INIT,
+                    .ith   = j + 1,
+                    .nth   = node->n_tasks,
+                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
+                    .wdata = cgraph->work ? cgraph->work->data : NULL,
+                };
+                workers[j].node = node;
+            }
+
+            atomic_fetch_sub(&state_shared.n_ready, 1);
+
+            while (atomic_load(&state_shared.n_ready) > 0) {
+                ggml_lock_lock  (&state_shared.spin);
+                ggml_lock_unlock(&state_shared.spin);
+            }
+
+            atomic_store(&state_shared.has_work, true);
+        }
+
         struct ggml_compute_params params = {
             /*.type  =*/ GGML_TASK_INIT,
             /*.ith   =*/ 0,
@@ -14358,6 +14816,25 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
 
         ggml_compute_forward(&params, node);
 
+        // wait for thread pool
+        if (init_parallel) {
+            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
+                atomic_store(&state_shared.has_work, false);
+            }
+
+            while (atomic_load(&state_shared.has_work)) {
+                ggml_lock_lock  (&state_shared.spin);
+                ggml_lock_unlock(&state_shared.spin);
+            }
+
+            atomic_fetch_sub(&state_shared.n_ready, 1);
+
+            while (atomic_load(&state_shared.n_ready) != 0) {
+                ggml_lock_lock  (&state_shared.spin);
+                ggml_lock_unlock(&state_shared.spin);
+            }
+        }
+
         // COMPUTE
         if (node->n_tasks > 1) {
             if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
@@ -14484,10 +14961,18 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         atomic_store(&state_shared.stop, true);
         atomic_store(&state_shared.has_work, true);
 
-        for (int j = 0; j < n_threads - 1; j++) {
-            int rc = ggml_thread_join(workers[j].thrd, NULL);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
+        if (pool) {
+            // state_shared lives on this stack frame - wait for all workers to leave it before returning
+            while (atomic_load(&pool->n_active) > 0) {
+                ggml_lock_lock  (&state_shared.spin);
+                ggml_lock_unlock(&state_shared.spin);
+            }
+        } else {
+            for (int j = 0; j < n_threads - 1; j++) {
+                int rc = ggml_thread_join(workers[j].thrd, NULL);
+                GGML_ASSERT(rc == 0);
+                UNUSED(rc);
+            }
         }
 
         ggml_lock_destroy(&state_shared.spin);
@@ -15562,6 +16047,72 @@ size_t ggml_quantize_chunk(enum ggml_type type, const float * src, void * dst, i
     return result;
 }
 
+bool ggml_repack(struct ggml_tensor * tensor) {
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST)
+    // the GPU backends only know the original block layouts
+    UNUSED(tensor);
+    return false;
+#elif !defined(__ARM_NEON) && !defined(__AVX__)
+    // the scalar 4-row kernels are not faster than the row by row ones
+    UNUSED(tensor);
+    return false;
+#else
+    enum ggml_type type_x4;
+
+    switch (tensor->type) {
+        case GGML_TYPE_Q4_0: type_x4 = GGML_TYPE_Q4_0_X4; break;
+        case GGML_TYPE_Q8_0: type_x4 = GGML_TYPE_Q8_0_X4; break;
+        default:
+            return false;
+    }
+
+    if (tensor->data == NULL || !ggml_is_contiguous(tensor)) {
+        return false;
+    }
+
+    // only 2D tensors can keep a few rows after the last group
+    if (tensor->ne[1] % GGML_REPACK_NROWS != 0 && (tensor->ne[2] != 1 || tensor->ne[3] != 1)) {
+        return false;
+    }
+
+    // the blocks of both types are a delta followed by the quants, so they are interleaved as
+    // the GGML_REPACK_NROWS deltas followed by the GGML_REPACK_NROWS quants
+    const size_t  bs = GGML_TYPE_SIZE[tensor->type];
+    const size_t  qs = bs - sizeof(ggml_fp16_t);
+    const int64_t nb = tensor->ne[0]/GGML_BLCK_SIZE[tensor->type];
+    const int     nr = ggml_nrows(tensor) - tensor->ne[1] % GGML_REPACK_NROWS;
+    const size_t  rs = tensor->nb[1];
+
+    char * tmp = malloc(GGML_REPACK_NROWS*rs);
+    if (tmp == NULL) {
+        return false;
+    }
+
+    for (int ir = 0; ir < nr; ir += GGML_REPACK_NROWS) {
+        char * data = (char *) tensor->data + ir*rs;
+
+        memcpy(tmp, data, GGML_REPACK_NROWS*rs);
+
+        for (int64_t i = 0; i < nb; ++i) {
+            char * y = data + i*GGML_REPACK_NROWS*bs;
+
+            for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+                const char * x = tmp + r*rs + i*bs;
+
+                memcpy(y + r*sizeof(ggml_fp16_t), x, sizeof(ggml_fp16_t));
+                memcpy(y + GGML_REPACK_NROWS*sizeof(ggml_fp16_t) + r*qs, x + sizeof(ggml_fp16_t), qs);
+            }
+        }
+    }
+
+    free(tmp);
+
+    tensor->type = type_x4;
+
+    return true;
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 int ggml_cpu_has_avx(void) {
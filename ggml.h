@@ -228,6 +228,7 @@ extern "C" {
 
     struct ggml_object;
     struct ggml_context;
+    struct ggml_threadpool;
 
     enum ggml_type {
         GGML_TYPE_F32  = 0,
@@ -243,6 +244,9 @@ extern "C" {
         GGML_TYPE_I8,
         GGML_TYPE_I16,
         GGML_TYPE_I32,
+        // runtime-only layouts produced by ggml_repack(), never stored in model files
+        GGML_TYPE_Q4_0_X4,
+        GGML_TYPE_Q8_0_X4,
         GGML_TYPE_COUNT,
     };
 
@@ -382,6 +386,10 @@ extern "C" {
         int n_leafs;
         int n_threads;
 
+        // if not NULL and created with n_threads, the graph is computed by the workers of this pool
+        // otherwise, n_threads - 1 new threads are spawned for each ggml_graph_compute() call
+        struct ggml_threadpool * threadpool;
+
         size_t work_size;
         struct ggml_tensor * work;
 
@@ -923,6 +931,25 @@ extern "C" {
             struct ggml_tensor  * a,
             struct ggml_tensor  * b);
 
+    // copy a conv_1d kernel [taps, input channels, output channels] into a new tensor of ctx, transposed to
+    // [input channels, taps, output channels], which ggml_conv_1d_1s_packed/2s_packed use without reordering it
+    // for every call - the data is copied when the function is called, so it is meant for weights
+    // returns NULL if a is not a contiguous F16/F32 tensor with data
+    GGML_API struct ggml_tensor * ggml_conv_1d_pack_kernel(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a);
+
+    // same as ggml_conv_1d_1s/2s, with a kernel returned by ggml_conv_1d_pack_kernel
+    GGML_API struct ggml_tensor * ggml_conv_1d_1s_packed(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b);
+
+    GGML_API struct ggml_tensor * ggml_conv_1d_2s_packed(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b);
+
     GGML_API struct ggml_tensor * ggml_flash_attn(
             struct ggml_context * ctx,
             struct ggml_tensor  * q,
@@ -930,6 +957,19 @@ extern "C" {
             struct ggml_tensor  * v,
             bool                  masked);
 
+    // softmax(scale * k*q^T) * v without materializing k*q^T
+    // q: [D, N, H], k: [D, M, H], v: [M, D, H] (transposed), result: [D, N, H] F32
+    // k and v are both F16 (q is F16 or F32) or both F32 (q is F32)
+    // n_past >= 0: q row j attends only to the k rows i <= n_past + j
+    // n_past <  0: no mask
+    GGML_API struct ggml_tensor * ggml_flash_attn_ext(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * v,
+            float                 scale,
+            int                   n_past);
+
     GGML_API struct ggml_tensor * ggml_flash_ff(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
@@ -966,6 +1006,13 @@ extern "C" {
     GGML_API struct ggml_cgraph ggml_build_forward (struct ggml_tensor * tensor);
     GGML_API struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep);
 
+    // persistent worker threads that can be shared by multiple ggml_graph_compute() calls
+    // the workers sleep on a condition variable while there is no graph to compute
+    // a pool must not be used by more than one ggml_graph_compute() call at a time
+    GGML_API struct ggml_threadpool * ggml_threadpool_new      (int n_threads);
+    GGML_API void                     ggml_threadpool_free     (struct ggml_threadpool * pool);
+    GGML_API int                      ggml_threadpool_n_threads(const struct ggml_threadpool * pool);
+
     GGML_API void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
     GGML_API void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
@@ -1086,6 +1133,12 @@ extern "C" {
 
     GGML_API size_t ggml_quantize_chunk(enum ggml_type type, const float * src, void * dst, int start, int n, int64_t * hist);
 
+    // interleave the blocks of each group of 4 rows of a 2D Q4_0 or Q8_0 tensor in place
+    // (Q4_0 -> Q4_0_X4, Q8_0 -> Q8_0_X4) so that ggml_mul_mat computes 4 rows per pass
+    // returns false and leaves the tensor untouched if it cannot be repacked
+    // the result can only be used as src0 of ggml_mul_mat
+    GGML_API bool ggml_repack(struct ggml_tensor * tensor);
+
     //
     // system info
     //
@@ -117,7 +117,7 @@ fout.write(struct.pack("i", hparams["d_model"]))
 fout.write(struct.pack("i", hparams["decoder_attention_heads"]))
 fout.write(struct.pack("i", hparams["decoder_layers"]))
 fout.write(struct.pack("i", hparams["num_mel_bins"]))
-fout.write(struct.pack("i", use_f16))
+fout.write(struct.pack("i", use_f16 | 0x10000)) # 0x10000: the tensor data is aligned to 32 bytes
 
 fout.write(struct.pack("i", filters.shape[0]))
 fout.write(struct.pack("i", filters.shape[1]))
@@ -199,6 +199,9 @@ for name in list_vars.keys():
         fout.write(struct.pack("i", data.shape[n_dims - 1 - i]))
     fout.write(str_)
 
+    # padding, so that the data is aligned to 32 bytes from the start of the file
+    fout.write(bytes(-fout.tell() % 32))
+
     # data
     data.tofile(fout)
 
@@ -253,7 +253,7 @@ fout.write(struct.pack("i", hparams["n_text_state"]))
 fout.write(struct.pack("i", hparams["n_text_head"]))
 fout.write(struct.pack("i", hparams["n_text_layer"]))
 fout.write(struct.pack("i", hparams["n_mels"]))
-fout.write(struct.pack("i", use_f16))
+fout.write(struct.pack("i", use_f16 | 0x10000)) # 0x10000: the tensor data is aligned to 32 bytes
 
 # write mel filters
 fout.write(struct.pack("i", filters.shape[0]))
@@ -312,6 +312,9 @@ for name in list_vars.keys():
         fout.write(struct.pack("i", data.shape[n_dims - 1 - i]))
     fout.write(str_)
 
+    # padding, so that the data is aligned to 32 bytes from the start of the file
+    fout.write(bytes(-fout.tell() % 32))
+
     # data
     data.tofile(fout)
 
@@ -0,0 +1,186 @@
+// Compares ggml_conv_1d_1s/2s and ggml_conv_1d_1s_packed/2s_packed with a convolution computed tap by tap
+//
+// usage: test-conv-1d
+//
+// The reference sums the products of each tap and input channel in double precision, from the same F16 rounded
+// values as the kernels. The packed and unpacked kernels must give identical results, for any number of threads
+// (the kernel and the input are reordered by all the threads) and for outputs that do not fill the 4x3 tiles.
+
+#include "ggml.h"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+struct test_shape {
+    int nk;  // taps
+    int nc;  // input channels
+    int nt;  // input length
+    int nco; // output channels
+};
+
+static std::vector<float> to_vector(const struct ggml_tensor * t) {
+    const float * data = (const float *) t->data;
+    return std::vector<float>(data, data + ggml_nelements(t));
+}
+
+static float get_f32(const struct ggml_tensor * t, int i) {
+    if (t->type == GGML_TYPE_F16) {
+        return ggml_fp16_to_fp32(((const ggml_fp16_t *) t->data)[i]);
+    }
+    return ((const float *) t->data)[i];
+}
+
+static std::vector<float> compute(struct ggml_context * ctx, struct ggml_tensor * t, int n_threads) {
+    struct ggml_cgraph gf = ggml_build_forward(t);
+    gf.n_threads = n_threads;
+
+    ggml_graph_compute(ctx, &gf);
+
+    return to_vector(t);
+}
+
+static bool test_conv_1d(enum ggml_type type, const test_shape & shape, int s, std::mt19937 & rng) {
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 16*1024*1024,
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    const int nk  = shape.nk;
+    const int nc  = shape.nc;
+    const int nt  = shape.nt;
+    const int nco = shape.nco;
+    const int nh  = nk/2;
+    const int no  = nt/s;
+
+    struct ggml_tensor * w = ggml_new_tensor_3d(ctx, type,          nk, nc, nco);
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, nt, nc);
+
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    for (int i = 0; i < ggml_nelements(w); ++i) {
+        if (type == GGML_TYPE_F16) {
+            ((ggml_fp16_t *) w->data)[i] = ggml_fp32_to_fp16(dist(rng));
+        } else {
+            ((float *) w->data)[i] = dist(rng);
+        }
+    }
+
+    for (int i = 0; i < ggml_nelements(x); ++i) {
+        ((float *) x->data)[i] = dist(rng);
+    }
+
+    // the F16 kernels multiply the input rounded to F16
+    std::vector<float> xr(ggml_nelements(x));
+    for (int i = 0; i < (int) xr.size(); ++i) {
+        const float v = ((float *) x->data)[i];
+        xr[i] = type == GGML_TYPE_F16 ? ggml_fp16_to_fp32(ggml_fp32_to_fp16(v)) : v;
+    }
+
+    // reference: one tap at a time, with zero padding of nh on each side
+    std::vector<double> ref(no*nco);
+    std::vector<double> ref_abs(no*nco);
+
+    for (int i1 = 0; i1 < nco; ++i1) {
+        for (int i0 = 0; i0 < no; ++i0) {
+            double sum     = 0.0;
+            double sum_abs = 0.0;
+            for (int ic = 0; ic < nc; ++ic) {
+                for (int ik = 0; ik < nk; ++ik) {
+                    const int it = s*i0 + ik - nh;
+                    if (it < 0 || it >= nt) {
+                        continue;
+                    }
+                    const double p = (double) get_f32(w, (i1*nc + ic)*nk + ik)*xr[ic*nt + it];
+                    sum     += p;
+                    sum_abs += fabs(p);
+                }
+            }
+            ref    [i1*no + i0] = sum;
+            ref_abs[i1*no + i0] = sum_abs;
+        }
+    }
+
+    struct ggml_tensor * wp = ggml_conv_1d_pack_kernel(ctx, w);
+
+    bool ok = true;
+
+    if (wp == nullptr) {
+        fprintf(stderr, "%s: %s: ggml_conv_1d_pack_kernel() failed\n", __func__, ggml_type_name(type));
+        ok = false;
+    }
+
+    const float eps = type == GGML_TYPE_F16 ? 1e-3f : 1e-5f;
+
+    for (int n_threads : { 1, 2, 3, 4 }) {
+        if (!ok) {
+            break;
+        }
+
+        const std::vector<float> cur = compute(ctx, s == 1 ? ggml_conv_1d_1s(ctx, w, x) : ggml_conv_1d_2s(ctx, w, x), n_threads);
+        const std::vector<float> pck = compute(ctx, s == 1 ? ggml_conv_1d_1s_packed(ctx, wp, x) : ggml_conv_1d_2s_packed(ctx, wp, x), n_threads);
+
+        if (cur != pck) {
+            fprintf(stderr, "%s: %s [%d, %d, %d] x [%d, %d], stride %d, %d threads: the packed kernel gives different results\n",
+                    __func__, ggml_type_name(type), nk, nc, nco, nt, nc, s, n_threads);
+            ok = false;
+        }
+
+        for (int i = 0; i < (int) cur.size(); ++i) {
+            if (fabs(cur[i] - ref[i]) > eps*(ref_abs[i] + 1.0)) {
+                fprintf(stderr, "%s: %s [%d, %d, %d] x [%d, %d], stride %d, %d threads: output %d is %f, expected %f\n",
+                        __func__, ggml_type_name(type), nk, nc, nco, nt, nc, s, n_threads, i, cur[i], ref[i]);
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(void) {
+    // initialize the fp16 tables
+    {
+        struct ggml_init_params params = { 0, NULL, false };
+        struct ggml_context * ctx = ggml_init(params);
+        ggml_free(ctx);
+    }
+
+    const test_shape shapes[] = {
+        { 3,  1,   8,  1 },
+        { 3,  4,  16,  3 },
+        { 3,  7,  33,  5 },
+        { 3, 16,  64, 16 },
+        { 3, 13,  50, 17 },
+        { 5,  9,  31, 40 },
+        { 1,  8,  12,  7 },
+        { 3, 80, 100, 35 },
+    };
+
+    std::mt19937 rng(42);
+
+    int n_failed = 0;
+    int n_tests  = 0;
+
+    for (enum ggml_type type : { GGML_TYPE_F16, GGML_TYPE_F32 }) {
+        for (const auto & shape : shapes) {
+            for (int s : { 1, 2 }) {
+                n_tests++;
+                if (!test_conv_1d(type, shape, s, rng)) {
+                    n_failed++;
+                }
+            }
+        }
+    }
+
+    fprintf(stderr, "%s: %d / %d tests passed\n", __func__, n_tests - n_failed, n_tests);
+
+    return n_failed == 0 ? 0 : 1;
+}
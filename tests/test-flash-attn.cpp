@@ -0,0 +1,177 @@
+// Compares ggml_flash_attn_ext with soft_max(scale*K*Q)*V computed by ggml_mul_mat, ggml_diag_mask_inf and
+// ggml_soft_max
+//
+// usage: test-flash-attn
+//
+// Covers q in F16 and F32 with F16 K/V, F32 q/K/V, partial blocks of q rows (N not a multiple of the block size),
+// causal masks with several n_past (including blocks whose last keys are all masked) and several threads.
+// The memory past the work buffer is checked to detect a work size that is too small.
+
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#define TEST_GUARD_SIZE 4096
+#define TEST_GUARD_BYTE 0xa5
+
+struct test_case {
+    enum ggml_type type_q;
+    enum ggml_type type_kv;
+
+    int D;      // head size
+    int N;      // q rows
+    int M;      // k rows
+    int H;      // heads
+    int n_past; // -1 for no mask
+};
+
+static void fill(struct ggml_tensor * t, const std::vector<float> & data) {
+    for (int i = 0; i < (int) data.size(); ++i) {
+        if (t->type == GGML_TYPE_F16) {
+            ((ggml_fp16_t *) t->data)[i] = ggml_fp32_to_fp16(data[i]);
+        } else {
+            ((float *) t->data)[i] = data[i];
+        }
+    }
+}
+
+// computes the graph of t and checks that the memory after the work buffer is not touched
+static bool compute(struct ggml_context * ctx, struct ggml_tensor * t, int n_threads) {
+    struct ggml_cgraph gf = ggml_build_forward(t);
+    gf.n_threads = n_threads;
+
+    ggml_graph_compute(ctx, &gf);
+
+    if (gf.work) {
+        const uint8_t * guard = (const uint8_t *) gf.work->data + ggml_nbytes(gf.work);
+        for (int i = 0; i < TEST_GUARD_SIZE; ++i) {
+            if (guard[i] != TEST_GUARD_BYTE) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool test_flash_attn(const test_case & tc, int n_threads, std::mt19937 & rng) {
+    const int D = tc.D;
+    const int N = tc.N;
+    const int M = tc.M;
+    const int H = tc.H;
+
+    const float scale = 1.0f/sqrtf(float(D));
+
+    std::vector<uint8_t> buf(4*1024*1024, TEST_GUARD_BYTE);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ buf.size(),
+        /*.mem_buffer =*/ buf.data(),
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * q = ggml_new_tensor_3d(ctx, tc.type_q,  D, N, H);
+    struct ggml_tensor * k = ggml_new_tensor_3d(ctx, tc.type_kv, D, M, H);
+    struct ggml_tensor * v = ggml_new_tensor_3d(ctx, tc.type_kv, M, D, H);
+
+    // the reference is computed from the same rounded values
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+
+    for (struct ggml_tensor * t : { q, k, v }) {
+        std::vector<float> data(ggml_nelements(t));
+        for (auto & x : data) {
+            x = dist(rng);
+        }
+        fill(t, data);
+    }
+
+    // reference
+    struct ggml_tensor * q_f32 = q;
+    if (q->type != GGML_TYPE_F32) {
+        q_f32 = ggml_cpy(ctx, q, ggml_new_tensor_3d(ctx, GGML_TYPE_F32, D, N, H));
+    }
+
+    struct ggml_tensor * kq = ggml_scale(ctx, ggml_mul_mat(ctx, k, q_f32), ggml_new_f32(ctx, scale));
+    if (tc.n_past >= 0) {
+        kq = ggml_diag_mask_inf(ctx, kq, tc.n_past);
+    }
+
+    struct ggml_tensor * ref = ggml_mul_mat(ctx, v, ggml_soft_max(ctx, kq));
+
+    bool ok = compute(ctx, ref, n_threads);
+
+    std::vector<float> ref_data((const float *) ref->data, (const float *) ref->data + ggml_nelements(ref));
+
+    struct ggml_tensor * out = ggml_flash_attn_ext(ctx, q, k, v, scale, tc.n_past);
+
+    if (!compute(ctx, out, n_threads)) {
+        fprintf(stderr, "%s: the memory after the work buffer was modified\n", __func__);
+        ok = false;
+    }
+
+    float err_max = 0.0f;
+    for (int i = 0; i < (int) ref_data.size(); ++i) {
+        const float err = fabsf(((const float *) out->data)[i] - ref_data[i]);
+        err_max = std::max(err_max, std::isnan(err) ? INFINITY : err);
+    }
+
+    // the reference computes the exponentials with the F16 table of ggml_soft_max (max error ~4e-4)
+    if (err_max > 2e-3f) {
+        ok = false;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "%s: q %s, kv %s, D = %d, N = %d, M = %d, H = %d, n_past = %d, %d threads: max error %g\n",
+                __func__, ggml_type_name(tc.type_q), ggml_type_name(tc.type_kv), D, N, M, H, tc.n_past, n_threads, err_max);
+    }
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(void) {
+    std::mt19937 rng(42);
+
+    int n_failed = 0;
+    int n_tests  = 0;
+
+    const std::pair<enum ggml_type, enum ggml_type> types[] = {
+        { GGML_TYPE_F16, GGML_TYPE_F16 },
+        { GGML_TYPE_F32, GGML_TYPE_F16 },
+        { GGML_TYPE_F32, GGML_TYPE_F32 },
+    };
+
+    for (const auto & type : types) {
+        for (int D : { 64, 65 }) {
+            for (int N : { 1, 12, 13, 25 }) {
+                for (int M : { 32, 45 }) {
+                    for (int n_past : { -1, 0, 7, M - N }) {
+                        if (n_past < -1) {
+                            continue;
+                        }
+
+                        for (int n_threads : { 1, 3 }) {
+                            const test_case tc = { type.first, type.second, D, N, M, 3, n_past };
+
+                            n_tests++;
+                            if (!test_flash_attn(tc, n_threads, rng)) {
+                                n_failed++;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    fprintf(stderr, "%s: %d / %d tests passed\n", __func__, n_tests - n_failed, n_tests);
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,162 @@
+// Compares the register-tiled F16 x F32 ggml_mul_mat with the ggml_vec_dot_f16 path
+//
+// usage: test-mul-mat-f16
+//
+// With at least GGML_MUL_MAT_TILE_NE11 (32) columns in src1, the product is computed by tiles of 4 rows x 3 columns.
+// The reference multiplies src0 by each column of src1 on its own, which uses ggml_vec_dot_f16. The two sum in a
+// different order, so they are compared relative to the sum of the absolute values of the products.
+// Covers column counts that are not a multiple of 3, row counts that are not a multiple of the 16-row blocks and are
+// split between threads inside a block, rows shorter than a SIMD vector and 3D matrices.
+
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+struct test_shape {
+    int ne00; // columns of src0
+    int ne01; // rows of src0
+    int ne02; // matrices
+    int ne11; // columns of src1 (at least 32)
+};
+
+static bool test_mul_mat_f16(const test_shape & shape, std::mt19937 & rng) {
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 64*1024*1024,
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    const int ne00 = shape.ne00;
+    const int ne01 = shape.ne01;
+    const int ne02 = shape.ne02;
+    const int ne11 = shape.ne11;
+
+    struct ggml_tensor * src0 = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, ne00, ne01, ne02);
+    struct ggml_tensor * src1 = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, ne00, ne11, ne02);
+
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    for (int i = 0; i < ggml_nelements(src0); ++i) {
+        ((ggml_fp16_t *) src0->data)[i] = ggml_fp32_to_fp16(dist(rng));
+    }
+
+    for (int i = 0; i < ggml_nelements(src1); ++i) {
+        ((float *) src1->data)[i] = dist(rng);
+    }
+
+    // sum of the absolute values of the products, from src1 rounded to F16 like the kernels do
+    std::vector<double> sum_abs(ne01*ne11*ne02);
+
+    for (int i2 = 0; i2 < ne02; ++i2) {
+        for (int i1 = 0; i1 < ne11; ++i1) {
+            for (int i0 = 0; i0 < ne01; ++i0) {
+                double sum = 0.0;
+                for (int k = 0; k < ne00; ++k) {
+                    const float x = ggml_fp16_to_fp32(((ggml_fp16_t *) src0->data)[(i2*ne01 + i0)*ne00 + k]);
+                    const float y = ggml_fp16_to_fp32(ggml_fp32_to_fp16(((float *) src1->data)[(i2*ne11 + i1)*ne00 + k]));
+                    sum += fabs((double) x*y);
+                }
+                sum_abs[(i2*ne11 + i1)*ne01 + i0] = sum;
+            }
+        }
+    }
+
+    // reference: one column at a time
+    std::vector<float> ref(ne01*ne11*ne02);
+
+    {
+        std::vector<struct ggml_tensor *> cols(ne11);
+
+        struct ggml_cgraph gf = {};
+        gf.n_threads = 1;
+
+        for (int i1 = 0; i1 < ne11; ++i1) {
+            struct ggml_tensor * col = ggml_view_3d(ctx, src1, ne00, 1, ne02, src1->nb[1], src1->nb[2], i1*src1->nb[1]);
+
+            cols[i1] = ggml_mul_mat(ctx, src0, col);
+
+            ggml_build_forward_expand(&gf, cols[i1]);
+        }
+
+        ggml_graph_compute(ctx, &gf);
+
+        for (int i2 = 0; i2 < ne02; ++i2) {
+            for (int i1 = 0; i1 < ne11; ++i1) {
+                for (int i0 = 0; i0 < ne01; ++i0) {
+                    ref[(i2*ne11 + i1)*ne01 + i0] = ((float *) cols[i1]->data)[i2*ne01 + i0];
+                }
+            }
+        }
+    }
+
+    bool ok = true;
+
+    for (int n_threads : { 1, 2, 3, 4 }) {
+        struct ggml_tensor * dst = ggml_mul_mat(ctx, src0, src1);
+
+        struct ggml_cgraph gf = ggml_build_forward(dst);
+        gf.n_threads = n_threads;
+
+        ggml_graph_compute(ctx, &gf);
+
+        double err_max = 0.0;
+
+        for (int i = 0; i < (int) ref.size(); ++i) {
+            const double err = fabs((double) ((float *) dst->data)[i] - ref[i])/(sum_abs[i] + 1e-6);
+            err_max = std::max(err_max, std::isnan(err) ? INFINITY : err);
+        }
+
+        if (err_max > 1e-3) {
+            fprintf(stderr, "%s: [%d, %d, %d] x [%d, %d, %d], %d threads: max relative error %g\n",
+                    __func__, ne00, ne01, ne02, ne00, ne11, ne02, n_threads, err_max);
+            ok = false;
+        }
+    }
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(void) {
+    // initialize the fp16 tables
+    {
+        struct ggml_init_params params = { 0, NULL, false };
+        struct ggml_context * ctx = ggml_init(params);
+        ggml_free(ctx);
+    }
+
+    const test_shape shapes[] = {
+        {  64, 16, 1, 32 },
+        {  64, 37, 1, 32 },
+        {  96, 50, 1, 34 },
+        { 128, 33, 1, 65 },
+        {  37, 21, 1, 40 },
+        {   5, 19, 1, 32 },
+        {   7,  4, 3, 35 },
+        {  64, 13, 3, 33 },
+        {  40, 30, 2, 47 },
+    };
+
+    std::mt19937 rng(42);
+
+    int n_failed = 0;
+    int n_tests  = 0;
+
+    for (const auto & shape : shapes) {
+        n_tests++;
+        if (!test_mul_mat_f16(shape, rng)) {
+            n_failed++;
+        }
+    }
+
+    fprintf(stderr, "%s: %d / %d tests passed\n", __func__, n_tests - n_failed, n_tests);
+
+    return n_failed == 0 ? 0 : 1;
+}
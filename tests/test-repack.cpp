@@ -0,0 +1,174 @@
+// Compares ggml_mul_mat and ggml_get_rows on Q4_0/Q8_0 matrices before and after ggml_repack()
+//
+// usage: test-repack
+//
+// The 4-row kernels of the repacked types must give bit-identical results to the row by row kernels, for any number
+// of threads and for matrices whose number of rows is not a multiple of 4 (the last rows are not repacked).
+
+#include "ggml.h"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+struct test_shape {
+    int ne00; // columns of src0
+    int ne01; // rows of src0
+    int ne02; // matrices of src0
+    int ne11; // rows of src1
+};
+
+struct test_result {
+    std::vector<float> mul_mat;
+    std::vector<float> get_rows;
+};
+
+static std::vector<float> to_vector(const struct ggml_tensor * t) {
+    const float * data = (const float *) t->data;
+    return std::vector<float>(data, data + ggml_nelements(t));
+}
+
+// computes src0*src1 and all the rows of src0 (for 2D src0) with the given number of threads
+static test_result compute(struct ggml_context * ctx, struct ggml_tensor * src0, struct ggml_tensor * src1, int n_threads) {
+    test_result result;
+
+    struct ggml_tensor * mul_mat = ggml_mul_mat(ctx, src0, src1);
+
+    struct ggml_cgraph gf = ggml_build_forward(mul_mat);
+    gf.n_threads = n_threads;
+
+    struct ggml_tensor * get_rows = nullptr;
+
+    if (src0->ne[2] == 1) {
+        // in reverse order, so that the rows of a group are not gathered in order
+        struct ggml_tensor * rows = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, src0->ne[1]);
+        for (int i = 0; i < src0->ne[1]; ++i) {
+            ((int32_t *) rows->data)[i] = src0->ne[1] - 1 - i;
+        }
+
+        get_rows = ggml_get_rows(ctx, src0, rows);
+
+        ggml_build_forward_expand(&gf, get_rows);
+    }
+
+    ggml_graph_compute(ctx, &gf);
+
+    result.mul_mat = to_vector(mul_mat);
+    if (get_rows) {
+        result.get_rows = to_vector(get_rows);
+    }
+
+    return result;
+}
+
+static bool test_repack(enum ggml_type type, const test_shape & shape, std::mt19937 & rng) {
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 64*1024*1024,
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * src0 = ggml_new_tensor_3d(ctx, type,          shape.ne00, shape.ne01, shape.ne02);
+    struct ggml_tensor * src1 = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, shape.ne00, shape.ne11, shape.ne02);
+
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    {
+        std::vector<float> data(ggml_nelements(src0));
+        for (auto & x : data) {
+            x = dist(rng);
+        }
+
+        std::vector<int64_t> hist(16, 0);
+        ggml_quantize_chunk(type, data.data(), src0->data, 0, data.size(), hist.data());
+    }
+
+    for (int i = 0; i < ggml_nelements(src1); ++i) {
+        ((float *) src1->data)[i] = dist(rng);
+    }
+
+    const int n_threads[] = { 1, 2, 3, 4 };
+
+    std::vector<test_result> ref;
+    for (int nt : n_threads) {
+        ref.push_back(compute(ctx, src0, src1, nt));
+    }
+
+    bool ok = true;
+
+    if (!ggml_repack(src0)) {
+        fprintf(stderr, "%s: %s [%d, %d, %d]: ggml_repack() failed\n", __func__, ggml_type_name(type), shape.ne00, shape.ne01, shape.ne02);
+        ok = false;
+    } else {
+        for (int i = 0; i < (int) ref.size(); ++i) {
+            const test_result cur = compute(ctx, src0, src1, n_threads[i]);
+
+            if (cur.mul_mat != ref[i].mul_mat || cur.get_rows != ref[i].get_rows) {
+                fprintf(stderr, "%s: %s [%d, %d, %d] x %d, %d threads: %s differs after ggml_repack()\n",
+                        __func__, ggml_type_name(type), shape.ne00, shape.ne01, shape.ne02, shape.ne11, n_threads[i],
+                        cur.mul_mat != ref[i].mul_mat ? "ggml_mul_mat" : "ggml_get_rows");
+                ok = false;
+            }
+        }
+    }
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(void) {
+    // initialize the fp16 tables
+    {
+        struct ggml_init_params params = { 0, NULL, false };
+        struct ggml_context * ctx = ggml_init(params);
+        ggml_free(ctx);
+    }
+
+    {
+        struct ggml_init_params params = { 1024*1024, NULL, false };
+        struct ggml_context * ctx = ggml_init(params);
+
+        struct ggml_tensor * t = ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_0, 64, 8);
+        const bool supported = ggml_repack(t);
+
+        ggml_free(ctx);
+
+        if (!supported) {
+            fprintf(stderr, "%s: ggml_repack() is not supported on this target, skipping\n", __func__);
+            return 0;
+        }
+    }
+
+    const test_shape shapes[] = {
+        {  32,  4, 1,  1 },
+        {  64,  5, 1,  1 },
+        { 256, 16, 1,  1 },
+        { 256, 13, 1,  3 },
+        { 384, 30, 1,  7 },
+        { 128,  7, 1, 16 },
+        { 128,  8, 3,  1 },
+        {  96, 12, 2,  5 },
+    };
+
+    std::mt19937 rng(42);
+
+    int n_failed = 0;
+    int n_tests  = 0;
+
+    for (enum ggml_type type : { GGML_TYPE_Q4_0, GGML_TYPE_Q8_0 }) {
+        for (const auto & shape : shapes) {
+            n_tests++;
+            if (!test_repack(type, shape, rng)) {
+                n_failed++;
+            }
+        }
+    }
+
+    fprintf(stderr, "%s: %d / %d tests passed\n", __func__, n_tests - n_failed, n_tests);
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+// Compares whisper_tokenize() with the std::regex based tokenizer that it replaced
+//
+// usage: test-tokenizer model.bin
+//
+// The reference splits the text into words with the GPT-2 regex (in the "C" locale) and finds the longest tokens
+// that form each word. whisper_tokenize() must give the same tokens for the fixed strings below and for random
+// strings of letters, digits, apostrophes, whitespace runs, punctuation and non-ASCII bytes.
+
+#include "whisper.h"
+
+#include <cstdio>
+#include <random>
+#include <regex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static std::vector<whisper_token> tokenize_ref(const std::unordered_map<std::string, whisper_token> & token_to_id, const std::string & text) {
+    std::vector<std::string> words;
+
+    // first split the text into words
+    {
+        std::string str = text;
+        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+
+        std::regex re(pat);
+        std::smatch m;
+
+        while (std::regex_search(str, m, re)) {
+            for (auto x : m) {
+                words.push_back(x);
+            }
+            str = m.suffix();
+        }
+    }
+
+    // find the longest tokens that form the words
+    std::vector<whisper_token> tokens;
+    for (const auto & word : words) {
+        if (word.empty()) continue;
+
+        int i = 0;
+        int n = word.size();
+        while (i < n) {
+            int j = n;
+            bool found = false;
+            while (j > i) {
+                auto it = token_to_id.find(word.substr(i, j - i));
+                if (it != token_to_id.end()) {
+                    tokens.push_back(it->second);
+                    i = j;
+                    found = true;
+                    break;
+                }
+                --j;
+            }
+            if (!found) {
+                ++i;
+            }
+        }
+    }
+
+    return tokens;
+}
+
+static std::string to_printable(const std::string & text) {
+    std::string result;
+    for (unsigned char c : text) {
+        if (c < 0x20 || c >= 0x7f) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\x%02x", c);
+            result += buf;
+        } else {
+            result += (char) c;
+        }
+    }
+    return result;
+}
+
+int main(int argc, char ** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s model.bin\n", argv[0]);
+        return 1;
+    }
+
+    struct whisper_context * ctx = whisper_init_from_file(argv[1]);
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to load the model '%s'\n", __func__, argv[1]);
+        return 2;
+    }
+
+    // same as the vocab of the context: the later tokens win for duplicated strings
+    std::unordered_map<std::string, whisper_token> token_to_id;
+    for (int i = 0; i < whisper_n_vocab(ctx); ++i) {
+        token_to_id[whisper_token_to_str(ctx, i)] = i;
+    }
+
+    std::vector<std::string> texts = {
+        "",
+        " ",
+        "Hello world",
+        " And so my fellow Americans, ask not what your country can do for you",
+        "I'm sure it's what they'd've wanted, isn't it? We'll see, you're right, I've 'ere",
+        "'s 't 're 've 'm 'll 'd ''s 'S 'RE ' ' '",
+        "a  b   c    d\t\te\n\n\nf \t \n g   ",
+        "   leading and trailing   ",
+        "\t\n\v\f\r ",
+        "1234 56.78 9,000 $100 50% 3rd 2x",
+        "...!?;:--()[]{}<>\"'`~@#^&*_=+|\\/",
+        "caf\xc3\xa9 na\xc3\xafve \xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e \xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82",
+        " \xc3\xa9t\xc3\xa9 l'\xc3\xa9t\xc3\xa9, \xe2\x80\x94 \xe2\x80\x9cquoted\xe2\x80\x9d \xf0\x9f\x98\x80",
+        "\xff\xfe\x80 abc\x80\x81 123\xc0",
+    };
+
+    // random strings
+    {
+        const std::vector<std::string> pieces = {
+            "a", "Z", "hello", "The", "x", "7", "42", "0",
+            "'", "'s", "'t", "'re", "'ve", "'m", "'ll", "'d", "'S", "'l",
+            " ", " ", "  ", "   ", "\t", "\n", "\r\n", " \t ",
+            ".", ",", "!", "?", "-", "\"", "(", ")", "$", "%",
+            "\xc3\xa9", "\xe6\x97\xa5", "\xf0\x9f\x98\x80", "\x80", "\xff",
+        };
+
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<int> dist_len(1, 24);
+        std::uniform_int_distribution<int> dist_piece(0, pieces.size() - 1);
+
+        for (int i = 0; i < 2000; ++i) {
+            std::string text;
+            for (int n = dist_len(rng); n > 0; --n) {
+                text += pieces[dist_piece(rng)];
+            }
+            texts.push_back(text);
+        }
+    }
+
+    int n_failed = 0;
+
+    std::vector<whisper_token> tokens(1024);
+
+    for (const auto & text : texts) {
+        const std::vector<whisper_token> ref = tokenize_ref(token_to_id, text);
+
+        const int n_tokens = whisper_tokenize(ctx, text.c_str(), tokens.data(), tokens.size());
+        if (n_tokens < 0 || std::vector<whisper_token>(tokens.begin(), tokens.begin() + n_tokens) != ref) {
+            fprintf(stderr, "%s: mismatch for '%s': got %d tokens, expected %d\n", __func__, to_printable(text).c_str(), n_tokens, (int) ref.size());
+            n_failed++;
+        }
+    }
+
+    whisper_free(ctx);
+
+    fprintf(stderr, "%s: %d / %d texts tokenized as the reference\n", __func__, (int) texts.size() - n_failed, (int) texts.size());
+
+    return n_failed == 0 ? 0 : 3;
+}
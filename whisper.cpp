@@ -6,19 +6,48 @@
 #include "ggml.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <cstdio>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
-#include <regex>
 #include <random>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+
+#if !defined(__ARM_NEON) && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#endif
+
 #if defined(GGML_BIG_ENDIAN)
 #include <bit>
 
@@ -101,10 +130,13 @@ static void byteswap_tensor(ggml_tensor * tensor) {
 #define WHISPER_PRINT_DEBUG(...)
 #endif
 
-//#define WHISPER_USE_FLASH_ATTN
 //#define WHISPER_USE_FLASH_FF
 #define WHISPER_MAX_DECODERS 16
 
+// max number of tokens proposed by the draft model per decoder pass (whisper_full_params.draft.n_draft is clamped to it)
+// the verifying pass computes the logits of all n_draft + 1 tokens, which must fit in the scratch buffers
+#define WHISPER_MAX_DRAFT 16
+
 #define WHISPER_USE_SCRATCH
 #define WHISPER_MAX_SCRATCH_BUFFERS 16
 
@@ -230,6 +262,15 @@ static const std::map<e_model, size_t> MEM_REQ_SCRATCH0 = {
     { MODEL_LARGE,   198ull*MB },
 };
 
+// with flash attention, the encoder does not store the n_audio_ctx x n_audio_ctx KQ matrices in scratch 0
+static const std::map<e_model, size_t> MEM_REQ_SCRATCH0_FLASH_ATTN = {
+    { MODEL_TINY,     14ull*MB },
+    { MODEL_BASE,     18ull*MB },
+    { MODEL_SMALL,    28ull*MB },
+    { MODEL_MEDIUM,   36ull*MB },
+    { MODEL_LARGE,    44ull*MB },
+};
+
 static const std::map<e_model, size_t> MEM_REQ_SCRATCH1 = {
     { MODEL_TINY,     18ull*MB },
     { MODEL_BASE,     24ull*MB },
@@ -353,18 +394,53 @@ static const std::map<e_model, size_t> MEM_REQ_DECODE = {
 };
 
 struct whisper_mel {
-    int n_len;
-    int n_len_org;
-    int n_mel;
+    int n_len     = 0;
+    int n_len_org = 0;
+    int n_mel     = 0;
 
     std::vector<float> data;
 };
 
+// incremental log mel spectrogram of a continuous audio stream
+// complete frames are computed once, when their last sample is appended, and cached in a ring buffer
+struct whisper_mel_stream {
+    int64_t n_samples = 0; // number of samples appended so far
+    int64_t n_frames  = 0; // number of complete frames computed so far
+
+    // samples of the incomplete frames: [n_frames*WHISPER_HOP_LENGTH, n_samples)
+    std::vector<float> pcm;
+
+    // log10 mel energies of the last n_frames_max complete frames (not normalized)
+    // frame f is stored at ring[(f % n_frames_max)*WHISPER_N_MEL]
+    int n_frames_max = 2*100*WHISPER_CHUNK_SIZE;
+
+    std::vector<float> ring;
+};
+
 struct whisper_filters {
     int32_t n_mel;
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // sparse form of data, computed at load time
+    // mel band j applies the weights band_w[band_offs[j] .. band_offs[j] + band_len[j]) to the fft bins starting at band_start[j]
+    // band_len is a multiple of 4 (padded with zero weights)
+    std::vector<int32_t> band_start;
+    std::vector<int32_t> band_len;
+    std::vector<int32_t> band_offs;
+    std::vector<float>   band_w;
+};
+
+// real-input FFT of size n, computed with a complex FFT of size n/2
+// all tables are computed once by whisper_fft_init, so whisper_fft_power does not allocate
+struct whisper_fft {
+    int n = 0; // number of real input samples (even)
+
+    std::vector<int>   factors; // radices of the complex FFT of size n/2
+    std::vector<float> w;       // exp(-2*pi*i*t/(n/2)), t < n/2 (complex, interleaved)
+    std::vector<float> w_split; // exp(-2*pi*i*k/n),     k < n/2 (complex, interleaved)
+    std::vector<float> hann;    // Hann window of size n
 };
 
 struct whisper_vocab {
@@ -373,8 +449,10 @@ struct whisper_vocab {
 
     int n_vocab = 51864;
 
-    std::map<token, id> token_to_id;
-    std::map<id, token> id_to_token;
+    std::unordered_map<token, id> token_to_id;
+    std::vector<token>            id_to_token;
+
+    int max_token_len = 0; // in bytes
 
     id token_eot  = 50256;
     id token_sot  = 50257;
@@ -387,11 +465,45 @@ struct whisper_vocab {
     static const id token_translate  = 50358;
     static const id token_transcribe = 50359;
 
+    // sorted ids of the tokens masked by suppress_non_speech_tokens
+    // resolved once when the vocab is loaded (see whisper_vocab_init_non_speech)
+    std::vector<id> non_speech_ids;
+
     bool is_multilingual() const {
         return n_vocab == 51865;
     }
 };
 
+static const std::vector<std::string> non_speech_tokens = {
+    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
+    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
+    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
+    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
+};
+
+static void whisper_vocab_init_non_speech(whisper_vocab & vocab) {
+    vocab.non_speech_ids.clear();
+
+    auto add = [&vocab](const std::string & token) {
+        const auto it = vocab.token_to_id.find(token);
+        if (it != vocab.token_to_id.end()) {
+            vocab.non_speech_ids.push_back(it->second);
+        }
+    };
+
+    for (const std::string & token : non_speech_tokens) {
+        add(token);
+        add(" " + token);
+    }
+
+    // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+    add(" -");
+    add(" '");
+
+    std::sort(vocab.non_speech_ids.begin(), vocab.non_speech_ids.end());
+    vocab.non_speech_ids.erase(std::unique(vocab.non_speech_ids.begin(), vocab.non_speech_ids.end()), vocab.non_speech_ids.end());
+}
+
 struct whisper_segment {
     int64_t t0;
     int64_t t1;
@@ -568,6 +680,17 @@ struct whisper_model {
     // the model memory buffer is read-only and can be shared between processors
     std::vector<uint8_t> * buf;
 
+    // with mmap, the copies of the tensors that are not aligned in the model file (see WHISPER_MMAP_UNALIGNED)
+    std::vector<std::vector<uint8_t>> buf_unaligned;
+
+    // the conv kernels reordered by ggml_conv_1d_pack_kernel, in their own context because with mmap the model
+    // context only holds the tensor objects
+    struct ggml_context * ctx_conv = nullptr;
+    std::vector<uint8_t>  buf_conv;
+
+    struct ggml_tensor * e_conv_1_w_packed = nullptr;
+    struct ggml_tensor * e_conv_2_w_packed = nullptr;
+
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
@@ -608,6 +731,64 @@ struct whisper_decoder {
     std::vector<whisper_token> tokens_tmp; // used for whisper_decode calls
 };
 
+// a sequence of tokens to evaluate with the KV cache of the given decoder
+struct whisper_decode_seq {
+    whisper_decoder * decoder;
+
+    const whisper_token * tokens;
+
+    int n_tokens;
+    int n_past;
+
+    bool logits_all; // compute the logits for all tokens of the sequence instead of only the last one
+};
+
+// the decoder graphs of recently used batch shapes are kept in the state and replayed
+#define WHISPER_MAX_DECODE_GRAPHS 8
+
+// the self-attention of a sequence spans its KV cache rounded up to a multiple of this many entries
+// so that a graph can be replayed for several consecutive tokens (the extra entries are masked)
+#define WHISPER_DECODE_KV_PAD 32
+
+// decoder graph built for a batch shape, i.e. the number of tokens and KV cache entries of each sequence
+// the intermediate results live in the scratch buffers of the state, so only the inputs and the views of the
+// self-attention KV caches (which depend on the decoders of the batch and on n_past) are rebound for each call
+struct whisper_decode_graph {
+    int M = 0; // audio context
+
+    std::vector<int> n_tokens; // for each sequence
+    std::vector<int> n_kv;     // for each sequence
+    std::vector<int> n_logits; // for each sequence (1 or n_tokens)
+
+    std::vector<uint8_t> buf; // tensor objects and parameters
+
+    // more than one graph if the batch is too big for GGML_MAX_NODES
+    std::vector<struct ggml_cgraph> graphs;
+
+    struct ggml_tensor * embd     = nullptr;
+    struct ggml_tensor * position = nullptr;
+    struct ggml_tensor * rows     = nullptr;
+    struct ggml_tensor * logits   = nullptr;
+
+    // tensor data = kv_self.{k|v}->data + offs + n_past*offs_past
+    struct kv_view {
+        struct ggml_tensor * t;
+
+        int  seq;
+        bool is_v;
+
+        size_t offs;
+        size_t offs_past;
+    };
+
+    std::vector<kv_view> kv_views;
+
+    // the n_past parameters of the causal masks
+    std::vector<std::pair<struct ggml_tensor *, int>> masks;
+
+    int64_t t_last_used = 0;
+};
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
@@ -624,6 +805,7 @@ struct whisper_state {
     // shared between all decoders
     whisper_kv_cache kv_cross;
     whisper_mel mel;
+    whisper_mel_stream mel_stream;
 
     whisper_decoder decoders[WHISPER_MAX_DECODERS] = {};
 
@@ -640,6 +822,12 @@ struct whisper_state {
     std::vector<whisper_segment> result_all;
     std::vector<whisper_token>   prompt_past;
 
+    // the arrays returned by whisper_full_get_result
+    std::vector<whisper_segment_data> result_segments;
+    std::vector<whisper_token_data>   result_tokens;
+    std::vector<int32_t>              result_token_text;
+    std::vector<char>                 result_text;
+
     // work container used to avoid memory allocations
     std::vector<std::pair<double, whisper_vocab::id>> logits_id;
 
@@ -661,6 +849,32 @@ struct whisper_state {
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
 
+    // compute threads shared by all encoder / decoder graphs of this state
+    struct ggml_threadpool * threadpool = nullptr;
+
+    // decoder graphs of recently used batch shapes (see whisper_decode_internal)
+    std::vector<std::unique_ptr<whisper_decode_graph>> decode_graphs;
+
+    int64_t n_decode_graph_calls = 0;
+
+    // speculative decoding (see whisper_full_params.draft)
+    whisper_context * draft_ctx   = nullptr;
+    whisper_state   * draft_state = nullptr; // state of draft_ctx, owned by this state
+
+    std::vector<whisper_token> draft_past; // the tokens in the KV cache of the draft decoder
+
+    int32_t n_draft_proposed = 0; // number of tokens proposed by the draft model
+    int32_t n_draft_accepted = 0; // number of proposed tokens accepted by the main model
+
+    struct ggml_threadpool * get_threadpool(int n_threads) {
+        if (threadpool == nullptr || ggml_threadpool_n_threads(threadpool) != n_threads) {
+            ggml_threadpool_free(threadpool);
+            threadpool = ggml_threadpool_new(n_threads);
+        }
+
+        return threadpool;
+    }
+
     void use_buf(struct ggml_context * ctx, int i) {
 #if defined(WHISPER_USE_SCRATCH)
         size_t last_size = 0;
@@ -693,18 +907,185 @@ struct whisper_state {
     }
 };
 
+// read-only memory mapping of a model file
+// the pages are shared with the page cache, so processes that map the same model share its memory
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+
+    bool locked = false;
+
+    whisper_mmap() = default;
+    whisper_mmap(const whisper_mmap &) = delete;
+
+#if defined(_WIN32)
+    bool init(const char * fname, bool prefetch) {
+        HANDLE hFile = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname);
+            return false;
+        }
+
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(hFile, &file_size) || file_size.QuadPart == 0) {
+            fprintf(stderr, "%s: failed to get the size of '%s'\n", __func__, fname);
+            CloseHandle(hFile);
+            return false;
+        }
+
+        HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(hFile);
+
+        if (hMapping == NULL) {
+            fprintf(stderr, "%s: CreateFileMappingA failed (error %lu)\n", __func__, GetLastError());
+            return false;
+        }
+
+        addr = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(hMapping);
+
+        if (addr == NULL) {
+            fprintf(stderr, "%s: MapViewOfFile failed (error %lu)\n", __func__, GetLastError());
+            return false;
+        }
+
+        size = (size_t) file_size.QuadPart;
+
+#if _WIN32_WINNT >= 0x602
+        if (prefetch) {
+            // ask the kernel to read the file ahead
+            WIN32_MEMORY_RANGE_ENTRY range;
+            range.VirtualAddress = addr;
+            range.NumberOfBytes  = (SIZE_T) size;
+            if (!PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0)) {
+                fprintf(stderr, "%s: warning: PrefetchVirtualMemory failed (error %lu)\n", __func__, GetLastError());
+            }
+        }
+#else
+        (void) prefetch;
+#endif
+
+        return true;
+    }
+
+    bool lock() {
+        if (!VirtualLock(addr, size)) {
+            fprintf(stderr, "%s: warning: failed to lock %zu bytes of memory (error %lu)\n", __func__, size, GetLastError());
+            return false;
+        }
+
+        locked = true;
+
+        return true;
+    }
+
+    ~whisper_mmap() {
+        if (locked) {
+            VirtualUnlock(addr, size);
+        }
+        if (addr) {
+            UnmapViewOfFile(addr);
+        }
+    }
+#else
+    bool init(const char * fname, bool prefetch) {
+        const int fd = open(fname, O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "%s: failed to open '%s': %s\n", __func__, fname, strerror(errno));
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            fprintf(stderr, "%s: failed to get the size of '%s'\n", __func__, fname);
+            close(fd);
+            return false;
+        }
+
+        void * ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (ptr == MAP_FAILED) {
+            fprintf(stderr, "%s: mmap failed: %s\n", __func__, strerror(errno));
+            return false;
+        }
+
+        addr = ptr;
+        size = st.st_size;
+
+        if (prefetch) {
+            // ask the kernel to read the file ahead, without blocking until it is resident
+            if (posix_madvise(addr, size, POSIX_MADV_WILLNEED) != 0) {
+                fprintf(stderr, "%s: warning: posix_madvise(.., POSIX_MADV_WILLNEED) failed\n", __func__);
+            }
+        }
+
+        return true;
+    }
+
+    bool lock() {
+        if (mlock(addr, size) != 0) {
+            fprintf(stderr, "%s: warning: failed to mlock %zu bytes of memory: %s\n"
+                    "%s: try increasing RLIMIT_MEMLOCK ('ulimit -l' as root)\n", __func__, size, strerror(errno), __func__);
+            return false;
+        }
+
+        locked = true;
+
+        return true;
+    }
+
+    ~whisper_mmap() {
+        if (locked) {
+            munlock(addr, size);
+        }
+        if (addr) {
+            munmap(addr, size);
+        }
+    }
+#endif
+};
+
+// model files whose ftype has this flag pad the data of each tensor to WHISPER_FILE_ALIGN bytes from the start of
+// the file, with zeros after the tensor name. written by the converters and by quantize
+#define WHISPER_FILE_FLAG_ALIGNED 0x10000
+#define WHISPER_FILE_ALIGN        32
+
+// the tensor data of a mapped model file without the alignment is used in place on the targets that support unaligned
+// loads, and copied on the others
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86) || defined(__aarch64__) || defined(_M_ARM64)
+#define WHISPER_MMAP_UNALIGNED
+#endif
+
+// model loader context that reads from a mapped model file
+// whisper_model_load points the weight tensors into the mapping instead of reading them
+struct whisper_mmap_reader {
+    const whisper_mmap * mapping;
+    size_t offs;
+};
+
 struct whisper_context {
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
 
     ggml_type wtype = ggml_type::GGML_TYPE_F16; // weight type (FP32 / FP16 / QX)
     ggml_type itype = ggml_type::GGML_TYPE_F16; // intermediate type (FP32 or FP16)
+    ggml_type ktype = ggml_type::GGML_TYPE_F16; // type of the K caches (itype or Q8_0)
+
+    bool flash_attn = false; // compute the attention with ggml_flash_attn_ext
 
     whisper_model model;
     whisper_vocab vocab;
     whisper_state * state = nullptr;
 
+    whisper_fft fft;         // WHISPER_N_FFT-point FFT of the mel spectrogram
+    whisper_fft fft_vocoder; // 2*WHISPER_N_FFT-point FFT of the phase vocoder
+
     std::string path_model; // populated by whisper_init_from_file()
+
+    std::unique_ptr<whisper_mmap> mapping; // the model file, when loaded with use_mmap
+
+    std::vector<whisper_state *> parallel_states; // reused by whisper_full_parallel()
 };
 
 template<typename T>
@@ -713,11 +1094,25 @@ static void read_safe(whisper_model_loader * loader, T & dest) {
     BYTESWAP_VALUE(dest);
 }
 
+#ifndef WHISPER_MMAP_UNALIGNED
+// alignment required by the elements (or blocks) of the given type: the largest power of two that divides their size
+static size_t whisper_type_align(ggml_type type) {
+    const size_t size = ggml_type_size(type);
+    return size & (~size + 1);
+}
+#endif
+
+// size in bytes of n consecutive elements of the given type (n is a multiple of the block size)
+static size_t whisper_row_size(ggml_type type, int64_t n) {
+    return ggml_type_size(type)*n/ggml_blck_size(type);
+}
+
 static bool kv_cache_init(
         const struct whisper_hparams & hparams,
                         const size_t   mem_bytes,
              struct whisper_kv_cache & cache,
-                           ggml_type   wtype,
+                           ggml_type   ktype,
+                           ggml_type   vtype,
                                  int   n_ctx) {
     cache.buf.resize(mem_bytes);
 
@@ -740,8 +1135,8 @@ static bool kv_cache_init(
     const int n_mem      = n_text_layer*n_ctx;
     const int n_elements = n_text_state*n_mem;
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(cache.ctx, ktype, n_elements);
+    cache.v = ggml_new_tensor_1d(cache.ctx, vtype, n_elements);
 
     return true;
 }
@@ -752,10 +1147,10 @@ static bool kv_cache_reinit(struct whisper_kv_cache & cache) {
     const int n_elements = ggml_nelements(cache.k);
     WHISPER_ASSERT(n_elements == ggml_nelements(cache.v));
 
-    const ggml_type wtype = cache.k->type;
-    WHISPER_ASSERT(wtype == cache.v->type);
+    const ggml_type ktype = cache.k->type;
+    const ggml_type vtype = cache.v->type;
 
-    WHISPER_ASSERT(cache.buf.size() >= 2*n_elements*ggml_type_sizef(wtype));
+    WHISPER_ASSERT(cache.buf.size() >= n_elements*(ggml_type_sizef(ktype) + ggml_type_sizef(vtype)));
 
     struct ggml_init_params params = {
         /*.mem_size   =*/ cache.buf.size(),
@@ -770,8 +1165,8 @@ static bool kv_cache_reinit(struct whisper_kv_cache & cache) {
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(cache.ctx, ktype, n_elements);
+    cache.v = ggml_new_tensor_1d(cache.ctx, vtype, n_elements);
 
     return true;
 }
@@ -783,6 +1178,76 @@ static void kv_cache_free(struct whisper_kv_cache & cache) {
     }
 }
 
+// copy the first n tokens of each layer of the self-attention cache src to dst
+// the rest of dst is not touched, since it will be overwritten by the next decoder passes
+//
+// layout (see whisper_decode_internal):
+//   - k: [n_state, n_ctx, n_layer]
+//   - v: [n_ctx, n_state, n_layer]
+//
+static void kv_cache_copy(
+        const struct whisper_hparams & hparams,
+             struct whisper_kv_cache & dst,
+       const struct whisper_kv_cache & src,
+                                 int   n) {
+    WHISPER_ASSERT(ggml_nbytes(dst.k) == ggml_nbytes(src.k));
+    WHISPER_ASSERT(ggml_nbytes(dst.v) == ggml_nbytes(src.v));
+
+    const int n_state = hparams.n_text_state;
+    const int n_layer = hparams.n_text_layer;
+    const int n_ctx   = ggml_nelements(src.k)/(n_state*n_layer);
+
+    WHISPER_ASSERT(n <= n_ctx);
+
+    const size_t rsk = whisper_row_size(src.k->type, n_state); // K can be quantized by rows of n_state
+    const size_t esv = ggml_element_size(src.v);
+
+    for (int il = 0; il < n_layer; ++il) {
+        const size_t offs = rsk*il*n_ctx;
+        memcpy((char *) dst.k->data + offs, (const char *) src.k->data + offs, rsk*n);
+    }
+
+    for (int il = 0; il < n_layer; ++il) {
+        for (int i = 0; i < n_state; ++i) {
+            const size_t offs = esv*(il*n_state + i)*n_ctx;
+            memcpy((char *) dst.v->data + offs, (const char *) src.v->data + offs, esv*n);
+        }
+    }
+
+    dst.n = n;
+}
+
+// model loader that forwards to another one and counts the bytes read
+struct whisper_loader_pos {
+    whisper_model_loader * loader;
+    size_t offs;
+};
+
+static whisper_model_loader whisper_loader_pos_wrap(whisper_loader_pos & pos) {
+    whisper_model_loader loader = {};
+
+    loader.context = &pos;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        whisper_loader_pos * p = reinterpret_cast<whisper_loader_pos *>(ctx);
+        const size_t n = p->loader->read(p->loader->context, output, read_size);
+        p->offs += n;
+        return n;
+    };
+
+    loader.eof = [](void * ctx) {
+        whisper_loader_pos * p = reinterpret_cast<whisper_loader_pos *>(ctx);
+        return p->loader->eof(p->loader->context);
+    };
+
+    loader.close = [](void * ctx) {
+        whisper_loader_pos * p = reinterpret_cast<whisper_loader_pos *>(ctx);
+        p->loader->close(p->loader->context);
+    };
+
+    return loader;
+}
+
 // load the model from a ggml file
 //
 // file format:
@@ -794,7 +1259,9 @@ static void kv_cache_free(struct whisper_kv_cache & cache) {
 //
 // see the convert-pt-to-ggml.py script for details
 //
-static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
+// if mreader is not null, loader reads from it and the weights are not copied, but point into the mapped file
+//
+static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx, whisper_mmap_reader * mreader) {
     fprintf(stderr, "%s: loading model\n", __func__);
 
     const int64_t t_start_us = ggml_time_us();
@@ -804,6 +1271,15 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     auto & model = wctx.model;
     auto & vocab = wctx.vocab;
 
+    // count the bytes read, to skip the padding before the tensor data of aligned model files
+    whisper_loader_pos pos = { loader, 0 };
+
+    whisper_model_loader loader_pos = whisper_loader_pos_wrap(pos);
+
+    loader = &loader_pos;
+
+    bool aligned = false;
+
     // verify magic
     {
         uint32_t magic;
@@ -852,6 +1328,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             model.type = e_model::MODEL_LARGE;
         }
 
+        aligned = hparams.ftype & WHISPER_FILE_FLAG_ALIGNED;
+
+        hparams.ftype &= ~WHISPER_FILE_FLAG_ALIGNED;
+
         const int32_t qntvr = hparams.ftype / GGML_QNT_VERSION_FACTOR;
 
         hparams.ftype %= GGML_QNT_VERSION_FACTOR;
@@ -878,6 +1358,7 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         fprintf(stderr, "%s: n_mels        = %d\n", __func__, hparams.n_mels);
         fprintf(stderr, "%s: ftype         = %d\n", __func__, model.hparams.ftype);
         fprintf(stderr, "%s: qntvr         = %d\n", __func__, qntvr);
+        fprintf(stderr, "%s: aligned       = %d\n", __func__, aligned);
         fprintf(stderr, "%s: type          = %d\n", __func__, model.type);
 
         // print memory requirements
@@ -903,8 +1384,8 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         // initialize all memory buffers
         // always have at least one decoder
 
+        // the model buffer is allocated when creating the ggml context below
         wctx.model.buf = new std::vector<uint8_t>();
-        wctx.model.buf->resize(scale*MEM_REQ_MODEL.at(wctx.wtype).at(model.type));
 
         // we skip initialization of the state until it is needed
         // because it might be that state will always be provided externally.
@@ -920,6 +1401,30 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         filters.data.resize(filters.n_mel * filters.n_fft);
         loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
         BYTESWAP_FILTERS(filters);
+
+        // each triangular filter has only a few non-zero weights
+        filters.band_start.resize(filters.n_mel);
+        filters.band_len  .resize(filters.n_mel);
+        filters.band_offs .resize(filters.n_mel);
+        filters.band_w    .clear();
+
+        for (int j = 0; j < filters.n_mel; j++) {
+            const float * w = filters.data.data() + j*filters.n_fft;
+
+            int k0 = 0;
+            int k1 = filters.n_fft;
+            while (k0 < k1 && w[k0]     == 0.0f) k0++;
+            while (k1 > k0 && w[k1 - 1] == 0.0f) k1--;
+
+            // pad to a multiple of 4, without going past the last bin
+            const int len = std::min((k1 - k0 + 3)/4*4, (int) filters.n_fft/4*4);
+            k0 = std::min(k0, filters.n_fft - len);
+
+            filters.band_start[j] = k0;
+            filters.band_len[j]   = len;
+            filters.band_offs[j]  = filters.band_w.size();
+            filters.band_w.insert(filters.band_w.end(), w + k0, w + k0 + len);
+        }
     }
 
     // load vocab
@@ -938,6 +1443,9 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
         tmp.reserve(128);
 
+        vocab.token_to_id.reserve(std::max(n_vocab, model.hparams.n_vocab));
+        vocab.id_to_token.resize(std::max(n_vocab, model.hparams.n_vocab));
+
         for (int i = 0; i < n_vocab; i++) {
             uint32_t len;
             read_safe(loader, len);
@@ -955,6 +1463,8 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             vocab.token_to_id[word] = i;
             vocab.id_to_token[i] = word;
 
+            vocab.max_token_len = std::max(vocab.max_token_len, (int) word.size());
+
             //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
         }
 
@@ -988,8 +1498,12 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 }
                 vocab.token_to_id[word] = i;
                 vocab.id_to_token[i] = word;
+
+                vocab.max_token_len = std::max(vocab.max_token_len, (int) word.size());
             }
         }
+
+        whisper_vocab_init_non_speech(vocab);
     }
 
     size_t ctx_size = 0;
@@ -1107,12 +1621,26 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         fprintf(stderr, "%s: model ctx     = %7.2f MB\n", __func__, ctx_size/(1024.0*1024.0));
     }
 
+    // with a mapped model file, only the tensor objects are allocated
+    // (models without weights, used for testing, still get allocated tensors)
+    const bool use_mmap = mreader && mreader->offs < mreader->mapping->size;
+
     // create the ggml context
     {
+        const auto & hparams = model.hparams;
+
+        const size_t scale = hparams.ftype ? 1 : 2;
+
+        if (use_mmap) {
+            wctx.model.buf->resize((15 + 15*hparams.n_audio_layer + 24*hparams.n_text_layer)*512); // object overhead
+        } else {
+            wctx.model.buf->resize(scale*MEM_REQ_MODEL.at(wctx.wtype).at(model.type));
+        }
+
         struct ggml_init_params params = {
             /*.mem_size   =*/ wctx.model.buf->size(),
             /*.mem_buffer =*/ wctx.model.buf->data(),
-            /*.no_alloc   =*/ false,
+            /*.no_alloc   =*/ use_mmap,
         };
 
         model.ctx = ggml_init(params);
@@ -1349,6 +1877,11 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
             name.assign(&tmp[0], tmp.size());
 
+            if (aligned) {
+                char pad[WHISPER_FILE_ALIGN];
+                loader->read(loader->context, pad, (WHISPER_FILE_ALIGN - pos.offs % WHISPER_FILE_ALIGN) % WHISPER_FILE_ALIGN);
+            }
+
             if (model.tensors.find(name) == model.tensors.end()) {
                 fprintf(stderr, "%s: unknown tensor '%s' in model file\n", __func__, name.data());
                 return false;
@@ -1376,8 +1909,29 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 return false;
             }
 
-            loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
-            BYTESWAP_TENSOR(tensor);
+            if (use_mmap) {
+                if (mreader->offs + ggml_nbytes(tensor) > mreader->mapping->size) {
+                    fprintf(stderr, "%s: tensor '%s' data is out of bounds of the model file\n", __func__, name.data());
+                    return false;
+                }
+
+                char * data = (char *) mreader->mapping->addr + mreader->offs;
+                mreader->offs += ggml_nbytes(tensor);
+                pos.offs      += ggml_nbytes(tensor);
+
+#ifndef WHISPER_MMAP_UNALIGNED
+                // the tensor data is used in place only if its elements are aligned
+                if ((uintptr_t) data % whisper_type_align(tensor->type) != 0) {
+                    model.buf_unaligned.emplace_back(data, data + ggml_nbytes(tensor));
+                    data = (char *) model.buf_unaligned.back().data();
+                }
+#endif
+
+                tensor->data = data;
+            } else {
+                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+                BYTESWAP_TENSOR(tensor);
+            }
 
             //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype), ggml_nbytes(tensor)/1024.0/1024.0);
             total_size += ggml_nbytes(tensor);
@@ -1386,6 +1940,16 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
         fprintf(stderr, "%s: model size    = %7.2f MB\n", __func__, total_size/1024.0/1024.0);
 
+        if (!model.buf_unaligned.empty()) {
+            size_t size_copied = 0;
+            for (const auto & buf : model.buf_unaligned) {
+                size_copied += buf.size();
+            }
+
+            fprintf(stderr, "%s: %d tensors (%.2f MB) are not aligned in the model file and have been copied\n",
+                    __func__, (int) model.buf_unaligned.size(), size_copied/1024.0/1024.0);
+        }
+
         if (model.n_loaded == 0) {
             fprintf(stderr, "%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
         } else if (model.n_loaded != (int) model.tensors.size()) {
@@ -1394,11 +1958,63 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         }
     }
 
+    // reorder the conv kernels once instead of for every encoder pass
+    {
+        model.buf_conv.resize(ggml_nbytes(model.e_conv_1_w) + ggml_nbytes(model.e_conv_2_w) + 2*512); // + object overhead
+
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ model.buf_conv.size(),
+            /*.mem_buffer =*/ model.buf_conv.data(),
+            /*.no_alloc   =*/ false,
+        };
+
+        model.ctx_conv = ggml_init(params);
+        if (!model.ctx_conv) {
+            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+            return false;
+        }
+
+        model.e_conv_1_w_packed = ggml_conv_1d_pack_kernel(model.ctx_conv, model.e_conv_1_w);
+        model.e_conv_2_w_packed = ggml_conv_1d_pack_kernel(model.ctx_conv, model.e_conv_2_w);
+
+        if (!model.e_conv_1_w_packed || !model.e_conv_2_w_packed) {
+            fprintf(stderr, "%s: failed to pack the conv kernels\n", __func__);
+            return false;
+        }
+    }
+
     wctx.t_load_us = ggml_time_us() - t_start_us;
 
     return true;
 }
 
+// interleave the rows of the quantized weight matrices for the 4-row ggml_mul_mat kernels
+// the tensors that ggml_repack() does not support are left as they are
+static void whisper_model_repack(whisper_context & wctx) {
+    const int64_t t_start_us = ggml_time_us();
+
+    auto & model = wctx.model;
+
+    int n_repacked = 0;
+    size_t size_repacked = 0;
+
+    for (auto & kv : model.tensors) {
+        ggml_tensor * tensor = kv.second;
+
+        if (ggml_repack(tensor)) {
+            n_repacked++;
+            size_repacked += ggml_nbytes(tensor);
+        }
+    }
+
+    const int64_t t_repack_us = ggml_time_us() - t_start_us;
+
+    wctx.t_load_us += t_repack_us;
+
+    fprintf(stderr, "%s: repacked %d tensors, %7.2f MB in %7.2f ms\n", __func__,
+            n_repacked, size_repacked/1024.0/1024.0, t_repack_us/1000.0);
+}
+
 // evaluate the encoder with the given state
 //
 // given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
@@ -1468,7 +2084,7 @@ static bool whisper_encode_internal(
         {
             wstate.use_buf(ctx0, 1);
 
-            cur = ggml_conv_1d_1s(ctx0, model.e_conv_1_w, mel);
+            cur = ggml_conv_1d_1s_packed(ctx0, model.e_conv_1_w_packed, mel);
             cur = ggml_add(ctx0,
                     ggml_repeat(ctx0,
                         model.e_conv_1_b,
@@ -1479,7 +2095,7 @@ static bool whisper_encode_internal(
 
             wstate.use_buf(ctx0, 0);
 
-            cur = ggml_conv_1d_2s(ctx0, model.e_conv_2_w, cur);
+            cur = ggml_conv_1d_2s_packed(ctx0, model.e_conv_2_w_packed, cur);
             cur = ggml_add(ctx0,
                     ggml_repeat(ctx0,
                         model.e_conv_2_b,
@@ -1573,18 +2189,10 @@ static bool whisper_encode_internal(
 
                 wstate.use_buf(ctx0, 0);
 
-#ifdef WHISPER_USE_FLASH_ATTN
-                struct ggml_tensor * Q =
+                struct ggml_tensor * K =
                     ggml_permute(ctx0,
                             ggml_cpy(ctx0,
-                                Qcur,
-                                ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
-                            0, 2, 1, 3);
-
-                struct ggml_tensor * K =
-                    ggml_permute(ctx0,
-                            ggml_cpy(ctx0,
-                                Kcur,
+                                Kcur,
                                 ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
                             0, 2, 1, 3);
 
@@ -1597,45 +2205,40 @@ static bool whisper_encode_internal(
                                 1, 2, 0, 3),
                             ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head));
 
-                struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V, false);
-#else
-                struct ggml_tensor * Q =
-                    ggml_permute(ctx0,
-                            ggml_cpy(ctx0,
-                                Qcur,
-                                ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
-                            0, 2, 1, 3);
+                struct ggml_tensor * KQV = nullptr;
 
-                struct ggml_tensor * K =
-                    ggml_permute(ctx0,
-                            ggml_cpy(ctx0,
-                                Kcur,
-                                ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
-                            0, 2, 1, 3);
+                if (wctx.flash_attn) {
+                    // the n_ctx x n_ctx KQ matrices of the heads are never stored
+                    struct ggml_tensor * Q =
+                        ggml_permute(ctx0,
+                                ggml_reshape_3d(ctx0,
+                                    Qcur,
+                                    n_state/n_head, n_head, n_ctx),
+                                0, 2, 1, 3);
 
-                // K * Q
-                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                    KQV = ggml_flash_attn_ext(ctx0, Q, K, V, 1.0f/sqrt(float(n_state)/n_head), -1);
+                } else {
+                    struct ggml_tensor * Q =
+                        ggml_permute(ctx0,
+                                ggml_cpy(ctx0,
+                                    Qcur,
+                                    ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
+                                0, 2, 1, 3);
 
-                struct ggml_tensor * KQ_scaled =
-                    ggml_scale_inplace(ctx0,
-                            KQ,
-                            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-                            );
+                    // K * Q
+                    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
-                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_scaled);
+                    struct ggml_tensor * KQ_scaled =
+                        ggml_scale_inplace(ctx0,
+                                KQ,
+                                ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
+                                );
 
-                struct ggml_tensor * V =
-                    ggml_cpy(ctx0,
-                            ggml_permute(ctx0,
-                                ggml_reshape_3d(ctx0,
-                                    Vcur,
-                                    n_state/n_head, n_head, n_ctx),
-                                1, 2, 0, 3),
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head)
-                            );
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_scaled);
+
+                    KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                }
 
-                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-#endif
                 struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
                 wstate.use_buf(ctx0, 1);
@@ -1689,7 +2292,7 @@ static bool whisper_encode_internal(
                 wstate.use_buf(ctx0, 0);
 
                 cur = ggml_flash_ff(ctx0,
-                        ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wstate.itype, n_state, n_ctx)),
+                        ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wctx.itype, n_state, n_ctx)),
                         layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
 #else
                 wstate.use_buf(ctx0, 0);
@@ -1753,7 +2356,8 @@ static bool whisper_encode_internal(
         // run the computation
         {
             struct ggml_cgraph gf = {};
-            gf.n_threads = n_threads;
+            gf.n_threads  = n_threads;
+            gf.threadpool = wstate.get_threadpool(n_threads);
 
             ggml_build_forward_expand(&gf, cur);
             ggml_graph_compute(ctx0, &gf);
@@ -1789,7 +2393,8 @@ static bool whisper_encode_internal(
     // pre-compute cross-attention memory
     {
         struct ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
+        gf.n_threads  = n_threads;
+        gf.threadpool = wstate.get_threadpool(n_threads);
 
         // TODO: hack to disconnect the encoded features from the previous graph
         cur->op = GGML_OP_NONE;
@@ -1823,7 +2428,7 @@ static bool whisper_encode_internal(
 
             Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
 
-            struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx, (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
+            struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx, whisper_row_size(wstate.kv_cross.k->type, n_state)*(il*n_ctx));
             struct ggml_tensor * v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
                     (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
                     (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
@@ -1853,65 +2458,73 @@ static bool whisper_encode_internal(
     return true;
 }
 
-// evaluate the decoder
-//
-// given text prompt + audio features -> computes the logits for the next token
-//
-//   - model:      the model
-//   - n_threads:  number of threads to use
-//   - tokens:     text prompt
-//   - n_tokens:   number of tokens in the prompt
-//   - n_past:     number of past tokens to prefix the prompt with
-//
-static bool whisper_decode_internal(
+// build the decoder graph for the batch shape of graph (see whisper_decode_internal)
+// the graph is valid for the given sequences and can be replayed after rebinding the KV cache views
+static bool whisper_decode_graph_build(
         whisper_context & wctx,
           whisper_state & wstate,
-        whisper_decoder & decoder,
-    const whisper_token * tokens,
-              const int   n_tokens,
-              const int   n_past,
-              const int   n_threads) {
-    const int64_t t_start_us = ggml_time_us();
-
+    const std::vector<whisper_decode_seq> & seqs,
+   whisper_decode_graph & graph) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    auto & kv_self = decoder.kv_self;
-
-    WHISPER_ASSERT(!!kv_self.ctx);
-
-    auto & logits_out = wstate.logits;
-
-    const int n_vocab = hparams.n_vocab;
-
     const int n_ctx   = hparams.n_text_ctx;
     const int n_state = hparams.n_text_state;
     const int n_head  = hparams.n_text_head;
     const int n_layer = hparams.n_text_layer;
 
-    const int N = n_tokens;
-    const int M = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_seq = seqs.size();
+
+    int N = 0;
+    for (const auto & seq : seqs) {
+        N += seq.n_tokens;
+    }
+
+    int n_rows = 0;
+    for (int n : graph.n_logits) {
+        n_rows += n;
+    }
+
+    const int M = graph.M;
+
+    // ggml_flash_attn_ext needs the K caches in F16 or F32, with Q8_0 K caches the KQ matrices are computed
+    const bool flash_attn = wctx.flash_attn && wctx.ktype == wctx.itype;
+
+    // only the tensor objects, the inputs and a few parameters are allocated in the context, the data of the other
+    // tensors is in the scratch buffers. the number of tensors is bounded with some margin:
+    //   - 16:       the inputs, the embeddings, the final norm and the logits (about 12)
+    //   - 96:       the tensors of a layer that are shared by the sequences (about 70)
+    //   - 32*n_seq: the KV cache views and copies and the self-attention of each sequence (about 25)
+    // each tensor also gets 16 bytes for its alignment and the data of the scalar parameters (scales, masks)
+    // the context memory used by each layer is checked below, so that a wrong bound is reported instead of
+    // overflowing the context
+    {
+        const size_t n_tensors = 16 + n_layer*(96 + 32*n_seq);
 
-    //WHISPER_PRINT_DEBUG("%s: n_past = %d, N = %d, M = %d, n_ctx = %d\n", __func__, n_past, N, M, n_ctx);
+        graph.buf.resize(n_tensors*(GGML_OBJECT_SIZE + sizeof(struct ggml_tensor) + 16) + (2*N + n_rows)*sizeof(int32_t) + 1024);
+    }
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.buf_compute.size(),
-        /*.mem_buffer =*/ wstate.buf_compute.data(),
+        /*.mem_size   =*/ graph.buf.size(),
+        /*.mem_buffer =*/ graph.buf.data(),
         /*.no_alloc   =*/ false,
     };
 
     struct ggml_context * ctx0 = ggml_init(params);
+    if (ctx0 == nullptr) {
+        fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+        return false;
+    }
 
-    struct ggml_cgraph gf = {};
-    gf.n_threads = n_threads;
+    graph.graphs.clear();
+    graph.kv_views.clear();
+    graph.masks.clear();
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, tokens, N*ggml_element_size(embd));
+    struct ggml_cgraph gf = {};
 
-    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    for (int i = 0; i < N; ++i) {
-        ((int32_t *) position->data)[i] = n_past + i;
-    }
+    struct ggml_tensor * embd     = graph.embd     = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    struct ggml_tensor * position = graph.position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    struct ggml_tensor * rows     = graph.rows     = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_rows); // the tokens for which logits are computed
 
     wstate.use_buf(ctx0, 3);
 
@@ -1923,9 +2536,24 @@ static bool whisper_decode_internal(
 
     struct ggml_tensor * inpL = cur;
 
+    int    n_nodes_layer = 0;
+    size_t mem_layer     = 0; // max context memory used by a layer
+
     for (int il = 0; il < n_layer; ++il) {
         const auto & layer = model.layers_decoder[il];
 
+        const int    n_nodes_start = gf.n_nodes;
+        const size_t mem_start     = ggml_used_mem(ctx0);
+
+        // all layers have the same tensors, so the next one fits if the largest one so far does
+        // (the end of the graph uses less than a layer)
+        if (mem_start + 2*mem_layer > graph.buf.size()) {
+            fprintf(stderr, "%s: the decoder graph does not fit in its context (%zu of %zu bytes used after %d layers, n_seq = %d)\n",
+                    __func__, mem_start, graph.buf.size(), il, n_seq);
+            ggml_free(ctx0);
+            return false;
+        }
+
         // norm
         {
             wstate.use_buf(ctx0, 0);
@@ -1961,76 +2589,128 @@ static bool whisper_decode_internal(
 
             Kcur = ggml_scale_inplace(ctx0, Kcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
+
+            Vcur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
+                        layer.attn_v_b,
+                        Vcur),
+                    Vcur);
+
             // store key and value to memory
-            {
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
-                        layer.attn_v_w,
-                        cur);
+            for (int s = 0, i0 = 0; s < n_seq; i0 += seqs[s].n_tokens, ++s) {
+                const auto & kv_self = seqs[s].decoder->kv_self;
 
-                Vcur = ggml_add(ctx0,
-                        ggml_repeat(ctx0,
-                            layer.attn_v_b,
-                            Vcur),
-                        Vcur);
+                const int n_tokens = seqs[s].n_tokens;
+                const int n_past   = seqs[s].n_past;
+
+                struct ggml_tensor * Kseq = ggml_view_1d(ctx0, Kcur, n_tokens*n_state, i0*Kcur->nb[1]);
+                struct ggml_tensor * Vseq = ggml_transpose(ctx0, ggml_view_2d(ctx0, Vcur, n_state, n_tokens, Vcur->nb[1], i0*Vcur->nb[1]));
 
-                Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, N));
+                const size_t rsk = whisper_row_size(kv_self.k->type, n_state);
+                const size_t esv = ggml_element_size(kv_self.v);
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_state,
-                        (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + n_past*ggml_element_size(kv_self.v));
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state, rsk*(il*n_ctx + n_past));
+                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
+                        (   n_ctx)*esv,
+                        (il*n_ctx)*esv*n_state + n_past*esv);
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+                struct ggml_tensor * k_cpy = ggml_cpy(ctx0, Kseq, k);
+                struct ggml_tensor * v_cpy = ggml_cpy(ctx0, Vseq, v);
+
+                // the copies write through views of the views
+                graph.kv_views.push_back({ k,     s, false, rsk*il*n_ctx, rsk });
+                graph.kv_views.push_back({ k_cpy, s, false, rsk*il*n_ctx, rsk });
+                graph.kv_views.push_back({ v,     s, true,  esv*n_state*il*n_ctx, esv });
+                graph.kv_views.push_back({ v_cpy, s, true,  esv*n_state*il*n_ctx, esv });
+
+                ggml_build_forward_expand(&gf, k_cpy);
+                ggml_build_forward_expand(&gf, v_cpy);
             }
 
             // ------
 
-            wstate.use_buf(ctx0, 0);
+            wstate.use_buf(ctx0, 1);
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
-                        0, 2, 1, 3);
+            // each sequence attends only to its own KV cache
+            // the results are gathered in KQV_all, which is used by the projection below
+            struct ggml_tensor * KQV_all = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N);
 
-            struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, kv_self.k, (n_past + N)*n_state, il*n_ctx*ggml_element_size(kv_self.k)*n_state),
-                            n_state/n_head, n_head, n_past + N),
-                        0, 2, 1, 3);
+            for (int s = 0, i0 = 0; s < n_seq; i0 += seqs[s].n_tokens, ++s) {
+                const auto & kv_self = seqs[s].decoder->kv_self;
 
-            wstate.use_buf(ctx0, 1);
+                const int n_tokens = seqs[s].n_tokens;
+                const int n_past   = seqs[s].n_past;
+                const int n_kv     = graph.n_kv[s];
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_view_3d(ctx0, Qcur,
+                                n_state/n_head, n_head, n_tokens,
+                                Qcur->nb[1]/n_head,
+                                Qcur->nb[1],
+                                i0*Qcur->nb[1]),
+                            0, 2, 1, 3);
 
-            //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale_inplace(ctx0,
-            //            KQ,
-            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-            //            );
+                struct ggml_tensor * Kview =
+                    ggml_view_3d(ctx0, kv_self.k,
+                            n_state/n_head, n_head, n_kv,
+                            whisper_row_size(kv_self.k->type, n_state/n_head),
+                            whisper_row_size(kv_self.k->type, n_state),
+                            whisper_row_size(kv_self.k->type, n_state)*il*n_ctx);
 
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ, n_past);
+                struct ggml_tensor * K = ggml_permute(ctx0, Kview, 0, 2, 1, 3);
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
+                graph.kv_views.push_back({ Kview, s, false, whisper_row_size(kv_self.k->type, n_state)*il*n_ctx, 0 });
+                graph.kv_views.push_back({ K,     s, false, whisper_row_size(kv_self.k->type, n_state)*il*n_ctx, 0 });
 
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_past + N, n_state/n_head, n_head,
-                        n_ctx*ggml_element_size(kv_self.v),
-                        n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
-                        il*n_ctx*ggml_element_size(kv_self.v)*n_state);
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_state/n_head, n_head,
+                            n_ctx*ggml_element_size(kv_self.v),
+                            n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
+                            il*n_ctx*ggml_element_size(kv_self.v)*n_state);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                graph.kv_views.push_back({ V, s, true, il*n_ctx*ggml_element_size(kv_self.v)*n_state, 0 });
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                struct ggml_tensor * KQV = nullptr;
 
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
+                if (flash_attn) {
+                    // Q and K are already scaled
+                    // the mask also covers the KV cache entries past n_past + n_tokens
+                    KQV = ggml_flash_attn_ext(ctx0, Q, K, V, 1.0f, n_past);
+
+                    graph.masks.push_back({ KQV->opt[1], s });
+                } else {
+                    // K * Q
+                    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+                    //struct ggml_tensor * KQ_scaled =
+                    //    ggml_scale_inplace(ctx0,
+                    //            KQ,
+                    //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
+                    //            );
+
+                    // also masks the KV cache entries past n_past + n_tokens
+                    struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ, n_past);
+
+                    graph.masks.push_back({ KQ_masked->src1, s });
+
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
+
+                    KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                }
+
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0,
+                            KQV_merged,
+                            ggml_view_2d(ctx0, KQV_all, n_state, n_tokens, KQV_all->nb[1], i0*KQV_all->nb[1])));
+            }
+
+            cur = KQV_all;
         }
 
         // projection
@@ -2084,7 +2764,7 @@ static bool whisper_decode_internal(
             // Kcross is already scaled
             struct ggml_tensor * Kcross =
                 ggml_reshape_3d(ctx0,
-                        ggml_view_1d(ctx0, wstate.kv_cross.k, M*n_state, il*M*ggml_element_size(wstate.kv_cross.k)*n_state),
+                        ggml_view_1d(ctx0, wstate.kv_cross.k, M*n_state, whisper_row_size(wstate.kv_cross.k->type, n_state)*il*M),
                         n_state/n_head, n_head, M);
 
             //struct ggml_tensor * Vcross =
@@ -2106,30 +2786,44 @@ static bool whisper_decode_internal(
 
             // ------
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
-                        0, 2, 1, 3);
-
             struct ggml_tensor * K = ggml_permute(ctx0, Kcross, 0, 2, 1, 3);
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+            struct ggml_tensor * KQV = nullptr;
+
+            if (flash_attn) {
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0,
+                                Qcur,
+                                n_state/n_head, n_head, N),
+                            0, 2, 1, 3);
+
+                // no masking for cross-attention
+                KQV = ggml_flash_attn_ext(ctx0, Q, K, V, 1.0f, -1);
+            } else {
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_cpy(ctx0,
+                                Qcur,
+                                ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                            0, 2, 1, 3);
+
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
-            //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale_inplace(ctx0,
-            //            KQ,
-            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-            //            );
+                //struct ggml_tensor * KQ_scaled =
+                //    ggml_scale_inplace(ctx0,
+                //            KQ,
+                //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
+                //            );
 
-            // no masking for cross-attention
-            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
+                // no masking for cross-attention
+                //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ);
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+            }
 
             struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
@@ -2214,6 +2908,21 @@ static bool whisper_decode_internal(
         wstate.use_buf(ctx0, 3);
 
         inpL = ggml_add(ctx0, cur, inpFF);
+
+        // with many sequences in the batch, the per-sequence self-attention can make the graph too big
+        // in that case, the layers so far are computed by a first graph and a new graph continues from its output
+        ggml_build_forward_expand(&gf, inpL);
+
+        n_nodes_layer = std::max(n_nodes_layer, gf.n_nodes - n_nodes_start);
+        mem_layer     = std::max(mem_layer, ggml_used_mem(ctx0) - mem_start);
+
+        if (il < n_layer - 1 && gf.n_nodes + 2*n_nodes_layer > GGML_MAX_NODES) {
+            graph.graphs.push_back(gf);
+
+            gf = {};
+
+            inpL = ggml_view_tensor(ctx0, inpL);
+        }
     }
 
     cur = inpL;
@@ -2235,39 +2944,168 @@ static bool whisper_decode_internal(
 
     wstate.use_buf(ctx0, 0);
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all N tokens
-    // might be useful in the future
-    cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    // compute logits only for the last token of each sequence, unless logits_all is set
+    if (N > n_rows) {
+        cur = ggml_get_rows(ctx0, cur, rows);
+    }
 
     struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
 
     wstate.use_buf(ctx0, -1);
 
-    // run the computation
+    ggml_build_forward_expand(&gf, logits);
+
+    graph.graphs.push_back(gf);
+    graph.logits = logits;
+
+    //printf("%s: n_seq = %d, N = %d, used_mem = %f MB / %f MB\n", __func__, n_seq, N,
+    //        ggml_used_mem(ctx0)/1024.0/1024.0, graph.buf.size()/1024.0/1024.0);
+
+    // the tensors stay in graph.buf
+    ggml_free(ctx0);
+
+    return true;
+}
+
+// evaluate the decoder
+//
+// given text prompt + audio features -> computes the logits for the next token
+//
+// multiple sequences can be evaluated in a single pass, each one with its own decoder (i.e. self-attention KV cache)
+// the weights and the cross-attention KV cache are shared, so the matrix multiplications are performed once for all
+// tokens of the batch. the logits for the last token of sequence i are stored at wstate.logits[i*n_vocab]
+// (with logits_all, a sequence gets one row of logits per token and the rows of the next sequences are shifted)
+//
+// the graph is built once for each batch shape and replayed for the next tokens, see whisper_decode_graph
+//
+//   - model:      the model
+//   - n_threads:  number of threads to use
+//   - seqs:       the sequences to evaluate
+//
+static bool whisper_decode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+    const std::vector<whisper_decode_seq> & seqs,
+              const int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const auto & hparams = wctx.model.hparams;
+
+    auto & logits_out = wstate.logits;
+
+    const int n_vocab = hparams.n_vocab;
+    const int n_ctx   = hparams.n_text_ctx;
+
+    const int n_seq = seqs.size();
+
+    const int M = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+    // find the graph for this batch shape
+    whisper_decode_graph * graph = nullptr;
     {
-        ggml_build_forward_expand(&gf, logits);
-        ggml_graph_compute       (ctx0, &gf);
+        std::vector<int> n_tokens(n_seq);
+        std::vector<int> n_kv    (n_seq);
+        std::vector<int> n_logits(n_seq);
+
+        for (int s = 0; s < n_seq; ++s) {
+            WHISPER_ASSERT(!!seqs[s].decoder->kv_self.ctx);
+            WHISPER_ASSERT(seqs[s].n_past + seqs[s].n_tokens <= n_ctx);
+
+            n_tokens[s] = seqs[s].n_tokens;
+            n_kv[s]     = std::min(n_ctx, WHISPER_DECODE_KV_PAD*((seqs[s].n_past + seqs[s].n_tokens + WHISPER_DECODE_KV_PAD - 1)/WHISPER_DECODE_KV_PAD));
+            n_logits[s] = seqs[s].logits_all ? seqs[s].n_tokens : 1;
+        }
+
+        for (auto & g : wstate.decode_graphs) {
+            if (g->M == M && g->n_tokens == n_tokens && g->n_kv == n_kv && g->n_logits == n_logits) {
+                graph = g.get();
+                break;
+            }
+        }
+
+        if (graph == nullptr) {
+            // evict the least recently used graph
+            if (wstate.decode_graphs.size() >= WHISPER_MAX_DECODE_GRAPHS) {
+                auto it = std::min_element(wstate.decode_graphs.begin(), wstate.decode_graphs.end(),
+                        [](const std::unique_ptr<whisper_decode_graph> & a, const std::unique_ptr<whisper_decode_graph> & b) {
+                            return a->t_last_used < b->t_last_used;
+                        });
+
+                wstate.decode_graphs.erase(it);
+            }
+
+            std::unique_ptr<whisper_decode_graph> g(new whisper_decode_graph);
+
+            g->M        = M;
+            g->n_tokens = std::move(n_tokens);
+            g->n_kv     = std::move(n_kv);
+            g->n_logits = std::move(n_logits);
+
+            if (!whisper_decode_graph_build(wctx, wstate, seqs, *g)) {
+                return false;
+            }
+
+            graph = g.get();
+
+            wstate.decode_graphs.push_back(std::move(g));
+        }
+
+        graph->t_last_used = ++wstate.n_decode_graph_calls;
     }
 
-    // extract logits for all N tokens
-    //logits_out.resize(N*n_vocab);
-    //memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*N*n_vocab);
+    // set the inputs
+    int n_rows = 0;
 
-    // extract logits only for the last token
-    logits_out.resize(n_vocab);
-    memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*n_vocab);
+    for (int s = 0, i0 = 0; s < n_seq; i0 += seqs[s].n_tokens, ++s) {
+        for (int i = 0; i < seqs[s].n_tokens; ++i) {
+            ((int32_t *) graph->embd->data)[i0 + i]     = seqs[s].tokens[i];
+            ((int32_t *) graph->position->data)[i0 + i] = seqs[s].n_past + i;
+        }
 
-    if (N > 1) {
-        //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
-        //        ggml_used_mem(ctx0)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(0)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(1)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(2)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(3)/1024.0/1024.0);
+        for (int i = seqs[s].n_tokens - graph->n_logits[s]; i < seqs[s].n_tokens; ++i) {
+            ((int32_t *) graph->rows->data)[n_rows++] = i0 + i;
+        }
     }
 
-    ggml_free(ctx0);
+    // point the views to the KV caches of the sequences
+    for (const auto & kv_view : graph->kv_views) {
+        const auto & seq = seqs[kv_view.seq];
+
+        const struct ggml_tensor * base = kv_view.is_v ? seq.decoder->kv_self.v : seq.decoder->kv_self.k;
+
+        kv_view.t->data = (char *) base->data + kv_view.offs + seq.n_past*kv_view.offs_past;
+    }
+
+    for (const auto & mask : graph->masks) {
+        ((int32_t *) mask.first->data)[0] = seqs[mask.second].n_past;
+    }
+
+    // run the computation
+    for (auto & gf : graph->graphs) {
+        // the work buffer is allocated from the compute buffer for each run
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ wstate.buf_compute.size(),
+            /*.mem_buffer =*/ wstate.buf_compute.data(),
+            /*.no_alloc   =*/ false,
+        };
+
+        struct ggml_context * ctx0 = ggml_init(params);
+
+        gf.n_threads  = n_threads;
+        gf.threadpool = wstate.get_threadpool(n_threads);
+        gf.work       = nullptr;
+        gf.work_size  = 0;
+
+        ggml_graph_compute(ctx0, &gf);
+
+        gf.work = nullptr;
+
+        ggml_free(ctx0);
+    }
+
+    // extract logits only for the last token of each sequence (or all tokens with logits_all)
+    logits_out.resize(n_rows*n_vocab);
+    memcpy(logits_out.data(), ggml_get_data(graph->logits), sizeof(float)*n_rows*n_vocab);
 
     wstate.t_decode_us += ggml_time_us() - t_start_us;
     wstate.n_decode++;
@@ -2275,6 +3113,17 @@ static bool whisper_decode_internal(
     return true;
 }
 
+static bool whisper_decode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+        whisper_decoder & decoder,
+    const whisper_token * tokens,
+              const int   n_tokens,
+              const int   n_past,
+              const int   n_threads) {
+    return whisper_decode_internal(wctx, wstate, { { &decoder, tokens, n_tokens, n_past, false } }, n_threads);
+}
+
 //  500 -> 00:05.000
 // 6000 -> 01:00.000
 static std::string to_timestamp(int64_t t, bool comma = false) {
@@ -2292,145 +3141,350 @@ static std::string to_timestamp(int64_t t, bool comma = false) {
     return std::string(buf);
 }
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const std::vector<float> & in, std::vector<float> & out) {
-    int N = in.size();
+// factorize n/2 into radix-4, radix-2 and odd radix passes and precompute the tables
+// for WHISPER_N_FFT = 400: 200 = 4*2*5*5
+static void whisper_fft_init(whisper_fft & fft, int n) {
+    WHISPER_ASSERT(n % 2 == 0);
 
-    out.resize(N*2);
+    const int m = n/2;
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+    fft.n = n;
 
-        for (int n = 0; n < N; n++) {
-            float angle = 2*M_PI*k*n/N;
-            re += in[n]*cos(angle);
-            im -= in[n]*sin(angle);
+    fft.factors.clear();
+    for (int r = m; r > 1; ) {
+        int p = r % 4 == 0 ? 4 : r % 2 == 0 ? 2 : 3;
+        while (r % p != 0) {
+            p += 2;
         }
-
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
+        WHISPER_ASSERT(p <= 8); // see whisper_fft_pass
+        fft.factors.push_back(p);
+        r /= p;
     }
-}
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(const std::vector<float> & in, std::vector<float> & out) {
-    out.resize(in.size()*2);
-
-    int N = in.size();
-
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
+    fft.w.resize(2*m);
+    for (int t = 0; t < m; t++) {
+        fft.w[2*t + 0] =  cos((2.0*M_PI*t)/m);
+        fft.w[2*t + 1] = -sin((2.0*M_PI*t)/m);
     }
 
-    if (N%2 == 1) {
-        dft(in, out);
-        return;
+    fft.w_split.resize(2*m);
+    for (int k = 0; k < m; k++) {
+        fft.w_split[2*k + 0] =  cos((2.0*M_PI*k)/n);
+        fft.w_split[2*k + 1] = -sin((2.0*M_PI*k)/n);
     }
 
-    std::vector<float> even;
-    std::vector<float> odd;
-
-    even.reserve(N/2);
-    odd.reserve(N/2);
-
-    for (int i = 0; i < N; i++) {
-        if (i % 2 == 0) {
-            even.push_back(in[i]);
-        } else {
-            odd.push_back(in[i]);
-        }
+    fft.hann.resize(n);
+    for (int i = 0; i < n; i++) {
+        fft.hann[i] = 0.5*(1.0 - cos((2.0*M_PI*i)/n));
     }
+}
+
+// one radix-p pass of the complex FFT of size m = l1*p*ido (self-sorting, out-of-place)
+// cc: [ido, p, l1] -> ch: [ido, l1, p]
+static void whisper_fft_pass(
+        const float * w,
+                int   m,
+                int   p,
+                int   l1,
+                int   ido,
+        const float * cc,
+              float * ch) {
+    const int st = m/p;
+
+    for (int k = 0; k < l1; k++) {
+        for (int i = 0; i < ido; i++) {
+            float t[2*8]; // p-point DFT of the inputs, before applying the twiddle factors
+
+            const float * a = cc + 2*(i + ido*p*k);
+
+            if (p == 2) {
+                t[0] = a[0] + a[2*ido + 0];
+                t[1] = a[1] + a[2*ido + 1];
+                t[2] = a[0] - a[2*ido + 0];
+                t[3] = a[1] - a[2*ido + 1];
+            } else if (p == 4) {
+                const float * a0 = a;
+                const float * a1 = a + 2*ido;
+                const float * a2 = a + 4*ido;
+                const float * a3 = a + 6*ido;
+
+                const float s0r = a0[0] + a2[0], s0i = a0[1] + a2[1];
+                const float d0r = a0[0] - a2[0], d0i = a0[1] - a2[1];
+                const float s1r = a1[0] + a3[0], s1i = a1[1] + a3[1];
+                const float d1r = a1[0] - a3[0], d1i = a1[1] - a3[1];
+
+                t[0] = s0r + s1r; t[1] = s0i + s1i;
+                t[2] = d0r + d1i; t[3] = d0i - d1r; // d0 - i*d1
+                t[4] = s0r - s1r; t[5] = s0i - s1i;
+                t[6] = d0r - d1i; t[7] = d0i + d1r; // d0 + i*d1
+            } else if (p == 5) {
+                const float c1 = 0.309016994374947f;  // cos(2*pi/5)
+                const float c2 = -0.809016994374947f; // cos(4*pi/5)
+                const float s1 = 0.951056516295154f;  // sin(2*pi/5)
+                const float s2 = 0.587785252292473f;  // sin(4*pi/5)
+
+                const float * a0 = a;
+                const float * a1 = a + 2*ido;
+                const float * a2 = a + 4*ido;
+                const float * a3 = a + 6*ido;
+                const float * a4 = a + 8*ido;
+
+                const float t1r = a1[0] + a4[0], t1i = a1[1] + a4[1];
+                const float t2r = a2[0] + a3[0], t2i = a2[1] + a3[1];
+                const float t3r = a1[0] - a4[0], t3i = a1[1] - a4[1];
+                const float t4r = a2[0] - a3[0], t4i = a2[1] - a3[1];
+
+                const float b1r = a0[0] + c1*t1r + c2*t2r, b1i = a0[1] + c1*t1i + c2*t2i;
+                const float b2r = a0[0] + c2*t1r + c1*t2r, b2i = a0[1] + c2*t1i + c1*t2i;
+                const float d1r = s1*t3r + s2*t4r,         d1i = s1*t3i + s2*t4i;
+                const float d2r = s2*t3r - s1*t4r,         d2i = s2*t3i - s1*t4i;
+
+                t[0] = a0[0] + t1r + t2r; t[1] = a0[1] + t1i + t2i;
+                t[2] = b1r + d1i; t[3] = b1i - d1r; // b1 - i*d1
+                t[4] = b2r + d2i; t[5] = b2i - d2r; // b2 - i*d2
+                t[6] = b2r - d2i; t[7] = b2i + d2r; // b2 + i*d2
+                t[8] = b1r - d1i; t[9] = b1i + d1r; // b1 + i*d1
+            } else {
+                for (int u = 0; u < p; u++) {
+                    float re = 0.0f;
+                    float im = 0.0f;
 
-    std::vector<float> even_fft;
-    std::vector<float> odd_fft;
+                    for (int j = 0, uj = 0; j < p; j++) {
+                        const float * aj = a + 2*ido*j;
+                        const float * r  = w + 2*uj*st;
 
-    fft(even, even_fft);
-    fft(odd, odd_fft);
+                        re += aj[0]*r[0] - aj[1]*r[1];
+                        im += aj[0]*r[1] + aj[1]*r[0];
 
-    for (int k = 0; k < N/2; k++) {
-        float theta = 2*M_PI*k/N;
+                        uj += u;
+                        if (uj >= p) {
+                            uj -= p;
+                        }
+                    }
 
-        float re = cos(theta);
-        float im = -sin(theta);
+                    t[2*u + 0] = re;
+                    t[2*u + 1] = im;
+                }
+            }
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+            float * b = ch + 2*(i + ido*k);
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+            for (int u = 0; u < p; u++) {
+                const float * tw = w + 2*(u*i*l1);
+                      float * bu = b + 2*ido*l1*u;
 
-        out[2*(k + N/2) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + N/2) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+                bu[0] = t[2*u + 0]*tw[0] - t[2*u + 1]*tw[1];
+                bu[1] = t[2*u + 0]*tw[1] + t[2*u + 1]*tw[0];
+            }
+        }
     }
 }
 
-static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> &hann, const float *samples,
-                                              int n_samples, int fft_size, int fft_step, int n_threads,
-                                              const whisper_filters &filters, bool speed_up, whisper_mel &mel) {
-    std::vector<float> fft_in(fft_size, 0.0);
-    std::vector<float> fft_out(2 * fft_size);
-    int n_fft = 1 + (speed_up ? fft_size / 4 : fft_size / 2);
+// power spectrum of the real input: out[k] = |X[k]|^2, k = 0 .. n/2
+// buf must have room for 2*n floats
+static void whisper_fft_power(const whisper_fft & fft, const float * in, float * out, float * buf) {
+    const int n = fft.n;
+    const int m = n/2;
 
-    for (int i = ith; i < mel.n_len; i += n_threads) {
-        const int offset = i * fft_step;
+    // treat the real input as m complex values z[k] = in[2k] + i*in[2k + 1]
+    const float * src = in;
+          float * dst = buf;
 
-        // apply Hanning window
-        for (int j = 0; j < fft_size; j++) {
-            if (offset + j < n_samples) {
-                fft_in[j] = hann[j] * samples[offset + j];
-            } else {
-                fft_in[j] = 0.0;
-            }
-        }
+    for (int f = 0, l1 = 1; f < (int) fft.factors.size(); f++) {
+        const int p = fft.factors[f];
 
-        // FFT -> mag^2
-        fft(fft_in, fft_out);
+        whisper_fft_pass(fft.w.data(), m, p, l1, m/(l1*p), src, dst);
 
-        for (int j = 0; j < fft_size; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
-        for (int j = 1; j < fft_size / 2; j++) {
-            fft_out[j] += fft_out[fft_size - j];
-        }
+        src = dst;
+        dst = dst == buf ? buf + n : buf;
+        l1 *= p;
+    }
 
-        if (speed_up) {
-            // scale down in the frequency domain results in a speed up in the time domain
-            for (int j = 0; j < n_fft; j++) {
-                fft_out[j] = 0.5 * (fft_out[2 * j] + fft_out[2 * j + 1]);
-            }
-        }
+    // split Z = FFT(z) into the spectrum X of the real input:
+    //   X[k] = (Z[k] + conj(Z[m - k]))/2 - i*w^k*(Z[k] - conj(Z[m - k]))/2
+    const float * Z = src;
 
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
+    out[0] = (Z[0] + Z[1])*(Z[0] + Z[1]);
+    out[m] = (Z[0] - Z[1])*(Z[0] - Z[1]);
 
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                    fft_out[k + 0] * filters.data[j*n_fft + k + 0] +
-                    fft_out[k + 1] * filters.data[j*n_fft + k + 1] +
-                    fft_out[k + 2] * filters.data[j*n_fft + k + 2] +
-                    fft_out[k + 3] * filters.data[j*n_fft + k + 3];
-            }
+    for (int k = 1; k < m; k++) {
+        const float ar = Z[2*k + 0];
+        const float ai = Z[2*k + 1];
+        const float br =  Z[2*(m - k) + 0];
+        const float bi = -Z[2*(m - k) + 1];
 
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
-            }
+        const float er = 0.5f*(ar + br);
+        const float ei = 0.5f*(ai + bi);
+        const float dr = 0.5f*(ar - br);
+        const float di = 0.5f*(ai - bi);
 
-            sum = log10(std::max(sum, 1e-10));
+        const float wr = fft.w_split[2*k + 0];
+        const float wi = fft.w_split[2*k + 1];
 
-            mel.data[j * mel.n_len + i] = sum;
+        // -i*w*d
+        const float or_ =  wr*di + wi*dr;
+        const float oi  = -(wr*dr - wi*di);
+
+        const float xr = er + or_;
+        const float xi = ei + oi;
+
+        out[k] = xr*xr + xi*xi;
+    }
+}
+
+// dot product of two float arrays, n must be a multiple of 4
+static inline float whisper_vec_dot_f32x4(const float * x, const float * y, int n) {
+#if defined(__ARM_NEON)
+    float32x4_t sum = vdupq_n_f32(0.0f);
+    for (int i = 0; i < n; i += 4) {
+        sum = vmlaq_f32(sum, vld1q_f32(x + i), vld1q_f32(y + i));
+    }
+
+    const float32x2_t s = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+
+    return vget_lane_f32(vpadd_f32(s, s), 0);
+#elif defined(__SSE__) || defined(_M_X64)
+    __m128 sum = _mm_setzero_ps();
+    for (int i = 0; i < n; i += 4) {
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+    }
+
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+
+    return _mm_cvtss_f32(sum);
+#else
+    float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (int i = 0; i < n; i += 4) {
+        sum[0] += x[i + 0]*y[i + 0];
+        sum[1] += x[i + 1]*y[i + 1];
+        sum[2] += x[i + 2]*y[i + 2];
+        sum[3] += x[i + 3]*y[i + 3];
+    }
+
+    return (sum[0] + sum[2]) + (sum[1] + sum[3]);
+#endif
+}
+
+// log10 mel energies of the frame that starts at samples[offset], zero-padded past n_samples
+// the energy of mel band j is stored in out[j*band_stride]
+// fft_in, fft_out and fft_buf are work buffers of size fft.n, fft.n/2 + 2 and 2*fft.n
+static void log_mel_spectrogram_frame(
+        const whisper_fft & fft, const whisper_filters & filters, bool speed_up,
+        const float * samples, int64_t n_samples, int64_t offset, int n_mel,
+        float * fft_in, float * fft_out, float * fft_buf, float * out, int band_stride) {
+    const int fft_size = fft.n;
+    const int n_fft    = 1 + (speed_up ? fft_size / 4 : fft_size / 2);
+
+    const auto & hann = fft.hann;
+
+    // apply Hanning window
+    for (int j = 0; j < fft_size; j++) {
+        if (offset + j < n_samples) {
+            fft_in[j] = hann[j] * samples[offset + j];
+        } else {
+            fft_in[j] = 0.0;
+        }
+    }
+
+    // FFT -> mag^2
+    whisper_fft_power(fft, fft_in, fft_out, fft_buf);
+
+    // fold the negative frequencies onto the positive ones
+    // (the phase vocoder below also reads the first negative frequency bin)
+    fft_out[fft_size/2 + 1] = fft_out[fft_size/2 - 1];
+    for (int j = 1; j < fft_size / 2; j++) {
+        fft_out[j] *= 2.0f;
+    }
+
+    if (speed_up) {
+        // scale down in the frequency domain results in a speed up in the time domain
+        for (int j = 0; j < n_fft; j++) {
+            fft_out[j] = 0.5 * (fft_out[2 * j] + fft_out[2 * j + 1]);
+        }
+    }
+
+    // mel spectrogram, using only the non-zero weights of each filter
+    for (int j = 0; j < n_mel; j++) {
+        double sum = whisper_vec_dot_f32x4(
+                fft_out + filters.band_start[j], filters.band_w.data() + filters.band_offs[j], filters.band_len[j]);
+
+        sum = log10(std::max(sum, 1e-10));
+
+        out[j*band_stride] = sum;
+    }
+}
+
+static void log_mel_spectrogram_worker_thread(int ith, const whisper_fft & fft, const float * samples,
+                                              int64_t n_samples, int fft_step, int n_frames, int n_mel, int n_threads,
+                                              const whisper_filters & filters, bool speed_up,
+                                              float * out, int frame_stride, int band_stride) {
+    const int fft_size = fft.n;
+
+    std::vector<float> fft_in(fft_size, 0.0);
+    std::vector<float> fft_out(fft_size/2 + 2);
+    std::vector<float> fft_buf(2 * fft_size);
+
+    for (int i = ith; i < n_frames; i += n_threads) {
+        log_mel_spectrogram_frame(
+                fft, filters, speed_up, samples, n_samples, (int64_t) i*fft_step, n_mel,
+                fft_in.data(), fft_out.data(), fft_buf.data(), out + (int64_t) i*frame_stride, band_stride);
+    }
+}
+
+// compute the log10 mel energies of n_frames frames, spaced fft_step samples apart, using n_threads threads
+// frame i is stored at out + i*frame_stride, with band_stride floats between the mel bands
+static void log_mel_spectrogram_frames(
+        const whisper_fft & fft, const whisper_filters & filters, bool speed_up,
+        const float * samples, int64_t n_samples, int fft_step, int n_frames, int n_mel, int n_threads,
+        float * out, int frame_stride, int band_stride) {
+    n_threads = std::max(1, std::min(n_threads, n_frames));
+
+    std::vector<std::thread> workers(n_threads - 1);
+    for (int iw = 0; iw < n_threads - 1; ++iw) {
+        workers[iw] = std::thread(
+                log_mel_spectrogram_worker_thread, iw + 1, std::cref(fft), samples,
+                n_samples, fft_step, n_frames, n_mel, n_threads,
+                std::cref(filters), speed_up, out, frame_stride, band_stride);
+    }
+
+    // main thread
+    log_mel_spectrogram_worker_thread(0, fft, samples, n_samples, fft_step, n_frames, n_mel, n_threads, filters, speed_up, out, frame_stride, band_stride);
+
+    for (int iw = 0; iw < n_threads - 1; ++iw) {
+        workers[iw].join();
+    }
+}
+
+// pad audio with at least one extra chunk of zeros
+static int log_mel_spectrogram_n_len_padded(int n_len) {
+    const int pad = (100*WHISPER_CHUNK_SIZE)/2;
+
+    if (n_len % pad != 0) {
+        n_len = (n_len/pad + 1)*pad;
+    }
+
+    return n_len + pad;
+}
+
+// clamping and normalization
+static void log_mel_spectrogram_normalize(whisper_mel & mel) {
+    double mmax = -1e20;
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] > mmax) {
+            mmax = mel.data[i];
+        }
+    }
+    //printf("%s: max = %f\n", __func__, mmax);
+
+    mmax -= 8.0;
+
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] < mmax) {
+            mel.data[i] = mmax;
         }
+
+        mel.data[i] = (mel.data[i] + 4.0)/4.0;
     }
 }
 
@@ -2440,7 +3494,7 @@ static bool log_mel_spectrogram(
             const float * samples,
               const int   n_samples,
               const int   /*sample_rate*/,
-              const int   fft_size,
+      const whisper_fft & fft,
               const int   fft_step,
               const int   n_mel,
               const int   n_threads,
@@ -2449,79 +3503,161 @@ static bool log_mel_spectrogram(
             whisper_mel & mel) {
     const int64_t t_start_us = ggml_time_us();
 
-    // Hanning window
-    std::vector<float> hann;
-    hann.resize(fft_size);
-    for (int i = 0; i < fft_size; i++) {
-        hann[i] = 0.5*(1.0 - cos((2.0*M_PI*i)/(fft_size)));
-    }
-
     mel.n_mel     = n_mel;
     mel.n_len     = n_samples/fft_step;
     mel.n_len_org = mel.n_len;
 
-    std::vector<float> samples_padded;
+    // the frames past the end of the audio are zero-padded
+    mel.n_len = log_mel_spectrogram_n_len_padded(mel.n_len);
 
-    // pad audio with at least one extra chunk of zeros
-    {
-        const int pad = (100*WHISPER_CHUNK_SIZE)/2;
+    mel.data.resize(mel.n_mel*mel.n_len);
 
-        if (mel.n_len % pad != 0) {
-            mel.n_len = (mel.n_len/pad + 1)*pad;
-        }
-        mel.n_len += pad;
+    //printf("%s: n_samples = %d, n_len = %d\n", __func__, n_samples, mel.n_len);
+    //printf("%s: recording length: %f s\n", __func__, (float) n_samples/sample_rate);
+
+    log_mel_spectrogram_frames(
+            fft, filters, speed_up, samples, n_samples, fft_step, mel.n_len, mel.n_mel, n_threads,
+            mel.data.data(), 1, mel.n_len);
+
+    log_mel_spectrogram_normalize(mel);
+
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
+
+    //printf("mel.n_len() = %d, divided by 1500: %f, n_samples / fft_step: %d\n", mel.n_len, mel.n_len / 1500.0, n_samples / fft_step);
+
+    return true;
+}
+
+static void log_mel_stream_reset(whisper_mel_stream & stream) {
+    stream.n_samples = 0;
+    stream.n_frames  = 0;
+
+    stream.pcm.clear();
+    stream.ring.clear();
+}
+
+// append samples to the stream and compute the frames that became complete
+static bool log_mel_stream_append(
+          whisper_state & wstate,
+     whisper_mel_stream & stream,
+            const float * samples,
+              const int   n_samples,
+      const whisper_fft & fft,
+              const int   n_threads,
+  const whisper_filters & filters) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const int fft_step = WHISPER_HOP_LENGTH;
+    const int n_mel    = WHISPER_N_MEL;
+
+    if (stream.ring.empty()) {
+        stream.ring.resize((size_t) stream.n_frames_max*n_mel);
+    }
+
+    stream.pcm.insert(stream.pcm.end(), samples, samples + n_samples);
+    stream.n_samples += n_samples;
+
+    // frame f is complete once all of its fft.n samples are available
+    const int64_t n_frames = stream.n_samples < fft.n ? 0 : (stream.n_samples - fft.n)/fft_step + 1;
+
+    // only the last n_frames_max frames fit in the ring buffer
+    const int64_t f0 = std::max(stream.n_frames, n_frames - stream.n_frames_max);
+
+    // compute the new frames in up to two contiguous runs of the ring buffer
+    for (int64_t f = f0; f < n_frames; ) {
+        const int i_ring = f % stream.n_frames_max;
+        const int n_run  = std::min(n_frames - f, (int64_t) (stream.n_frames_max - i_ring));
 
-        samples_padded.resize(mel.n_len*fft_step);
-        memcpy(samples_padded.data(), samples, n_samples*sizeof(float));
-        memset(samples_padded.data() + n_samples, 0, (mel.n_len*fft_step - n_samples)*sizeof(float));
+        const int64_t offset = (f - stream.n_frames)*fft_step;
 
-        samples = samples_padded.data();
+        log_mel_spectrogram_frames(
+                fft, filters, false, stream.pcm.data() + offset, stream.pcm.size() - offset, fft_step, n_run, n_mel, n_threads,
+                stream.ring.data() + (size_t) i_ring*n_mel, n_mel, 1);
+
+        f += n_run;
+    }
+
+    // drop the samples that are no longer needed
+    stream.pcm.erase(stream.pcm.begin(), stream.pcm.begin() + (n_frames - stream.n_frames)*fft_step);
+    stream.n_frames = n_frames;
+
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
+
+    return true;
+}
+
+// assemble the log mel spectrogram of the last n_samples of the stream
+// the result is identical to log_mel_spectrogram() of the same samples, with the window start aligned to fft_step
+static bool log_mel_stream_window(
+          whisper_state & wstate,
+const whisper_mel_stream & stream,
+                    int   n_samples,
+      const whisper_fft & fft,
+  const whisper_filters & filters,
+            whisper_mel & mel) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const int fft_step = WHISPER_HOP_LENGTH;
+    const int n_mel    = WHISPER_N_MEL;
+
+    n_samples = (int) std::min((int64_t) std::max(n_samples, 0), stream.n_samples);
+
+    // first frame of the window
+    const int64_t f0 = (stream.n_samples - n_samples)/fft_step;
+
+    if (f0 < stream.n_frames - stream.n_frames_max) {
+        fprintf(stderr, "%s: window of %d samples is longer than the stream buffer (%d frames)\n", __func__, n_samples, stream.n_frames_max);
+        return false;
     }
 
+    mel.n_mel     = n_mel;
+    mel.n_len     = (stream.n_samples - f0*fft_step)/fft_step;
+    mel.n_len_org = mel.n_len;
+
+    mel.n_len = log_mel_spectrogram_n_len_padded(mel.n_len);
+
     mel.data.resize(mel.n_mel*mel.n_len);
 
-    //printf("%s: n_samples = %d, n_len = %d\n", __func__, n_samples, mel.n_len);
-    //printf("%s: recording length: %f s\n", __func__, (float) n_samples/sample_rate);
+    int i = 0;
 
-    {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), samples,
-                    n_samples, fft_size, fft_step, n_threads,
-                    std::cref(filters), speed_up, std::ref(mel));
+    // complete frames from the ring buffer
+    for (; i < mel.n_len && f0 + i < stream.n_frames; i++) {
+        const float * src = stream.ring.data() + (size_t) ((f0 + i) % stream.n_frames_max)*n_mel;
+        for (int j = 0; j < n_mel; j++) {
+            mel.data[j*mel.n_len + i] = src[j];
         }
+    }
 
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples, n_samples, fft_size, fft_step, n_threads, filters, speed_up, mel);
+    // frames that overlap the end of the stream
+    {
+        const int64_t offset = (f0 + i - stream.n_frames)*fft_step;
 
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
+        int n_partial = 0;
+        while (i + n_partial < mel.n_len && offset + (int64_t) n_partial*fft_step < (int64_t) stream.pcm.size()) {
+            n_partial++;
         }
-    }
 
-    // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
+        if (n_partial > 0) {
+            log_mel_spectrogram_frames(
+                    fft, filters, false, stream.pcm.data() + offset, stream.pcm.size() - offset, fft_step, n_partial, n_mel, 1,
+                    mel.data.data() + i, 1, mel.n_len);
         }
+
+        i += n_partial;
     }
-    //printf("%s: max = %f\n", __func__, mmax);
 
-    mmax -= 8.0;
+    // frames past the end of the stream contain only zeros
+    {
+        const float zero = log10(std::max(0.0, 1e-10));
 
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
+        for (int j = 0; j < n_mel; j++) {
+            std::fill(mel.data.begin() + j*mel.n_len + i, mel.data.begin() + (j + 1)*mel.n_len, zero);
         }
-
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
     }
 
-    wstate.t_mel_us += ggml_time_us() - t_start_us;
+    log_mel_spectrogram_normalize(mel);
 
-    //printf("mel.n_len() = %d, divided by 1500: %f, n_samples / fft_step: %d\n", mel.n_len, mel.n_len / 1500.0, n_samples / fft_step);
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
 
     return true;
 }
@@ -2536,51 +3672,90 @@ static bool log_mel_spectrogram(
 // Regex (C++):
 // R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
 //
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+// the words are split by whisper_pre_tokenize, which matches the C++ regex in the "C" locale
+//
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+static bool whisper_is_alpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+static bool whisper_is_digit(char c) { return c >= '0' && c <= '9'; }
+static bool whisper_is_space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+static bool whisper_is_other(char c) { return !whisper_is_alpha(c) && !whisper_is_digit(c) && !whisper_is_space(c); }
 
-        std::regex re(pat);
-        std::smatch m;
+// length of the word that starts at text[i]
+static size_t whisper_pre_tokenize(const std::string & text, size_t i) {
+    const size_t n = text.size();
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
-            }
-            str = m.suffix();
+    // 's|'t|'re|'ve|'m|'ll|'d
+    if (text[i] == '\'' && i + 1 < n) {
+        const char c1 = text[i + 1];
+        if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+            return 2;
         }
+
+        const char c2 = i + 2 < n ? text[i + 2] : 0;
+        if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') || (c1 == 'l' && c2 == 'l')) {
+            return 3;
+        }
+    }
+
+    //  ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+
+    for (auto is_class : { whisper_is_alpha, whisper_is_digit, whisper_is_other }) {
+        size_t j = i;
+        if (text[j] == ' ' && j + 1 < n && is_class(text[j + 1])) {
+            j++;
+        }
+
+        if (!is_class(text[j])) {
+            continue;
+        }
+
+        while (j < n && is_class(text[j])) {
+            j++;
+        }
+
+        return j - i;
+    }
+
+    // \s+(?!\S)|\s+ - a run of spaces leaves its last space to the word that follows it
+    size_t j = i;
+    while (j < n && whisper_is_space(text[j])) {
+        j++;
     }
 
-    // find the longest tokens that form the words:
+    return j < n && j - i > 1 ? j - i - 1 : j - i;
+}
+
+static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
     std::vector<whisper_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.empty()) continue;
 
+    std::string sub;
+    sub.reserve(vocab.max_token_len);
+
+    for (size_t i0 = 0; i0 < text.size(); ) {
+        // first split the text into words
+        const int n = whisper_pre_tokenize(text, i0);
+
+        // find the longest tokens that form the word
         int i = 0;
-        int n = word.size();
         while (i < n) {
-            int j = n;
             bool found = false;
-            while (j > i) {
-                auto sub = word.substr(i, j-i);
-                auto it = vocab.token_to_id.find(sub);
+            for (int j = std::min(n, i + vocab.max_token_len); j > i; --j) {
+                sub.assign(text, i0 + i, j - i);
+
+                const auto it = vocab.token_to_id.find(sub);
                 if (it != vocab.token_to_id.end()) {
                     tokens.push_back(it->second);
                     i = j;
                     found = true;
                     break;
                 }
-                --j;
             }
             if (!found) {
                 fprintf(stderr, "unknown token \n");
                 ++i;
             }
         }
+
+        i0 += n;
     }
 
     return tokens;
@@ -2618,7 +3793,10 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
 
     const size_t scale = ctx->model.hparams.ftype ? 1 : 2;
 
-    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_SELF.at(ctx->model.type), state->decoders[0].kv_self, ctx->itype, ctx->model.hparams.n_text_ctx)) {
+    // the memory requirements are for K and V caches in itype
+    const float kv_scale = (ggml_type_sizef(ctx->ktype) + ggml_type_sizef(ctx->itype))/(2*ggml_type_sizef(ctx->itype));
+
+    if (!kv_cache_init(ctx->model.hparams, kv_scale * scale * MEM_REQ_KV_SELF.at(ctx->model.type), state->decoders[0].kv_self, ctx->ktype, ctx->itype, ctx->model.hparams.n_text_ctx)) {
         fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
         delete state;
         return nullptr;
@@ -2629,7 +3807,7 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         fprintf(stderr, "%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
     }
 
-    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_CROSS.at(ctx->model.type), state->kv_cross, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
+    if (!kv_cache_init(ctx->model.hparams, kv_scale * scale * MEM_REQ_KV_CROSS.at(ctx->model.type), state->kv_cross, ctx->ktype, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
         fprintf(stderr, "%s: kv_cache_init() failed for cross-attention cache\n", __func__);
         delete state;
         return nullptr;
@@ -2669,7 +3847,12 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     state->decoders[0].logprobs.reserve(ctx->vocab.n_vocab);
     state->buf_compute.resize(scale * std::max(MEM_REQ_ENCODE.at(ctx->model.type), MEM_REQ_DECODE.at(ctx->model.type)));
 
-    state->buf_scratch[0].resize(MEM_REQ_SCRATCH0.at(ctx->model.type));
+    // the decoder falls back to the KQ matrices with Q8_0 K caches (see whisper_decode_graph_build)
+    if (ctx->flash_attn && ctx->ktype == ctx->itype) {
+        state->buf_scratch[0].resize(MEM_REQ_SCRATCH0_FLASH_ATTN.at(ctx->model.type));
+    } else {
+        state->buf_scratch[0].resize(MEM_REQ_SCRATCH0.at(ctx->model.type));
+    }
     state->buf_scratch[1].resize(MEM_REQ_SCRATCH1.at(ctx->model.type));
     state->buf_scratch[2].resize(MEM_REQ_SCRATCH2.at(ctx->model.type));
     state->buf_scratch[3].resize(MEM_REQ_SCRATCH3.at(ctx->model.type));
@@ -2679,10 +3862,95 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     return state;
 }
 
-struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
+static struct whisper_context * whisper_init_no_state_internal(struct whisper_model_loader * loader, whisper_mmap_reader * mreader);
+
+struct whisper_context_params whisper_context_default_params() {
+    struct whisper_context_params result = {
+        /*.use_mmap  =*/ false,
+        /*.use_mlock =*/ false,
+        /*.prefetch  =*/ true,
+        /*.kv_q8_0   =*/ false,
+        /*.repack    =*/ false,
+        /*.flash_attn =*/ false,
+    };
+
+    return result;
+}
+
+static struct whisper_context * whisper_init_from_mmap_no_state(const char * path_model, struct whisper_context_params params) {
+    std::unique_ptr<whisper_mmap> mapping(new whisper_mmap);
+    if (!mapping->init(path_model, params.prefetch)) {
+        fprintf(stderr, "%s: failed to map '%s'\n", __func__, path_model);
+        return nullptr;
+    }
+
+    whisper_mmap_reader reader = { mapping.get(), 0 };
+
+    whisper_model_loader loader = {};
+
+    loader.context = &reader;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        whisper_mmap_reader * reader = reinterpret_cast<whisper_mmap_reader *>(ctx);
+
+        const size_t size_to_copy = std::min(read_size, reader->mapping->size - reader->offs);
+
+        memcpy(output, (const uint8_t *) reader->mapping->addr + reader->offs, size_to_copy);
+        reader->offs += size_to_copy;
+
+        return size_to_copy;
+    };
+
+    loader.eof = [](void * ctx) {
+        whisper_mmap_reader * reader = reinterpret_cast<whisper_mmap_reader *>(ctx);
+
+        return reader->offs >= reader->mapping->size;
+    };
+
+    loader.close = [](void * /*ctx*/) { };
+
+    auto ctx = whisper_init_no_state_internal(&loader, &reader);
+
+    if (ctx) {
+        if (params.use_mlock) {
+            mapping->lock();
+        }
+
+        ctx->mapping = std::move(mapping);
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
 
     fprintf(stderr, "%s: loading model from '%s'\n", __func__, path_model);
 
+#if defined(GGML_BIG_ENDIAN)
+    if (params.use_mmap) {
+        // the weights have to be byteswapped, so they cannot be used in place
+        fprintf(stderr, "%s: mmap is not supported on big endian systems, reading the model instead\n", __func__);
+        params.use_mmap = false;
+    }
+#endif
+
+    if (params.use_mmap && params.repack) {
+        // the weights are used in place from the read-only mapping
+        fprintf(stderr, "%s: weight repacking is not supported with mmap, ignoring it\n", __func__);
+    }
+
+    if (params.use_mmap) {
+        auto ctx = whisper_init_from_mmap_no_state(path_model, params);
+
+        if (ctx) {
+            ctx->path_model = path_model;
+            ctx->ktype      = params.kv_q8_0 ? GGML_TYPE_Q8_0 : ctx->itype;
+            ctx->flash_attn = params.flash_attn;
+        }
+
+        return ctx;
+    }
+
     auto fin = std::ifstream(path_model, std::ios::binary);
     if (!fin) {
         fprintf(stderr, "%s: failed to open '%s'\n", __func__, path_model);
@@ -2713,11 +3981,21 @@ struct whisper_context * whisper_init_from_file_no_state(const char * path_model
 
     if (ctx) {
         ctx->path_model = path_model;
+        ctx->ktype      = params.kv_q8_0 ? GGML_TYPE_Q8_0 : ctx->itype;
+        ctx->flash_attn = params.flash_attn;
+
+        if (params.repack) {
+            whisper_model_repack(*ctx);
+        }
     }
 
     return ctx;
 }
 
+struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
+    return whisper_init_from_file_with_params_no_state(path_model, whisper_context_default_params());
+}
+
 struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
     struct buf_context {
         uint8_t* buffer;
@@ -2755,12 +4033,12 @@ struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t
     return whisper_init_no_state(&loader);
 }
 
-struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
+static struct whisper_context * whisper_init_no_state_internal(struct whisper_model_loader * loader, whisper_mmap_reader * mreader) {
     ggml_time_init();
 
     whisper_context * ctx = new whisper_context;
 
-    if (!whisper_model_load(loader, *ctx)) {
+    if (!whisper_model_load(loader, *ctx, mreader)) {
         loader->close(loader->context);
         fprintf(stderr, "%s: failed to load model\n", __func__);
         delete ctx;
@@ -2769,11 +4047,18 @@ struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loa
 
     loader->close(loader->context);
 
+    whisper_fft_init(ctx->fft,         WHISPER_N_FFT);
+    whisper_fft_init(ctx->fft_vocoder, 2*WHISPER_N_FFT);
+
     return ctx;
 }
 
-struct whisper_context * whisper_init_from_file(const char * path_model) {
-    whisper_context * ctx = whisper_init_from_file_no_state(path_model);
+struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
+    return whisper_init_no_state_internal(loader, nullptr);
+}
+
+struct whisper_context * whisper_init_from_file_with_params(const char * path_model, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_from_file_with_params_no_state(path_model, params);
     if (!ctx) {
         return nullptr;
     }
@@ -2787,6 +4072,10 @@ struct whisper_context * whisper_init_from_file(const char * path_model) {
     return ctx;
 }
 
+struct whisper_context * whisper_init_from_file(const char * path_model) {
+    return whisper_init_from_file_with_params(path_model, whisper_context_default_params());
+}
+
 struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
     whisper_context * ctx = whisper_init_from_buffer_no_state(buffer, buffer_size);
     if (!ctx) {
@@ -2833,6 +4122,10 @@ void whisper_free_state(struct whisper_state * state)
         }
 #endif
 
+        ggml_threadpool_free(state->threadpool);
+
+        whisper_free_state(state->draft_state);
+
         delete state;
     }
 }
@@ -2842,12 +4135,19 @@ void whisper_free(struct whisper_context * ctx) {
         if (ctx->model.ctx) {
             ggml_free(ctx->model.ctx);
         }
+        if (ctx->model.ctx_conv) {
+            ggml_free(ctx->model.ctx_conv);
+        }
         if (ctx->model.buf) {
             delete ctx->model.buf;
         }
 
         whisper_free_state(ctx->state);
 
+        for (auto & state : ctx->parallel_states) {
+            whisper_free_state(state);
+        }
+
         delete ctx;
     }
 }
@@ -2859,7 +4159,7 @@ void whisper_free_params(struct whisper_full_params * params) {
 }
 
 int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, false, state->mel)) {
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, ctx->fft, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, false, state->mel)) {
         fprintf(stderr, "%s: failed to compute mel spectrogram\n", __func__);
         return -1;
     }
@@ -2873,7 +4173,7 @@ int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int
 
 // same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2
 int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, true, state->mel)) {
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, ctx->fft_vocoder, 2 * WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, true, state->mel)) {
         fprintf(stderr, "%s: failed to compute mel spectrogram\n", __func__);
         return -1;
     }
@@ -2915,6 +4215,40 @@ int whisper_set_mel(
     return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
 }
 
+int whisper_mel_stream_append_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    if (!log_mel_stream_append(*state, state->mel_stream, samples, n_samples, ctx->fft, n_threads, ctx->model.filters)) {
+        fprintf(stderr, "%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_mel_stream_append(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_mel_stream_append_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+int whisper_mel_stream_window_with_state(struct whisper_context * ctx, struct whisper_state * state, int n_samples) {
+    if (!log_mel_stream_window(*state, state->mel_stream, n_samples, ctx->fft, ctx->model.filters, state->mel)) {
+        fprintf(stderr, "%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_mel_stream_window(struct whisper_context * ctx, int n_samples) {
+    return whisper_mel_stream_window_with_state(ctx, ctx->state, n_samples);
+}
+
+void whisper_mel_stream_reset_with_state(struct whisper_context * /*ctx*/, struct whisper_state * state) {
+    log_mel_stream_reset(state->mel_stream);
+}
+
+void whisper_mel_stream_reset(struct whisper_context * ctx) {
+    whisper_mel_stream_reset_with_state(ctx, ctx->state);
+}
+
 int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
     if (!whisper_encode_internal(*ctx, *state, offset, n_threads)) {
         fprintf(stderr, "%s: failed to eval\n", __func__);
@@ -3011,30 +4345,12 @@ const char * whisper_lang_str(int id) {
     return nullptr;
 }
 
-int whisper_lang_auto_detect_with_state(
+// detect the language of the audio that was last encoded in the state
+static int whisper_lang_detect_encoded(
         struct whisper_context * ctx,
           struct whisper_state * state,
-                           int   offset_ms,
                            int   n_threads,
                          float * lang_probs) {
-    const int seek = offset_ms/10;
-
-    if (seek < 0) {
-        fprintf(stderr, "%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
-        return -1;
-    }
-
-    if (seek >= state->mel.n_len_org) {
-        fprintf(stderr, "%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len_org*10);
-        return -2;
-    }
-
-    // run the encoder
-    if (whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
-        fprintf(stderr, "%s: failed to encode\n", __func__);
-        return -6;
-    }
-
     const std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
 
     if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
@@ -3086,6 +4402,33 @@ int whisper_lang_auto_detect_with_state(
     return logits_id[0].second;
 }
 
+int whisper_lang_auto_detect_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * lang_probs) {
+    const int seek = offset_ms/10;
+
+    if (seek < 0) {
+        fprintf(stderr, "%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
+        return -1;
+    }
+
+    if (seek >= state->mel.n_len_org) {
+        fprintf(stderr, "%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len_org*10);
+        return -2;
+    }
+
+    // run the encoder
+    if (whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
+        fprintf(stderr, "%s: failed to encode\n", __func__);
+        return -6;
+    }
+
+    return whisper_lang_detect_encoded(ctx, state, n_threads, lang_probs);
+}
+
 int whisper_lang_auto_detect(
         struct whisper_context * ctx,
                            int   offset_ms,
@@ -3248,6 +4591,13 @@ void whisper_print_timings(struct whisper_context * ctx) {
         fprintf(stderr, "%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
         fprintf(stderr, "%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
         fprintf(stderr, "%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
+
+        if (ctx->state->draft_state != nullptr) {
+            const whisper_state * draft = ctx->state->draft_state;
+
+            fprintf(stderr, "%s:    draft time = %8.2f ms / %5d tokens accepted of %5d proposed\n", __func__,
+                    1e-3f * (draft->t_encode_us + draft->t_decode_us + draft->t_sample_us), ctx->state->n_draft_accepted, ctx->state->n_draft_proposed);
+        }
     }
     fprintf(stderr, "%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
 }
@@ -3257,6 +4607,15 @@ void whisper_reset_timings(struct whisper_context * ctx) {
         ctx->state->t_sample_us = 0;
         ctx->state->t_encode_us = 0;
         ctx->state->t_decode_us = 0;
+
+        ctx->state->n_draft_proposed = 0;
+        ctx->state->n_draft_accepted = 0;
+
+        if (ctx->state->draft_state != nullptr) {
+            ctx->state->draft_state->t_sample_us = 0;
+            ctx->state->draft_state->t_encode_us = 0;
+            ctx->state->draft_state->t_decode_us = 0;
+        }
     }
 }
 
@@ -3325,6 +4684,10 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
         /*.speed_up         =*/ false,
         /*.audio_ctx        =*/ 0,
+        /*.audio_ctx_auto   =*/ false,
+
+        /*.vad              =*/ false,
+        /*.vad_thold        =*/ 0.1f,
 
         /*.initial_prompt   =*/ nullptr,
         /*.prompt_tokens    =*/ nullptr,
@@ -3332,6 +4695,7 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
         /*.language         =*/ "en",
         /*.detect_language  =*/ false,
+        /*.detect_language_n_windows =*/ 1,
 
         /*.suppress_blank   =*/ true,
         /*.suppress_non_speech_tokens =*/ false,
@@ -3355,6 +4719,11 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
             /*.patience  =*/ -1.0f,
         },
 
+        /*.draft            =*/ {
+            /*.ctx     =*/ nullptr,
+            /*.n_draft =*/ 4,
+        },
+
         /*.new_segment_callback           =*/ nullptr,
         /*.new_segment_callback_user_data =*/ nullptr,
 
@@ -3372,13 +4741,13 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         case WHISPER_SAMPLING_GREEDY:
             {
                 result.greedy = {
-                    /*.best_of   =*/ 2, // TODO: increase to 5 when we speed-up batch decoding
+                    /*.best_of   =*/ 5,
                 };
             } break;
         case WHISPER_SAMPLING_BEAM_SEARCH:
             {
                 result.beam_search = {
-                    /*.beam_size =*/ 2, // TODO: increase to 5 when we speed-up batch decoding
+                    /*.beam_size =*/ 5,
 
                     /*.patience  =*/ -1.0f,
                 };
@@ -3483,22 +4852,205 @@ static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_sta
     return res;
 }
 
-static const std::vector<std::string> non_speech_tokens = {
-    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
-    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
-    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
-    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
-};
+// vectorized helpers for the logits processing
+// exp() uses the Cephes polynomial (~1 ulp for the inputs <= 0 used here), inputs below ln(FLT_MIN) map to 0
+
+#define WHISPER_EXP_LO -87.33654f
+
+#if defined(__ARM_NEON)
+static inline float32x4_t whisper_exp_f32x4(float32x4_t x) {
+    const uint32x4_t underflow = vcltq_f32(x, vdupq_n_f32(WHISPER_EXP_LO));
+
+    x = vminq_f32(x, vdupq_n_f32( 88.0f));
+    x = vmaxq_f32(x, vdupq_n_f32(WHISPER_EXP_LO));
+
+    // n = round(x/ln(2))
+    float32x4_t fx = vmlaq_f32(vdupq_n_f32(0.5f), x, vdupq_n_f32(1.44269504088896341f));
+    float32x4_t tx = vcvtq_f32_s32(vcvtq_s32_f32(fx));
+    fx = vsubq_f32(tx, vreinterpretq_f32_u32(vandq_u32(vcgtq_f32(tx, fx), vreinterpretq_u32_f32(vdupq_n_f32(1.0f)))));
+
+    x = vmlsq_f32(x, fx, vdupq_n_f32(0.693359375f));
+    x = vmlsq_f32(x, fx, vdupq_n_f32(-2.12194440e-4f));
+
+    const float32x4_t z = vmulq_f32(x, x);
+
+    float32x4_t y = vdupq_n_f32(1.9875691500e-4f);
+    y = vmlaq_f32(vdupq_n_f32(1.3981999507e-3f), y, x);
+    y = vmlaq_f32(vdupq_n_f32(8.3334519073e-3f), y, x);
+    y = vmlaq_f32(vdupq_n_f32(4.1665795894e-2f), y, x);
+    y = vmlaq_f32(vdupq_n_f32(1.6666665459e-1f), y, x);
+    y = vmlaq_f32(vdupq_n_f32(5.0000001201e-1f), y, x);
+    y = vmlaq_f32(vaddq_f32(x, vdupq_n_f32(1.0f)), y, z);
+
+    // 2^n
+    const int32x4_t pow2n = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(fx), vdupq_n_s32(127)), 23);
+
+    y = vmulq_f32(y, vreinterpretq_f32_s32(pow2n));
+
+    return vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(y), underflow));
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+static inline __m128 whisper_exp_f32x4(__m128 x) {
+    const __m128 underflow = _mm_cmplt_ps(x, _mm_set1_ps(WHISPER_EXP_LO));
+
+    x = _mm_min_ps(x, _mm_set1_ps( 88.0f));
+    x = _mm_max_ps(x, _mm_set1_ps(WHISPER_EXP_LO));
+
+    // n = round(x/ln(2))
+    __m128 fx = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)), _mm_set1_ps(0.5f));
+    __m128 tx = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+    fx = _mm_sub_ps(tx, _mm_and_ps(_mm_cmpgt_ps(tx, fx), _mm_set1_ps(1.0f)));
+
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(0.693359375f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(-2.12194440e-4f)));
+
+    const __m128 z = _mm_mul_ps(x, x);
+
+    __m128 y = _mm_set1_ps(1.9875691500e-4f);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507e-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073e-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894e-2f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, z), _mm_add_ps(x, _mm_set1_ps(1.0f)));
+
+    // 2^n
+    const __m128i pow2n = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(fx), _mm_set1_epi32(127)), 23);
+
+    y = _mm_mul_ps(y, _mm_castsi128_ps(pow2n));
+
+    return _mm_andnot_ps(underflow, y);
+}
+#endif
+
+// max of x[0..n), -INFINITY if n == 0
+static float whisper_vec_max_f32(const float * x, int n) {
+    float res = -INFINITY;
+
+    int i = 0;
+
+#if defined(__ARM_NEON)
+    if (n >= 4) {
+        float32x4_t vmax = vld1q_f32(x);
+        for (i = 4; i + 4 <= n; i += 4) {
+            vmax = vmaxq_f32(vmax, vld1q_f32(x + i));
+        }
+
+        const float32x2_t m = vpmax_f32(vget_low_f32(vmax), vget_high_f32(vmax));
+
+        res = vget_lane_f32(vpmax_f32(m, m), 0);
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    if (n >= 4) {
+        __m128 vmax = _mm_loadu_ps(x);
+        for (i = 4; i + 4 <= n; i += 4) {
+            vmax = _mm_max_ps(vmax, _mm_loadu_ps(x + i));
+        }
+
+        vmax = _mm_max_ps(vmax, _mm_movehl_ps(vmax, vmax));
+        vmax = _mm_max_ss(vmax, _mm_shuffle_ps(vmax, vmax, 1));
+
+        res = _mm_cvtss_f32(vmax);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        res = std::max(res, x[i]);
+    }
+
+    return res;
+}
+
+// sum of exp(x[i] - c) over [0..n)
+static float whisper_vec_sum_exp_f32(const float * x, float c, int n) {
+    float sum = 0.0f;
+
+    int i = 0;
+
+#if defined(__ARM_NEON)
+    {
+        const float32x4_t vc = vdupq_n_f32(c);
+
+        float32x4_t vsum = vdupq_n_f32(0.0f);
+        for (; i + 4 <= n; i += 4) {
+            vsum = vaddq_f32(vsum, whisper_exp_f32x4(vsubq_f32(vld1q_f32(x + i), vc)));
+        }
+
+        const float32x2_t s = vadd_f32(vget_low_f32(vsum), vget_high_f32(vsum));
+
+        sum = vget_lane_f32(vpadd_f32(s, s), 0);
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    {
+        const __m128 vc = _mm_set1_ps(c);
+
+        __m128 vsum = _mm_setzero_ps();
+        for (; i + 4 <= n; i += 4) {
+            vsum = _mm_add_ps(vsum, whisper_exp_f32x4(_mm_sub_ps(_mm_loadu_ps(x + i), vc)));
+        }
+
+        vsum = _mm_add_ps(vsum, _mm_movehl_ps(vsum, vsum));
+        vsum = _mm_add_ss(vsum, _mm_shuffle_ps(vsum, vsum, 1));
+
+        sum = _mm_cvtss_f32(vsum);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        sum += expf(x[i] - c);
+    }
+
+    return sum;
+}
+
+// logprobs[i] = x[i] - lse, probs[i] = exp(logprobs[i])
+// -INFINITY logits give -INFINITY logprobs and 0 probs, also when all of them are -INFINITY (lse = -INFINITY)
+static void whisper_vec_log_softmax_f32(const float * x, float lse, float * logprobs, float * probs, int n) {
+    if (lse == -INFINITY) {
+        std::fill(logprobs, logprobs + n, -INFINITY);
+        std::fill(probs,    probs    + n, 0.0f);
+        return;
+    }
+
+    int i = 0;
+
+#if defined(__ARM_NEON)
+    {
+        const float32x4_t vlse = vdupq_n_f32(lse);
+        for (; i + 4 <= n; i += 4) {
+            const float32x4_t lp = vsubq_f32(vld1q_f32(x + i), vlse);
+            vst1q_f32(logprobs + i, lp);
+            vst1q_f32(probs    + i, whisper_exp_f32x4(lp));
+        }
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    {
+        const __m128 vlse = _mm_set1_ps(lse);
+        for (; i + 4 <= n; i += 4) {
+            const __m128 lp = _mm_sub_ps(_mm_loadu_ps(x + i), vlse);
+            _mm_storeu_ps(logprobs + i, lp);
+            _mm_storeu_ps(probs    + i, whisper_exp_f32x4(lp));
+        }
+    }
+#endif
+
+    for (; i < n; ++i) {
+        logprobs[i] = x[i] - lse;
+        probs[i]    = expf(logprobs[i]);
+    }
+}
 
 // process the logits for the selected decoder
 // - applies logit filters
 // - computes logprobs and probs
+// i_batch is the index of the decoder's sequence in the last whisper_decode_internal batch
 static void whisper_process_logits(
               struct whisper_context & ctx,
                struct whisper_state  & state,
     const struct whisper_full_params   params,
               struct whisper_decoder & decoder,
-                               float   temperature) {
+                               float   temperature,
+                                 int   i_batch) {
     const auto & vocab      = ctx.vocab;
     const auto & tokens_cur = decoder.sequence.tokens;
 
@@ -3514,12 +5066,15 @@ static void whisper_process_logits(
     auto & logprobs = decoder.logprobs;
     {
         logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + (state.logits.size() - n_logits), n_logits*sizeof(float));
+
+        const float * logits_src = state.logits.data() + i_batch*n_logits;
 
         if (temperature > 0.0f) {
             for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
+                logits[i] = logits_src[i]/temperature;
             }
+        } else {
+            memcpy(logits.data(), logits_src, n_logits*sizeof(float));
         }
 
         // will be populated a bit later
@@ -3558,21 +5113,8 @@ static void whisper_process_logits(
         // suppress non-speech tokens
         // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
         if (params.suppress_non_speech_tokens) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
-
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
+            for (const whisper_token id : vocab.non_speech_ids) {
+                logits[id] = -INFINITY;
             }
         }
 
@@ -3618,66 +5160,44 @@ static void whisper_process_logits(
             }
         }
 
-        // populate the logprobs array (log_softmax)
-        {
-            const float logit_max = *std::max_element(logits.begin(), logits.end());
-            float logsumexp = 0.0f;
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logsumexp += expf(logits[i] - logit_max);
-                }
-            }
-            logsumexp = logf(logsumexp) + logit_max;
+        // log_softmax + timestamp rule in three sweeps over the vocabulary:
+        //   - max over the text tokens and over the timestamp tokens
+        //   - sum of exp over the text tokens and over the timestamp tokens
+        //   - logprobs and probs
+        // the logprobs of the timestamp tokens and of the text tokens differ only by the common logsumexp,
+        // so the timestamp rule can be decided from the first two sweeps
+        const int n_text = vocab.token_beg;
+        const int n_ts   = n_logits - vocab.token_beg;
 
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logprobs[i] = logits[i] - logsumexp;
-                } else {
-                    logprobs[i] = -INFINITY;
-                }
-            }
-        }
+        const float max_text = whisper_vec_max_f32(logits.data(),          n_text);
+        const float max_ts   = whisper_vec_max_f32(logits.data() + n_text, n_ts);
+
+        const float logit_max = std::max(max_text, max_ts);
+
+        // all tokens can be suppressed (e.g. by the logits filter callback), exp(x - logit_max) would be NaN
+        const float sum_text = logit_max == -INFINITY ? 0.0f : whisper_vec_sum_exp_f32(logits.data(),          logit_max, n_text);
+        const float sum_ts   = logit_max == -INFINITY ? 0.0f : whisper_vec_sum_exp_f32(logits.data() + n_text, logit_max, n_ts);
+
+        const float logsumexp = logit_max == -INFINITY ? -INFINITY : logf(sum_text + sum_ts) + logit_max;
 
         // if sum of probability over timestamps is above any other token, sample timestamp
         // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
-        {
+        if (logit_max != -INFINITY) {
             // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
-
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+            const float timestamp_logprob      = sum_ts > 0.0f ? logf(sum_ts) + logit_max - logsumexp : -INFINITY;
+            const float max_text_token_logprob = max_text - logsumexp;
 
             //fprintf(stderr, "timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
 
             if (timestamp_logprob > max_text_token_logprob) {
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
+                for (int i = 0; i < n_text; ++i) {
+                    logits[i] = -INFINITY;
                 }
             }
         }
-    }
 
-    // compute probs
-    {
-        for (int i = 0; i < n_logits; ++i) {
-            if (logits[i] == -INFINITY) {
-                probs[i] = 0.0f;
-            } else {
-                probs[i] = expf(logprobs[i]);
-            }
-        }
+        // populate the logprobs and probs arrays
+        whisper_vec_log_softmax_f32(logits.data(), logsumexp, logprobs.data(), probs.data(), n_logits);
     }
 
 #if 0
@@ -3893,6 +5413,217 @@ static void whisper_sequence_score(
     }
 }
 
+// automatic audio context: the encoder context is sized to the audio left in the window plus a margin of
+// trailing silence and rounded up to a bucket, so that the decode graphs can be reused across windows
+#define WHISPER_AUDIO_CTX_MARGIN 50
+#define WHISPER_AUDIO_CTX_BUCKET 64
+
+// number of encoder frames for n_frames mel frames of audio (0 - use the full audio context)
+static int whisper_audio_ctx_auto(const whisper_context & ctx, int n_frames) {
+#ifdef WHISPER_USE_COREML
+    // the Core ML encoder has a fixed input size
+    (void) ctx;
+    (void) n_frames;
+    return 0;
+#else
+    const int n_audio_ctx = ctx.model.hparams.n_audio_ctx;
+
+    int n_ctx = (n_frames + 1)/2 + WHISPER_AUDIO_CTX_MARGIN;
+    n_ctx = WHISPER_AUDIO_CTX_BUCKET*((n_ctx + WHISPER_AUDIO_CTX_BUCKET - 1)/WHISPER_AUDIO_CTX_BUCKET);
+
+    return n_ctx < n_audio_ctx ? n_ctx : 0;
+#endif
+}
+
+// voice activity detection on the mel spectrogram
+#define WHISPER_VAD_SMOOTH    10    // frames (100 ms) over which the energy of a frame is averaged
+#define WHISPER_VAD_PAD       20    // frames (200 ms) of silence kept before the speech
+#define WHISPER_VAD_MIN_RANGE 0.25f // minimum energy range (~10 dB) for the audio to contain any silence
+
+// for each frame of the mel spectrogram, the first frame of speech at or after it (n_len_org if there is none)
+// the energy of a frame is the mean of its log mel bins and a frame is speech if its smoothed energy is above
+// floor + thold*(peak - floor), where floor and peak are the 10th and the 99th percentile of the energies
+static void whisper_vad_mel(const whisper_mel & mel, float thold, std::vector<int> & next_speech) {
+    const int n_len = mel.n_len_org;
+
+    next_speech.resize(n_len + 1);
+    next_speech[n_len] = n_len;
+
+    if (n_len == 0) {
+        return;
+    }
+
+    std::vector<double> energy(n_len + 1, 0.0);
+    for (int j = 0; j < mel.n_mel; ++j) {
+        const float * row = mel.data.data() + j*mel.n_len;
+        for (int i = 0; i < n_len; ++i) {
+            energy[i + 1] += row[i];
+        }
+    }
+
+    // prefix sums -> centered moving average
+    for (int i = 0; i < n_len; ++i) {
+        energy[i + 1] += energy[i];
+    }
+
+    std::vector<float> smooth(n_len);
+    for (int i = 0; i < n_len; ++i) {
+        const int i0 = std::max(0,     i - WHISPER_VAD_SMOOTH/2);
+        const int i1 = std::min(n_len, i + WHISPER_VAD_SMOOTH/2 + 1);
+
+        smooth[i] = (energy[i1] - energy[i0])/((i1 - i0)*mel.n_mel);
+    }
+
+    std::vector<float> sorted = smooth;
+
+    const int k_floor = (10*(n_len - 1))/100;
+    const int k_peak  = (99*(n_len - 1))/100;
+
+    std::nth_element(sorted.begin(), sorted.begin() + k_floor, sorted.end());
+    const float e_floor = sorted[k_floor];
+
+    std::nth_element(sorted.begin(), sorted.begin() + k_peak, sorted.end());
+    const float e_peak = sorted[k_peak];
+
+    const float e_thold = e_peak - e_floor < WHISPER_VAD_MIN_RANGE ? -INFINITY : e_floor + thold*(e_peak - e_floor);
+
+    for (int i = n_len - 1; i >= 0; --i) {
+        next_speech[i] = smooth[i] > e_thold ? i : next_speech[i + 1];
+    }
+}
+
+// skip the silence at seek: the frame before the next speech, or seek_end if there is no speech left
+static int whisper_vad_seek(const std::vector<int> & next_speech, int seek, int seek_end) {
+    if (next_speech.empty() || seek >= seek_end) {
+        return seek;
+    }
+
+    const int n_len = (int) next_speech.size() - 1;
+    const int next  = seek < n_len ? next_speech[seek] : n_len;
+
+    return next < n_len ? std::max(seek, next - WHISPER_VAD_PAD) : seek_end;
+}
+
+// prepare the state of the draft model for speculative decoding of the current mel spectrogram
+// returns false if the draft model cannot be used with the model of ctx
+static bool whisper_draft_init(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+        struct whisper_context * draft_ctx) {
+    if (draft_ctx->vocab.n_vocab != ctx->vocab.n_vocab || draft_ctx->model.hparams.n_mels != ctx->model.hparams.n_mels) {
+        fprintf(stderr, "%s: the draft model does not match the model (n_vocab = %d, %d) - speculative decoding disabled\n",
+                __func__, draft_ctx->vocab.n_vocab, ctx->vocab.n_vocab);
+        return false;
+    }
+
+    if (state->draft_ctx != draft_ctx) {
+        whisper_free_state(state->draft_state);
+
+        state->draft_ctx   = nullptr;
+        state->draft_state = whisper_init_state(draft_ctx);
+
+        if (state->draft_state == nullptr) {
+            fprintf(stderr, "%s: failed to initialize the state of the draft model - speculative decoding disabled\n", __func__);
+            return false;
+        }
+
+        state->draft_ctx = draft_ctx;
+    }
+
+    state->draft_state->mel             = state->mel;
+    state->draft_state->exp_n_audio_ctx = state->exp_n_audio_ctx;
+
+    state->draft_past.clear();
+
+    return true;
+}
+
+// propose up to n_draft tokens that follow the prompt and the tokens of the decoder, using the draft model
+// the KV cache of the draft decoder is kept between calls, only the tokens after the common prefix are evaluated
+static bool whisper_draft_propose(
+                     struct whisper_state & state,
+               struct whisper_full_params   params,
+                  const whisper_decoder & decoder,
+       const std::vector<whisper_token> & prompt,
+                                    int   n_draft,
+             std::vector<whisper_token> & tokens) {
+    whisper_context & dctx     = *state.draft_ctx;
+    whisper_state   & dstate   = *state.draft_state;
+    whisper_decoder & ddecoder = dstate.decoders[0];
+
+    // the logits of the draft model are only used to propose tokens, the main model applies the filter
+    params.logits_filter_callback = nullptr;
+
+    auto & past = state.draft_past;
+
+    auto & cur = ddecoder.tokens_tmp;
+
+    cur = prompt;
+    for (const auto & token : decoder.sequence.tokens) {
+        cur.push_back(token.id);
+    }
+
+    size_t n_common = 0;
+    while (n_common < past.size() && n_common < cur.size() && past[n_common] == cur[n_common]) {
+        ++n_common;
+    }
+
+    // the last token is evaluated in any case to obtain the logits
+    n_common = std::min(n_common, cur.size() - 1);
+
+    if (!whisper_decode_internal(dctx, dstate, ddecoder, cur.data() + n_common, cur.size() - n_common, n_common, params.n_threads)) {
+        return false;
+    }
+
+    past = cur;
+
+    ddecoder.sequence.tokens = decoder.sequence.tokens;
+    ddecoder.seek_delta      = decoder.seek_delta;
+    ddecoder.has_ts          = decoder.has_ts;
+
+    tokens.clear();
+
+    while (true) {
+        const int64_t t_start_sample_us = ggml_time_us();
+
+        whisper_process_logits(dctx, dstate, params, ddecoder, 0.0f, 0);
+
+        const whisper_token_data token = whisper_sample_token(dctx, dstate, ddecoder, true);
+
+        dstate.t_sample_us += ggml_time_us() - t_start_sample_us;
+
+        tokens.push_back(token.id);
+
+        if (token.id == whisper_token_eot(&dctx) || (int) tokens.size() >= n_draft) {
+            break;
+        }
+
+        ddecoder.sequence.tokens.push_back(token);
+
+        if (token.id > whisper_token_beg(&dctx)) {
+            ddecoder.seek_delta = 2*(token.id - whisper_token_beg(&dctx));
+            ddecoder.has_ts     = true;
+        }
+
+        if (!whisper_decode_internal(dctx, dstate, ddecoder, &token.id, 1, past.size(), params.n_threads)) {
+            return false;
+        }
+
+        past.push_back(token.id);
+    }
+
+    return true;
+}
+
+// runs the encoder and decoder on the log mel spectrogram stored in the state
+// samples are only used for the token-level timestamps and can be NULL
+static int whisper_full_impl(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples);
+
 int whisper_full_with_state(
         struct whisper_context * ctx,
           struct whisper_state * state,
@@ -3900,9 +5631,12 @@ int whisper_full_with_state(
                    const float * samples,
                            int   n_samples) {
     // clear old results
-    auto & result_all = state->result_all;
+    state->result_all.clear();
 
-    result_all.clear();
+    if (samples == nullptr || n_samples <= 0) {
+        fprintf(stderr, "%s: no audio samples\n", __func__);
+        return -1;
+    }
 
     // compute log mel spectrogram
     if (params.speed_up) {
@@ -3917,15 +5651,106 @@ int whisper_full_with_state(
         }
     }
 
-    // auto-detect language if not specified
+    return whisper_full_impl(ctx, state, params, samples, n_samples);
+}
+
+int whisper_full_from_mel_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params) {
+    // clear old results
+    state->result_all.clear();
+
+    if (params.speed_up) {
+        fprintf(stderr, "%s: speed_up requires the audio samples\n", __func__);
+        return -1;
+    }
+    if (state->mel.n_len == 0) {
+        fprintf(stderr, "%s: no log mel spectrogram in the state\n", __func__);
+        return -2;
+    }
+
+    return whisper_full_impl(ctx, state, params, nullptr, 0);
+}
+
+static int whisper_full_impl(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    auto & result_all = state->result_all;
+
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        fprintf(stderr, "%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    state->exp_n_audio_ctx = params.audio_ctx;
+
+    const int seek_start = params.offset_ms/10;
+    const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
+
+    // the first frame of speech at or after each frame
+    std::vector<int> vad_next;
+    if (params.vad) {
+        whisper_vad_mel(state->mel, params.vad_thold, vad_next);
+    }
+
+    // encode the window at offset seek
+    auto encode_window = [&](int seek) {
+        // size the audio context to the audio left in the window
+        if (params.audio_ctx == 0 && params.audio_ctx_auto) {
+            state->exp_n_audio_ctx = whisper_audio_ctx_auto(*ctx, seek_end - seek);
+        }
+
+        return whisper_encode_internal(*ctx, *state, seek, params.n_threads);
+    };
+
+    // the window whose encoder output is in the state (-1 if none)
+    int seek_encoded = -1;
+
+    // auto-detect language if not specified
     if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
         std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
 
-        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
+        // detect on the first window that will be transcribed, so that its encoder output is reused by the decoding
+        const int seek_detect = std::max(0, std::min(whisper_vad_seek(vad_next, seek_start, seek_end), state->mel.n_len_org - 1));
+
+        int n_windows = 1;
+        while (n_windows < params.detect_language_n_windows && seek_detect + n_windows*100*WHISPER_CHUNK_SIZE < std::min(seek_end, state->mel.n_len_org) - 100) {
+            n_windows++;
+        }
+
+        // the probabilities are averaged over the windows, the first one is encoded last
+        int lang_id = -1;
+        for (int i = n_windows - 1; i >= 0; --i) {
+            std::vector<float> probs_cur(probs.size(), 0.0f);
+
+            if (!encode_window(seek_detect + i*100*WHISPER_CHUNK_SIZE)) {
+                fprintf(stderr, "%s: failed to encode\n", __func__);
+                return -6;
+            }
+
+            lang_id = whisper_lang_detect_encoded(ctx, state, params.n_threads, probs_cur.data());
+            if (lang_id < 0) {
+                break;
+            }
+
+            for (size_t j = 0; j < probs.size(); ++j) {
+                probs[j] += probs_cur[j]/n_windows;
+            }
+        }
+
         if (lang_id < 0) {
             fprintf(stderr, "%s: failed to auto-detect language\n", __func__);
             return -3;
         }
+
+        seek_encoded = seek_detect;
+
+        lang_id = std::max_element(probs.begin(), probs.end()) - probs.begin();
+
         state->lang_id = lang_id;
         params.language = whisper_lang_str(lang_id);
 
@@ -3942,9 +5767,6 @@ int whisper_full_with_state(
         state->energy = get_signal_energy(samples, n_samples, 32);
     }
 
-    const int seek_start = params.offset_ms/10;
-    const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
-
     // if length of spectrogram is less than 1s (100 samples), then return
     // basically don't process anything that is less than 1s
     // see issue #39: https://github.com/ggerganov/whisper.cpp/issues/39
@@ -4028,12 +5850,21 @@ int whisper_full_with_state(
         }
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        fprintf(stderr, "%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
+    // speculative decoding with the draft model
+    whisper_context * draft_ctx = nullptr;
+    if (params.draft.ctx != nullptr && params.draft.n_draft > 0 && params.strategy == WHISPER_SAMPLING_GREEDY) {
+        if (whisper_draft_init(ctx, state, params.draft.ctx)) {
+            draft_ctx = params.draft.ctx;
+        }
     }
-    state->exp_n_audio_ctx = params.audio_ctx;
+
+    int draft_seek = -1; // the window encoded by the draft model
+
+    std::vector<whisper_token> draft_tokens;
+
+    // the tokens of the last decoder pass with the draft tokens and the row of the logits for the next one
+    std::vector<whisper_token> spec_tokens;
+    int                        spec_row = 0;
 
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx) };
@@ -4056,13 +5887,14 @@ int whisper_full_with_state(
     std::vector<whisper_token> prompt;
     prompt.reserve(whisper_n_text_ctx(ctx));
 
-    // beam-search helpers
-    struct kv_buf {
-        std::vector<uint8_t> k;
-        std::vector<uint8_t> v;
-    };
+    // the sequences evaluated by the batched decoder pass
+    std::vector<whisper_decode_seq> decode_seqs;
+    decode_seqs.reserve(WHISPER_MAX_DECODERS);
 
-    std::vector<kv_buf> kv_bufs;
+    // beam-search helpers
+    whisper_kv_cache kv_caches[WHISPER_MAX_DECODERS] = {}; // the caches of the decoders before the beam-search update
+    int              kv_owner [WHISPER_MAX_DECODERS];      // the decoder that took over the cache of decoder j (-1 if none)
+    int              kv_src   [WHISPER_MAX_DECODERS];      // the decoder that produced the candidate selected by decoder j
 
     struct beam_candidate {
         int decoder_idx;
@@ -4077,6 +5909,15 @@ int whisper_full_with_state(
 
     // main loop
     while (true) {
+        // skip the silence before the next speech
+        {
+            const int seek_speech = whisper_vad_seek(vad_next, seek, seek_end);
+            if (seek_speech > seek) {
+                WHISPER_PRINT_DEBUG("%s: skipping silence %d - %d\n", __func__, seek, seek_speech);
+                seek = seek_speech;
+            }
+        }
+
         const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
         while (progress_cur >= progress_prev + progress_step) {
             progress_prev += progress_step;
@@ -4086,7 +5927,7 @@ int whisper_full_with_state(
         }
         if (params.progress_callback) {
             params.progress_callback(
-                ctx, ctx->state, progress_prev, params.progress_callback_user_data);
+                ctx, state, progress_prev, params.progress_callback_user_data);
         }
 
         // of only 1 second left, then stop
@@ -4101,12 +5942,14 @@ int whisper_full_with_state(
             }
         }
 
-        // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads)) {
+        // encode audio features starting at offset seek, unless the language detection already did
+        if (seek != seek_encoded && !encode_window(seek)) {
             fprintf(stderr, "%s: failed to encode\n", __func__);
             return -6;
         }
 
+        seek_encoded = -1;
+
         // if there is a very short audio segment left to process, we remove any past prompt since it tends
         // to confuse the decoder and often make it repeat or hallucinate stuff
         if (seek > seek_start && seek + 500 >= seek_end) {
@@ -4162,6 +6005,24 @@ int whisper_full_with_state(
                 decoder.has_ts    = false;
             }
 
+            // the draft model is used only when the sampling is deterministic
+            const bool use_draft = draft_ctx != nullptr && n_decoders_cur == 1 && t_cur < 1e-6f;
+
+            spec_tokens.clear();
+            spec_row = 0;
+
+            if (use_draft && draft_seek != seek) {
+                state->draft_state->exp_n_audio_ctx = state->exp_n_audio_ctx;
+
+                if (!whisper_encode_internal(*draft_ctx, *state->draft_state, seek, params.n_threads)) {
+                    fprintf(stderr, "%s: failed to encode with the draft model\n", __func__);
+                    return -6;
+                }
+
+                draft_seek = seek;
+                state->draft_past.clear();
+            }
+
             // init prompt and kv cache for the current iteration
             // run whisper_decoder() only for decoder 0 and copy the results for the other decoders
             {
@@ -4193,17 +6054,14 @@ int whisper_full_with_state(
                 {
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    whisper_process_logits(*ctx, *state, params, state->decoders[0], t_cur);
+                    whisper_process_logits(*ctx, *state, params, state->decoders[0], t_cur, 0);
 
                     state->decoders[0].kv_self.n += prompt.size();
 
                     for (int j = 1; j < n_decoders_cur; ++j) {
                         auto & decoder = state->decoders[j];
 
-                        memcpy(decoder.kv_self.k->data, state->decoders[0].kv_self.k->data, ggml_nbytes(decoder.kv_self.k));
-                        memcpy(decoder.kv_self.v->data, state->decoders[0].kv_self.v->data, ggml_nbytes(decoder.kv_self.v));
-
-                        decoder.kv_self.n += prompt.size();
+                        kv_cache_copy(ctx->model.hparams, decoder.kv_self, state->decoders[0].kv_self, state->decoders[0].kv_self.n);
 
                         memcpy(decoder.probs.data(), state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
                         memcpy(decoder.logits.data(), state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
@@ -4217,23 +6075,7 @@ int whisper_full_with_state(
             for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
                 const int64_t t_start_sample_us = ggml_time_us();
 
-                // store the KV caches of all decoders when doing beam-search
                 if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    kv_bufs.resize(n_decoders_cur);
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
-
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
-
-                        kv_bufs[j].k.resize(ggml_nbytes(decoder.kv_self.k));
-                        kv_bufs[j].v.resize(ggml_nbytes(decoder.kv_self.v));
-
-                        memcpy(kv_bufs[j].k.data(), decoder.kv_self.k->data, kv_bufs[j].k.size());
-                        memcpy(kv_bufs[j].v.data(), decoder.kv_self.v->data, kv_bufs[j].v.size());
-                    }
-
                     beam_candidates.clear();
                 }
 
@@ -4272,6 +6114,10 @@ int whisper_full_with_state(
                 }
 
                 // for beam-search, choose the top candidates and update the KV caches
+                //
+                // instead of copying the caches around, each decoder takes over the cache of the decoder that
+                // produced its candidate. only when several candidates come from the same decoder, the rest of
+                // them get one of the caches that are no longer used and copy the tokens decoded so far into it
                 if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
                     std::sort(
                             beam_candidates.begin(),
@@ -4280,6 +6126,18 @@ int whisper_full_with_state(
                         return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
                     });
 
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        kv_owner[j] = -1;
+
+                        if (decoder.completed || decoder.failed) {
+                            continue;
+                        }
+
+                        std::swap(kv_caches[j], decoder.kv_self);
+                    }
+
                     uint32_t cur_c = 0;
 
                     for (int j = 0; j < n_decoders_cur; ++j) {
@@ -4289,6 +6147,11 @@ int whisper_full_with_state(
                             continue;
                         }
 
+                        // all remaining candidates have been skipped as duplicates - start over
+                        if (cur_c >= beam_candidates.size()) {
+                            cur_c = 0;
+                        }
+
                         auto & cur = beam_candidates[cur_c++];
 
                         while (beam_candidates.size() > cur_c && beam_candidates[cur_c].sequence.sum_logprobs_all == cur.sequence.sum_logprobs_all && i > 0) {
@@ -4299,12 +6162,34 @@ int whisper_full_with_state(
                         decoder.seek_delta = cur.seek_delta;
                         decoder.has_ts     = cur.has_ts;
 
-                        memcpy(decoder.kv_self.k->data, kv_bufs[cur.decoder_idx].k.data(), kv_bufs[cur.decoder_idx].k.size());
-                        memcpy(decoder.kv_self.v->data, kv_bufs[cur.decoder_idx].v.data(), kv_bufs[cur.decoder_idx].v.size());
+                        kv_src[j] = cur.decoder_idx;
+
+                        if (kv_owner[cur.decoder_idx] == -1) {
+                            kv_owner[cur.decoder_idx] = j;
+                            std::swap(decoder.kv_self, kv_caches[cur.decoder_idx]);
+                        }
 
                         WHISPER_PRINT_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
                                 __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
                     }
+
+                    for (int j = 0, k = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        if (decoder.completed || decoder.failed || decoder.kv_self.ctx) {
+                            continue;
+                        }
+
+                        while (!kv_caches[k].ctx) {
+                            ++k;
+                        }
+
+                        std::swap(decoder.kv_self, kv_caches[k]);
+
+                        const auto & kv_src_self = state->decoders[kv_owner[kv_src[j]]].kv_self;
+
+                        kv_cache_copy(ctx->model.hparams, decoder.kv_self, kv_src_self, kv_src_self.n);
+                    }
                 }
 
                 // update the decoder state
@@ -4410,33 +6295,91 @@ int whisper_full_with_state(
 
                 state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
-                // obtain logits for the next token
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+                // speculative decoding: the tokens proposed by the draft model are evaluated together with the
+                // sampled token. the next sampled tokens use the logits of that pass for as long as they match
+                // the proposed tokens, i.e. they are the same as the ones a separate pass would give
+                if (use_draft) {
+                    auto & decoder = state->decoders[0];
 
-                    if (decoder.failed || decoder.completed) {
-                        continue;
+                    const whisper_token id = decoder.sequence.tokens.back().id;
+
+                    if (spec_row == 0 || spec_row >= (int) spec_tokens.size() || spec_tokens[spec_row] != id) {
+                        const int n_draft = std::min(std::min(params.draft.n_draft, WHISPER_MAX_DRAFT),
+                                std::min(whisper_n_text_ctx(ctx), whisper_n_text_ctx(draft_ctx)) - decoder.kv_self.n - 1);
+
+                        spec_tokens = { id };
+
+                        if (n_draft > 0) {
+                            if (!whisper_draft_propose(*state, params, decoder, prompt, n_draft, draft_tokens)) {
+                                fprintf(stderr, "%s: failed to decode with the draft model\n", __func__);
+                                return -8;
+                            }
+
+                            spec_tokens.insert(spec_tokens.end(), draft_tokens.begin(), draft_tokens.end());
+
+                            state->n_draft_proposed += draft_tokens.size();
+                        }
+
+                        decode_seqs.clear();
+                        decode_seqs.push_back({ &decoder, spec_tokens.data(), (int) spec_tokens.size(), decoder.kv_self.n, true });
+
+                        if (!whisper_decode_internal(*ctx, *state, decode_seqs, params.n_threads)) {
+                            fprintf(stderr, "%s: failed to decode\n", __func__);
+                            return -8;
+                        }
+
+                        spec_row = 0;
+                    } else {
+                        state->n_draft_accepted++;
                     }
 
-                    decoder.tokens_tmp.resize(1);
-                    decoder.tokens_tmp[0] = decoder.sequence.tokens.back().id;
+                    const int64_t t_start_sample_us = ggml_time_us();
+
+                    whisper_process_logits(*ctx, *state, params, decoder, t_cur, spec_row++);
+
+                    ++decoder.kv_self.n;
+
+                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
+
+                    continue;
+                }
+
+                // obtain logits for the next token
+                // the active decoders are evaluated together in a single batch
+                {
+                    decode_seqs.clear();
+
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        if (decoder.failed || decoder.completed) {
+                            continue;
+                        }
+
+                        decoder.tokens_tmp.resize(1);
+                        decoder.tokens_tmp[0] = decoder.sequence.tokens.back().id;
 
-                    //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.tokens_tmp[0], decoder.kv_self.n, decoder.seek_delta);
+                        //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.tokens_tmp[0], decoder.kv_self.n, decoder.seek_delta);
 
-                    if (!whisper_decode_internal(*ctx, *state, decoder, decoder.tokens_tmp.data(), decoder.tokens_tmp.size(), decoder.kv_self.n, params.n_threads)) {
+                        decode_seqs.push_back({ &decoder, decoder.tokens_tmp.data(), (int) decoder.tokens_tmp.size(), decoder.kv_self.n, false });
+                    }
+
+                    if (!whisper_decode_internal(*ctx, *state, decode_seqs, params.n_threads)) {
                         fprintf(stderr, "%s: failed to decode\n", __func__);
                         return -8;
                     }
 
-                    {
-                        const int64_t t_start_sample_us = ggml_time_us();
+                    const int64_t t_start_sample_us = ggml_time_us();
 
-                        whisper_process_logits(*ctx, *state, params, decoder, t_cur);
+                    for (int k = 0; k < (int) decode_seqs.size(); ++k) {
+                        auto & decoder = *decode_seqs[k].decoder;
 
-                        ++decoder.kv_self.n;
+                        whisper_process_logits(*ctx, *state, params, decoder, t_cur, k);
 
-                        state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                        ++decoder.kv_self.n;
                     }
+
+                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
                 }
             }
 
@@ -4559,10 +6502,8 @@ int whisper_full_with_state(
 
                             //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].id, tokens_cur[i].tid);
 
-                            result_all.push_back({ tt0, tt1, text, {} });
-                            for (int j = i0; j <= i; j++) {
-                                result_all.back().tokens.push_back(tokens_cur[j]);
-                            }
+                            result_all.push_back({ tt0, tt1, std::move(text), {} });
+                            result_all.back().tokens.assign(tokens_cur.begin() + i0, tokens_cur.begin() + i + 1);
 
                             int n_new = 1;
 
@@ -4603,10 +6544,8 @@ int whisper_full_with_state(
                         }
                     }
 
-                    result_all.push_back({ tt0, tt1, text, {} });
-                    for (int j = i0; j < (int) tokens_cur.size(); j++) {
-                        result_all.back().tokens.push_back(tokens_cur[j]);
-                    }
+                    result_all.push_back({ tt0, tt1, std::move(text), {} });
+                    result_all.back().tokens.assign(tokens_cur.begin() + i0, tokens_cur.end());
 
                     int n_new = 1;
 
@@ -4643,6 +6582,55 @@ int whisper_full(
     return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
 }
 
+int whisper_full_from_mel(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params) {
+    return whisper_full_from_mel_with_state(ctx, ctx->state, params);
+}
+
+// split points of whisper_full_parallel() are searched for within this distance of the even split
+#define WHISPER_PARALLEL_SEARCH_MS  3000
+// audio decoded on each side of a split point by both chunks
+#define WHISPER_PARALLEL_OVERLAP_MS 1000
+
+// find the sample with the lowest short-time energy in [i0, i1) - the most likely silence
+static int whisper_find_quiet_point(const float * samples, int i0, int i1) {
+    const int n_frame  = WHISPER_HOP_LENGTH; // 10 ms
+    const int n_smooth = 20;                 // 200 ms
+
+    const int n_frames = (i1 - i0)/n_frame;
+    if (n_frames <= n_smooth) {
+        return (i0 + i1)/2;
+    }
+
+    std::vector<double> energy(n_frames, 0.0);
+    for (int j = 0; j < n_frames; ++j) {
+        const float * x = samples + i0 + j*n_frame;
+        for (int k = 0; k < n_frame; ++k) {
+            energy[j] += x[k]*x[k];
+        }
+    }
+
+    // moving sum over n_smooth frames
+    double sum = 0.0;
+    for (int j = 0; j < n_smooth; ++j) {
+        sum += energy[j];
+    }
+
+    double sum_min = sum;
+    int    j_min   = 0;
+
+    for (int j = n_smooth; j < n_frames; ++j) {
+        sum += energy[j] - energy[j - n_smooth];
+        if (sum < sum_min) {
+            sum_min = sum;
+            j_min   = j - n_smooth + 1;
+        }
+    }
+
+    return i0 + (j_min + n_smooth/2)*n_frame;
+}
+
 int whisper_full_parallel(
         struct whisper_context * ctx,
         struct whisper_full_params params,
@@ -4654,70 +6642,144 @@ int whisper_full_parallel(
     }
     int ret = 0;
 
-    // prepare separate states for each thread
-    std::vector<whisper_state*> states;
+    const int offset_samples = std::min(n_samples, (int) ((int64_t) WHISPER_SAMPLE_RATE*params.offset_ms/1000));
+    const int end_samples    = params.duration_ms > 0 ? std::min(n_samples, offset_samples + (int) ((int64_t) WHISPER_SAMPLE_RATE*params.duration_ms/1000)) : n_samples;
 
-    const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
-    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+    const int n_samples_per_processor = (end_samples - offset_samples)/n_processors;
 
-    // the calling thread will process the first chunk
-    // while the other threads will process the remaining chunks
+    const int n_search  = std::min(WHISPER_SAMPLE_RATE*WHISPER_PARALLEL_SEARCH_MS/1000, n_samples_per_processor/4);
+    const int n_overlap = WHISPER_SAMPLE_RATE*WHISPER_PARALLEL_OVERLAP_MS/1000;
 
-    std::vector<std::thread> workers(n_processors - 1);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
+    // split the audio at the quietest point near each even split
+    // chunk i owns the audio in [splits[i], splits[i + 1]) and is decoded with n_overlap extra samples on each side
+    std::vector<int> splits(n_processors + 1);
+
+    splits[0]            = offset_samples;
+    splits[n_processors] = end_samples;
+
+    for (int i = 1; i < n_processors; ++i) {
+        const int center = offset_samples + i*n_samples_per_processor;
+
+        splits[i] = whisper_find_quiet_point(samples, center - n_search, center + n_search);
+    }
+
+    // the states are kept in the context and reused by the next calls
+    while ((int) ctx->parallel_states.size() < n_processors - 1) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            fprintf(stderr, "%s: failed to create a state for the parallel processing\n", __func__);
+            return -7;
+        }
+
+        ctx->parallel_states.push_back(state);
+    }
+
+    std::vector<whisper_state *> states(n_processors);
+    std::vector<int> chunk_begin(n_processors);
+    std::vector<int> chunk_end(n_processors);
+    std::vector<int> rets(n_processors, 0);
 
-        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
-        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+    states[0] = ctx->state;
+    for (int i = 1; i < n_processors; ++i) {
+        states[i] = ctx->parallel_states[i - 1];
+    }
+
+    for (int i = 0; i < n_processors; ++i) {
+        chunk_begin[i] = i == 0                ? splits[i]     : std::max(offset_samples, splits[i] - n_overlap);
+        chunk_end[i]   = i == n_processors - 1 ? splits[i + 1] : std::min(end_samples, splits[i + 1] + n_overlap);
+    }
 
+    auto process_chunk = [&](int i) {
         auto params_cur = params;
 
-        params_cur.offset_ms = 0;
-        params_cur.print_progress = false;
+        params_cur.offset_ms   = 0;
+        params_cur.duration_ms = 0;
+
         params_cur.print_realtime = false;
 
+        // the segments are reported after stitching the chunks
         params_cur.new_segment_callback = nullptr;
         params_cur.new_segment_callback_user_data = nullptr;
 
-        params_cur.progress_callback = nullptr;
-        params_cur.progress_callback_user_data = nullptr;
+        // only the first chunk reports the progress
+        if (i > 0) {
+            params_cur.print_progress = false;
+
+            params_cur.progress_callback = nullptr;
+            params_cur.progress_callback_user_data = nullptr;
+        }
 
-        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+        rets[i] = whisper_full_with_state(ctx, states[i], std::move(params_cur), samples + chunk_begin[i], chunk_end[i] - chunk_begin[i]);
+    };
+
+    // the calling thread will process the first chunk
+    // while the other threads will process the remaining chunks
+    std::vector<std::thread> workers(n_processors - 1);
+    for (int i = 1; i < n_processors; ++i) {
+        workers[i - 1] = std::thread(process_chunk, i);
     }
 
-    {
-        auto params_cur = params;
+    process_chunk(0);
 
-        // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
-        params_cur.print_realtime = false;
+    for (auto & worker : workers) {
+        worker.join();
+    }
 
-        // Run the first transformation using default state but only for the first chunk.
-        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
+    for (int i = 0; i < n_processors; ++i) {
+        if (rets[i] != 0) {
+            ret = rets[i];
+        }
     }
 
-    for (int i = 0; i < n_processors - 1; ++i) {
-        workers[i].join();
+    std::vector<std::vector<whisper_segment>> results(n_processors);
+    for (int i = 0; i < n_processors; ++i) {
+        results[i] = std::move(states[i]->result_all);
+        states[i]->result_all.clear();
     }
 
-    const int64_t offset_t = (int64_t) params.offset_ms/10.0;
+    // stitch the segments of the chunks into the default state
+    // a segment decoded by two chunks has about the same timestamps in both, so each chunk keeps only the segments
+    // whose midpoint is in its own part of the audio
+    auto & result_all = ctx->state->result_all;
 
-    // combine results into result_state->result_all from all other states
-    for (int i = 0; i < n_processors - 1; ++i) {
-        auto& results_i = states[i]->result_all;
+    for (int i = 0; i < n_processors; ++i) {
+        const int64_t t_offset = 100*(int64_t) chunk_begin[i]/WHISPER_SAMPLE_RATE;
+        const int64_t t_split0 = 100*(int64_t) splits[i]/WHISPER_SAMPLE_RATE;
+        const int64_t t_split1 = 100*(int64_t) splits[i + 1]/WHISPER_SAMPLE_RATE;
+        const int64_t t_end    = 100*(int64_t) chunk_end[i]/WHISPER_SAMPLE_RATE;
 
-        for (auto& result : results_i) {
+        for (auto & result : results[i]) {
             // correct the segment timestamp taking into account the offset
-            result.t0 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-            result.t1 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
+            result.t0 += t_offset;
+            result.t1 += t_offset;
+
+            // the decoder can predict timestamps past the end of the chunk
+            result.t1 = std::min(result.t1, t_end);
 
+            if (params.token_timestamps) {
+                for (auto & token : result.tokens) {
+                    token.t0 += t_offset;
+                    token.t1 += t_offset;
+                }
+            }
+
+            const int64_t t_mid = (result.t0 + result.t1)/2;
+
+            if (i > 0 && t_mid < t_split0) {
+                continue;
+            }
+
+            if (i < n_processors - 1 && t_mid >= t_split1) {
+                continue;
+            }
 
             // make sure that segments are not overlapping
-            if (!ctx->state->result_all.empty()) {
-                result.t0 = std::max(result.t0, ctx->state->result_all.back().t1);
+            if (!result_all.empty() && result.t0 < result_all.back().t1) {
+                result.t0 = result_all.back().t1;
+                result.t1 = std::max(result.t1, result.t0);
             }
 
-            ctx->state->result_all.push_back(std::move(result));
+            result_all.push_back(std::move(result));
 
             // call the new_segment_callback for each segment
             if (params.new_segment_callback) {
@@ -4725,13 +6787,18 @@ int whisper_full_parallel(
             }
         }
 
-        ctx->state->t_mel_us += states[i]->t_mel_us;
+        if (i > 0) {
+            ctx->state->t_mel_us += states[i]->t_mel_us;
 
-        ctx->state->t_sample_us += states[i]->t_sample_us;
-        ctx->state->t_encode_us += states[i]->t_encode_us;
-        ctx->state->t_decode_us += states[i]->t_decode_us;
+            ctx->state->t_sample_us += states[i]->t_sample_us;
+            ctx->state->t_encode_us += states[i]->t_encode_us;
+            ctx->state->t_decode_us += states[i]->t_decode_us;
 
-        whisper_free_state(states[i]);
+            states[i]->t_mel_us    = 0;
+            states[i]->t_sample_us = 0;
+            states[i]->t_encode_us = 0;
+            states[i]->t_decode_us = 0;
+        }
     }
 
     // average the timings
@@ -4743,10 +6810,9 @@ int whisper_full_parallel(
     // print information about the audio boundaries
     fprintf(stderr, "\n");
     fprintf(stderr, "%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        fprintf(stderr, "%s: split %d - %s\n", __func__, (i + 1), to_timestamp(100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t).c_str());
+    for (int i = 1; i < n_processors; ++i) {
+        fprintf(stderr, "%s: split %d - %s\n", __func__, i, to_timestamp(100*(int64_t) splits[i]/WHISPER_SAMPLE_RATE).c_str());
     }
-    fprintf(stderr, "%s: the transcription quality may be degraded near these boundaries\n", __func__);
 
     return ret;
 }
@@ -4831,6 +6897,327 @@ float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int
     return ctx->state->result_all[i_segment].tokens[i_token].p;
 }
 
+whisper_result whisper_full_get_result_from_state(struct whisper_context * ctx, struct whisper_state * state) {
+    const auto & result_all = state->result_all;
+
+    auto & segments   = state->result_segments;
+    auto & tokens     = state->result_tokens;
+    auto & token_text = state->result_token_text;
+    auto & text       = state->result_text;
+
+    size_t n_tokens  = 0;
+    size_t text_size = 0;
+
+    for (const auto & segment : result_all) {
+        n_tokens  += segment.tokens.size();
+        text_size += segment.text.size() + 1;
+
+        for (const auto & token : segment.tokens) {
+            text_size += ctx->vocab.id_to_token[token.id].size() + 1;
+        }
+    }
+
+    segments.clear();
+    tokens.clear();
+    token_text.clear();
+    text.clear();
+
+    segments.reserve(result_all.size());
+    tokens.reserve(n_tokens);
+    token_text.reserve(n_tokens);
+    text.reserve(text_size);
+
+    auto push_text = [&text](const std::string & str) {
+        const int32_t offs = text.size();
+        text.insert(text.end(), str.begin(), str.end());
+        text.push_back('\0');
+        return offs;
+    };
+
+    for (const auto & segment : result_all) {
+        segments.push_back({ segment.t0, segment.t1, push_text(segment.text), (int32_t) segment.text.size(), (int32_t) tokens.size(), (int32_t) segment.tokens.size() });
+
+        for (const auto & token : segment.tokens) {
+            tokens.push_back(token);
+            token_text.push_back(push_text(ctx->vocab.id_to_token[token.id]));
+        }
+    }
+
+    return {
+        /*.n_segments =*/ (int) segments.size(),
+        /*.n_tokens   =*/ (int) tokens.size(),
+        /*.segments   =*/ segments.data(),
+        /*.tokens     =*/ tokens.data(),
+        /*.token_text =*/ token_text.data(),
+        /*.text       =*/ text.data(),
+        /*.text_size  =*/ (int) text.size(),
+    };
+}
+
+whisper_result whisper_full_get_result(struct whisper_context * ctx) {
+    return whisper_full_get_result_from_state(ctx, ctx->state);
+}
+
+// =================================================================================================
+
+//
+// State pool
+//
+
+struct whisper_pool_job {
+    int id;
+
+    whisper_full_params params;
+    std::vector<float>  pcmf32;
+
+    whisper_pool_callback callback;
+    void * user_data;
+
+    std::atomic<bool> cancel;
+};
+
+struct whisper_pool {
+    whisper_context * ctx = nullptr;
+
+    std::vector<whisper_state *> states;
+    std::vector<std::thread>     workers;
+
+    // the job currently processed by each worker (nullptr if idle)
+    std::vector<whisper_pool_job *> running;
+
+    std::mutex              mutex;
+    std::condition_variable cv_queue; // a job was queued or the pool is stopping
+    std::condition_variable cv_done;  // a job was done
+
+    std::deque<std::unique_ptr<whisper_pool_job>> queue;
+
+    int n_queue_max = 0;
+    int n_running   = 0;
+    int next_id     = 0;
+
+    bool stop = false;
+};
+
+// chained in front of the encoder_begin_callback of the job, so that cancelled jobs stop at the next window
+static bool whisper_pool_encoder_begin(struct whisper_context * ctx, struct whisper_state * state, void * user_data) {
+    const whisper_pool_job * job = (const whisper_pool_job *) user_data;
+
+    if (job->cancel) {
+        return false;
+    }
+
+    if (job->params.encoder_begin_callback) {
+        return job->params.encoder_begin_callback(ctx, state, job->params.encoder_begin_callback_user_data);
+    }
+
+    return true;
+}
+
+static void whisper_pool_worker(whisper_pool * pool, int i_worker) {
+    whisper_state * state = pool->states[i_worker];
+
+    while (true) {
+        std::unique_ptr<whisper_pool_job> job;
+
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->cv_queue.wait(lock, [pool] { return pool->stop || !pool->queue.empty(); });
+
+            if (pool->queue.empty()) {
+                break;
+            }
+
+            job = std::move(pool->queue.front());
+            pool->queue.pop_front();
+
+            pool->running[i_worker] = job.get();
+            pool->n_running++;
+        }
+
+        whisper_full_params params = job->params;
+
+        params.encoder_begin_callback           = whisper_pool_encoder_begin;
+        params.encoder_begin_callback_user_data = job.get();
+
+        int result = whisper_full_with_state(pool->ctx, state, params, job->pcmf32.data(), job->pcmf32.size());
+
+        if (job->cancel) {
+            result = WHISPER_POOL_CANCELLED;
+        }
+
+        if (job->callback) {
+            job->callback(pool->ctx, state, job->id, result, job->user_data);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+
+            pool->running[i_worker] = nullptr;
+            pool->n_running--;
+        }
+
+        pool->cv_done.notify_all();
+    }
+}
+
+struct whisper_pool * whisper_pool_init(struct whisper_context * ctx, int n_states, int n_queue_max) {
+    if (n_states < 1) {
+        fprintf(stderr, "%s: invalid number of states: %d\n", __func__, n_states);
+        return nullptr;
+    }
+
+    whisper_pool * pool = new whisper_pool;
+
+    pool->ctx         = ctx;
+    pool->n_queue_max = std::max(0, n_queue_max);
+
+    for (int i = 0; i < n_states; ++i) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            fprintf(stderr, "%s: failed to create state %d\n", __func__, i);
+            for (auto & s : pool->states) {
+                whisper_free_state(s);
+            }
+            delete pool;
+            return nullptr;
+        }
+
+        pool->states.push_back(state);
+    }
+
+    pool->running.resize(n_states, nullptr);
+
+    for (int i = 0; i < n_states; ++i) {
+        pool->workers.emplace_back(whisper_pool_worker, pool, i);
+    }
+
+    return pool;
+}
+
+void whisper_pool_free(struct whisper_pool * pool) {
+    if (pool == nullptr) {
+        return;
+    }
+
+    std::deque<std::unique_ptr<whisper_pool_job>> cancelled;
+
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+
+        pool->stop = true;
+
+        cancelled.swap(pool->queue);
+
+        for (auto job : pool->running) {
+            if (job) {
+                job->cancel = true;
+            }
+        }
+    }
+
+    pool->cv_queue.notify_all();
+
+    for (auto & job : cancelled) {
+        if (job->callback) {
+            job->callback(pool->ctx, nullptr, job->id, WHISPER_POOL_CANCELLED, job->user_data);
+        }
+    }
+
+    for (auto & worker : pool->workers) {
+        worker.join();
+    }
+
+    for (auto & state : pool->states) {
+        whisper_free_state(state);
+    }
+
+    delete pool;
+}
+
+int whisper_pool_submit(
+        struct whisper_pool * pool,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        whisper_pool_callback callback,
+        void * user_data) {
+    if (samples == nullptr || n_samples <= 0) {
+        fprintf(stderr, "%s: no audio samples\n", __func__);
+        return -2;
+    }
+
+    std::unique_ptr<whisper_pool_job> job(new whisper_pool_job);
+
+    job->params    = params;
+    job->pcmf32.assign(samples, samples + n_samples);
+    job->callback  = callback;
+    job->user_data = user_data;
+    job->cancel    = false;
+
+    int id;
+
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+
+        if (pool->stop || (pool->n_queue_max > 0 && (int) pool->queue.size() >= pool->n_queue_max)) {
+            return -1;
+        }
+
+        id = job->id = pool->next_id++;
+
+        pool->queue.push_back(std::move(job));
+    }
+
+    pool->cv_queue.notify_one();
+
+    return id;
+}
+
+bool whisper_pool_cancel(struct whisper_pool * pool, int job_id) {
+    std::unique_ptr<whisper_pool_job> job;
+
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+
+        for (auto running : pool->running) {
+            if (running && running->id == job_id) {
+                running->cancel = true;
+                return true;
+            }
+        }
+
+        for (auto it = pool->queue.begin(); it != pool->queue.end(); ++it) {
+            if ((*it)->id == job_id) {
+                job = std::move(*it);
+                pool->queue.erase(it);
+                break;
+            }
+        }
+    }
+
+    if (!job) {
+        return false;
+    }
+
+    if (job->callback) {
+        job->callback(pool->ctx, nullptr, job->id, WHISPER_POOL_CANCELLED, job->user_data);
+    }
+
+    pool->cv_done.notify_all();
+
+    return true;
+}
+
+void whisper_pool_wait(struct whisper_pool * pool) {
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->cv_done.wait(lock, [pool] { return pool->queue.empty() && pool->n_running == 0; });
+}
+
+int whisper_pool_n_pending(struct whisper_pool * pool) {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    return (int) pool->queue.size() + pool->n_running;
+}
+
 // =================================================================================================
 
 //
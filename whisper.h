@@ -87,6 +87,30 @@ extern "C" {
         float vlen;        // voice length of the token
     } whisper_token_data;
 
+    typedef struct whisper_segment_data {
+        int64_t t0;        // start time of the segment
+        int64_t t1;        //   end time of the segment
+
+        int32_t text;      // offset of the text of the segment in whisper_result::text
+        int32_t text_len;  // length of the text of the segment in bytes
+
+        int32_t i_token;   // index of the first token of the segment in whisper_result::tokens
+        int32_t n_tokens;  // number of tokens of the segment
+    } whisper_segment_data;
+
+    // all the segments and tokens of a result in contiguous arrays
+    typedef struct whisper_result {
+        int n_segments;
+        int n_tokens;
+
+        const whisper_segment_data * segments;   // [n_segments]
+        const whisper_token_data   * tokens;     // [n_tokens]
+        const int32_t              * token_text; // [n_tokens] offset of the text of each token in text
+
+        const char * text;                       // UTF-8 arena with the NUL-terminated texts
+        int          text_size;                  // size of the arena in bytes
+    } whisper_result;
+
     typedef struct whisper_model_loader {
         void * context;
 
@@ -95,16 +119,34 @@ extern "C" {
         void  (*close)(void * ctx);
     } whisper_model_loader;
 
+    // Parameters for the whisper_init_from_file_with_params() functions
+    struct whisper_context_params {
+        // map the model file into memory and use the weights in place, instead of reading them
+        // NOTE: model files written before the aligned tensor data (see models/README.md) are mapped in place only on
+        //       x86 and arm64. on other targets most of their weights are copied to private memory, so mmap saves little
+        //       memory and use_mlock does not cover the copies. convert or quantize the model again to avoid this
+        bool use_mmap;
+        bool use_mlock; // with use_mmap, lock the model in memory so that it is never paged out
+        bool prefetch;  // with use_mmap, ask the OS to start reading the whole model file ahead
+        bool kv_q8_0;   // store the K caches of the self- and cross-attention in Q8_0 (the V caches stay in F16)
+        bool repack;    // interleave the rows of the Q4_0/Q8_0 weight matrices at load time for faster decoding (ignored with use_mmap)
+        bool flash_attn; // compute the attention with ggml_flash_attn_ext instead of storing the KQ matrices (less memory for the encoder)
+    };
+
+    WHISPER_API struct whisper_context_params whisper_context_default_params(void);
+
     // Various functions for loading a ggml whisper model.
     // Allocate (almost) all memory needed for the model.
     // Return NULL on failure
     WHISPER_API struct whisper_context * whisper_init_from_file(const char * path_model);
+    WHISPER_API struct whisper_context * whisper_init_from_file_with_params(const char * path_model, struct whisper_context_params params);
     WHISPER_API struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size);
     WHISPER_API struct whisper_context * whisper_init(struct whisper_model_loader * loader);
 
     // These are the same as the above, but the internal state of the context is not allocated automatically
     // It is the responsibility of the caller to allocate the state using whisper_init_state() (#523)
     WHISPER_API struct whisper_context * whisper_init_from_file_no_state(const char * path_model);
+    WHISPER_API struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params);
     WHISPER_API struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size);
     WHISPER_API struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader);
 
@@ -164,6 +206,41 @@ extern "C" {
                                int   n_len,
                                int   n_mel);
 
+    // Incremental log mel spectrogram of a continuous audio stream.
+    // Appends RAW PCM audio to the stream of the default state and computes only the mel frames that became complete.
+    // The frames of the last 60 seconds of the stream are kept in the state.
+    // Returns 0 on success
+    WHISPER_API int whisper_mel_stream_append(
+            struct whisper_context * ctx,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_threads);
+
+    WHISPER_API int whisper_mel_stream_append_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_threads);
+
+    // Set the log mel spectrogram of the state to the last n_samples of the stream.
+    // The start of the window is aligned down to a multiple of WHISPER_HOP_LENGTH samples, and the result is
+    // the same as calling whisper_pcm_to_mel() on the aligned window.
+    // Afterwards, call whisper_full_from_mel() to transcribe the window.
+    // Returns 0 on success
+    WHISPER_API int whisper_mel_stream_window(
+            struct whisper_context * ctx,
+                               int   n_samples);
+
+    WHISPER_API int whisper_mel_stream_window_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                               int   n_samples);
+
+    // Drop all audio of the stream
+    WHISPER_API void whisper_mel_stream_reset(struct whisper_context * ctx);
+    WHISPER_API void whisper_mel_stream_reset_with_state(struct whisper_context * ctx, struct whisper_state * state);
+
     // Run the Whisper encoder on the log mel spectrogram stored inside the default state in the provided whisper context.
     // Make sure to call whisper_pcm_to_mel() or whisper_set_mel() first.
     // offset can be used to specify the offset of the first frame in the spectrogram.
@@ -357,6 +434,11 @@ extern "C" {
         // note: these can significantly reduce the quality of the output
         bool speed_up;          // speed-up the audio by 2x using Phase Vocoder
         int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        bool audio_ctx_auto;    // size the audio context to the audio in each window (when audio_ctx is 0)
+
+        // skip the silent regions of the audio with a voice activity detection on the mel spectrogram
+        bool  vad;
+        float vad_thold;        // speech threshold, relative to the energy range of the audio (0.0 - 1.0)
 
         // tokens to provide to the whisper decoder as initial prompt
         // these are prepended to any existing text context from a previous call
@@ -367,6 +449,7 @@ extern "C" {
         // for auto-detection, set to nullptr, "" or "auto"
         const char * language;
         bool detect_language;
+        int  detect_language_n_windows; // number of 30 s windows over which the language probabilities are averaged
 
         // common decoding parameters:
         bool suppress_blank;    // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/decoding.py#L89
@@ -393,6 +476,15 @@ extern "C" {
             float patience; // TODO: not implemented, ref: https://arxiv.org/pdf/2204.05424.pdf
         } beam_search;
 
+        // speculative decoding, used for greedy sampling at temperature 0
+        // a smaller model with the same vocabulary (e.g. tiny or base) proposes up to n_draft tokens that are
+        // verified with a single decoder pass of the main model. the output is the same as without a draft model
+        // each state keeps its own state for the draft model, so one draft context can serve several states
+        struct {
+            struct whisper_context * ctx; // nullptr to disable
+            int n_draft;                  // max number of tokens proposed per decoder pass (at most 16)
+        } draft;
+
         // called for every newly generated text segment
         whisper_new_segment_callback new_segment_callback;
         void * new_segment_callback_user_data;
@@ -430,11 +522,25 @@ extern "C" {
                            const float * samples,
                                    int   n_samples);
 
+    // Same as whisper_full(), but transcribes the log mel spectrogram already stored in the state
+    // (see whisper_set_mel() and whisper_mel_stream_window()) instead of computing it from PCM samples.
+    // This is not supported with speed_up.
+    WHISPER_API int whisper_full_from_mel(
+                struct whisper_context * ctx,
+            struct whisper_full_params   params);
+
+    WHISPER_API int whisper_full_from_mel_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params);
+
     // Split the input audio in chunks and process each chunk separately using whisper_full_with_state()
+    // The audio is split at the quietest point near each even split, and each chunk is decoded with a small overlap
+    // into its neighbours. The segments of the chunks are stitched by their timestamps: a segment decoded in an
+    // overlap is kept only by the chunk that owns the audio at its midpoint.
     // Result is stored in the default state of the context
+    // The states of the other chunks are kept in the context and reused by the next calls.
     // Not thread safe if executed in parallel on the same context.
-    // It seems this approach can offer some speedup in some cases.
-    // However, the transcription accuracy can be worse at the beginning and end of each chunk.
     WHISPER_API int whisper_full_parallel(
                 struct whisper_context * ctx,
             struct whisper_full_params   params,
@@ -484,6 +590,76 @@ extern "C" {
     WHISPER_API float whisper_full_get_token_p           (struct whisper_context * ctx, int i_segment, int i_token);
     WHISPER_API float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token);
 
+    // Get all the segments and tokens of the result at once
+    // The arrays are owned by the state and are valid until the next call to whisper_full*() or to this function
+    // with the same state
+    WHISPER_API whisper_result whisper_full_get_result           (struct whisper_context * ctx);
+    WHISPER_API whisper_result whisper_full_get_result_from_state(struct whisper_context * ctx, struct whisper_state * state);
+
+    ////////////////////////////////////////////////////////////////////////////
+
+    // State pool
+    //
+    // Runs whisper_full_with_state() for many concurrent requests on a single whisper_context.
+    // The pool owns a fixed number of states and one worker thread per state, so the weights are loaded once and
+    // the memory usage does not depend on the number of requests. Requests wait in a queue until a state is free.
+    //
+    // Basic usage:
+    //
+    //     struct whisper_context * ctx  = whisper_init_from_file_no_state("/path/to/ggml-base.en.bin");
+    //     struct whisper_pool    * pool = whisper_pool_init(ctx, 4, 64);
+    //
+    //     const int job_id = whisper_pool_submit(pool, wparams, pcmf32.data(), pcmf32.size(), on_done, user_data);
+    //
+    //     ...
+    //
+    //     whisper_pool_free(pool);
+    //     whisper_free(ctx);
+    //
+    // The functions below are thread-safe. The context must not be used for anything else while the pool exists.
+
+    struct whisper_pool;
+
+    // Passed as result to the pool callback for jobs that were cancelled
+    #define WHISPER_POOL_CANCELLED -100
+
+    // Called from a worker thread when a job is done
+    // result is the return value of whisper_full_with_state(), or WHISPER_POOL_CANCELLED
+    // The results can be read from the state with the whisper_full_*_from_state() functions until the callback returns
+    // state is NULL if the job was cancelled before it started
+    typedef void (*whisper_pool_callback)(struct whisper_context * ctx, struct whisper_state * state, int job_id, int result, void * user_data);
+
+    // Create n_states states and their worker threads
+    // At most n_queue_max jobs wait in the queue (0 - unbounded)
+    // Return NULL on failure
+    WHISPER_API struct whisper_pool * whisper_pool_init(struct whisper_context * ctx, int n_states, int n_queue_max);
+
+    // Cancel the queued jobs, wait for the running jobs to stop and free the states
+    WHISPER_API void whisper_pool_free(struct whisper_pool * pool);
+
+    // Queue the audio for processing with the given parameters
+    // The samples are copied, but the strings referenced by params (language, initial_prompt, ...) must stay valid
+    // until the callback is called
+    // Return the id of the job (>= 0), -1 if the queue is full or -2 if there are no samples
+    WHISPER_API int whisper_pool_submit(
+                   struct whisper_pool * pool,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples,
+                 whisper_pool_callback   callback,
+                                  void * user_data);
+
+    // Cancel a job. A queued job is removed and its callback is called from the calling thread.
+    // A running job stops before encoding the next 30 second window and reports WHISPER_POOL_CANCELLED.
+    // Return false if the job is unknown or already done
+    WHISPER_API bool whisper_pool_cancel(struct whisper_pool * pool, int job_id);
+
+    // Block until the queue is empty and no job is running
+    WHISPER_API void whisper_pool_wait(struct whisper_pool * pool);
+
+    // Number of queued and running jobs
+    WHISPER_API int whisper_pool_n_pending(struct whisper_pool * pool);
+
     ////////////////////////////////////////////////////////////////////////////
 
     // Temporary helpers needed for exposing ggml interface